@@ -18,4 +18,77 @@
 #ifndef ANP_NETSTACK_ANPNETSTACK_H
 #define ANP_NETSTACK_ANPNETSTACK_H
 
+#include <stdint.h>
+
+// occupancy of the receive descriptor ring of one device queue, to size ANP_RX_RING_SIZE
+struct anp_rx_ring_stats {
+    uint32_t size;          // descriptors in the ring
+    uint32_t free;          // descriptors not holding a packet right now
+    uint32_t low_water;     // the fewest free descriptors ever seen
+    uint64_t allocs;        // frames received into a ring buffer
+    uint64_t misses;        // frames that found the ring empty and were heap allocated
+};
+
+int anp_rx_ring_stats(int queue, struct anp_rx_ring_stats *stats);
+
+#define ANP_TX_BURST_BUCKETS 8
+
+// the transmit queue of the external device, to size ANP_TX_QUEUE_SIZE and ANP_TX_BURST
+struct anp_tx_queue_stats {
+    uint32_t size;          // frames the queue holds
+    uint32_t depth;         // frames waiting right now
+    uint32_t max_depth;     // the most frames ever seen waiting
+    uint64_t enqueued;      // frames put on the queue
+    uint64_t drops;         // frames that found the queue full
+    uint64_t errors;        // frames the device did not take
+    uint64_t bursts;        // times the TX thread handed frames to the device
+    uint64_t burst_sizes[ANP_TX_BURST_BUCKETS]; // bursts of 1, 2-3, 4-7, ... frames
+};
+
+int anp_tx_queue_stats(struct anp_tx_queue_stats *stats);
+
+// header-only, mtu, jumbo and 64KB (GSO) subuffs, see ANP_SUB_POOL_*_SIZE
+#define ANP_SUB_POOL_CLASSES 4
+
+// one size class of the subuff pool
+struct anp_sub_pool_stats {
+    uint32_t size;          // buffer bytes of a subuff of the class
+    uint64_t allocs;        // alloc_sub() calls
+    uint64_t frees;         // free_sub() calls
+    uint64_t hits;          // allocations served from a thread's or the shared cache
+    uint64_t misses;        // allocations that went to malloc()
+    uint64_t in_use;        // allocated and not freed yet, a steady climb is a leak
+    uint64_t objects;       // subuffs that exist, in use or cached
+    uint64_t high_water;    // the most subuffs that ever existed at once
+};
+
+int anp_sub_pool_stats(int idx, struct anp_sub_pool_stats *stats);
+
+// the pcapng capture (ANP_CAPTURE), to size ANP_CAPTURE_RING_BYTES and pick a sampling rate
+struct anp_capture_stats {
+    uint32_t rings;         // threads that captured
+    uint64_t captured;      // frames put in a ring
+    uint64_t drops;         // frames that found their ring full
+    uint64_t written;       // frames in the file
+    uint64_t bytes;         // size of the file
+};
+
+int anp_capture_stats(struct anp_capture_stats *stats);
+
+// the table tcp_rx() finds connections in, sockets / buckets is its load factor
+struct anp_sock_hash_stats {
+    uint32_t buckets;
+    uint32_t sockets;
+    uint32_t max_chain;     // sockets in the fullest bucket
+    uint64_t resizes;
+    uint64_t lookups;
+    uint64_t probes;        // sockets compared, probes / lookups is the mean probe length
+};
+
+int anp_sock_hash_stats(struct anp_sock_hash_stats *stats);
+
+// ids lo..hi of send(..., MSG_ZEROCOPY) calls on fd whose buffer is free again, 1 when there
+// was a range, 0 when nothing completed since the last call, -1 and errno on errors
+int anp_zerocopy_completion(int fd, uint32_t *lo, uint32_t *hi);
+
 #endif //ANP_NETSTACK_ANPNETSTACK_H
@@ -22,13 +22,29 @@
 #include "subuff.h"
 #include "utilities.h"
 #include "tap_netdev.h"
+#include "packet_netdev.h"
+#include "xdp_netdev.h"
+#include "loop_netdev.h"
 #include "config.h"
 #include "arp.h"
 #include "ip.h"
+#include "tcp.h"
+#include "rx_ring.h"
+#include "tx_queue.h"
+#include "epoch.h"
+#include "capture.h"
+#include "anpnetstack.h"
 
 struct anp_netdev *cdev_lo;
 struct anp_netdev *cdev_ext;
-volatile bool stop;
+extern volatile bool stop;
+
+static const struct netdev_ops *netdev_backends[] = {
+    &tap_netdev_ops,
+    &tap_uring_netdev_ops,
+    &packet_netdev_ops,
+    &xdp_netdev_ops,
+};
 
 static struct anp_netdev *netdev_alloc(char *addr, char *hwaddr, uint32_t mtu)
 {
@@ -49,10 +65,85 @@ static struct anp_netdev *netdev_alloc(char *addr, char *hwaddr, uint32_t mtu)
     return dev;
 }
 
+// ANP_NETDEV in the environment picks the backend, otherwise it is ANP_NETDEV_BACKEND.
+// NULL for "none", the external device then stays down.
+static const struct netdev_ops *netdev_find_backend()
+{
+    const char *name = getenv("ANP_NETDEV");
+    if (NULL == name) {
+        name = ANP_NETDEV_BACKEND;
+    }
+    if (0 == strcmp(name, "none")) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(netdev_backends) / sizeof(netdev_backends[0]); i++) {
+        if (0 == strcmp(name, netdev_backends[i]->name)) {
+            return netdev_backends[i];
+        }
+    }
+    printf("Error: unknown netdev backend %s \n", name);
+    exit(-EINVAL);
+}
+
+static void netdev_open(struct anp_netdev *dev, const struct netdev_ops *ops)
+{
+    dev->ops = ops;
+    int ret = ops->open(dev);
+    if (0 != ret) {
+        printf("Error: opening the %s device failed, ret %d \n", ops->name, ret);
+        exit(-ret);
+    }
+    // the buffers rx_burst() receives into, one ring for every queue. Backends that receive
+    // into memory of their own (xdp) have set them up already.
+    for (int i = 0; i < dev->num_queues; i++) {
+        dev->queues[i].dev = dev;
+        dev->queues[i].id = i;
+        if (dev->rx_rings[i]) {
+            continue;
+        }
+        dev->rx_rings[i] = rx_ring_alloc(ANP_RX_RING_SIZE, dev->rx_buf_size);
+        if (!dev->rx_rings[i]) {
+            exit(-ENOMEM);
+        }
+    }
+    if (ANP_TX_QUEUE_SIZE > 0 && !(dev->features & NETDEV_F_LLTX)) {
+        dev->txq = tx_queue_alloc(dev, ANP_TX_QUEUE_SIZE);
+        if (!dev->txq) {
+            exit(-ENOMEM);
+        }
+    }
+    capture_add_dev(dev, ops->name);
+    printf("OK: %s device with %d queue(s), mtu %u, features 0x%x \n", ops->name, dev->num_queues,
+           dev->mtu, dev->features);
+}
+
+// ANP_MTU in the environment, otherwise the compile time ANP_MTU
+static uint32_t netdev_find_mtu()
+{
+    const char *str = getenv("ANP_MTU");
+    if (NULL == str) {
+        return ANP_MTU;
+    }
+    unsigned long mtu = strtoul(str, NULL, 10);
+    // 68 is the smallest mtu IPv4 allows, an IP packet can not be larger than 65535
+    if (mtu < 68 || mtu > 65535) {
+        printf("Error: mtu %s is out of range, using %d \n", str, ANP_MTU);
+        return ANP_MTU;
+    }
+    return mtu;
+}
+
 void client_netdev_init()
 {
-    cdev_ext = netdev_alloc(ANP_IP_CLIENT_EXT, ANP_MAC_CLIENT_EXT, ANP_MTU_15);
-    cdev_lo = netdev_alloc(ANP_IP_LO, ANP_MAC_CLIENT_LO, ANP_MTU_15);
+    cdev_ext = netdev_alloc(ANP_IP_CLIENT_EXT, ANP_MAC_CLIENT_EXT, netdev_find_mtu());
+    cdev_lo = netdev_alloc(ANP_IP_LO, ANP_MAC_CLIENT_LO, ANP_MTU_65K);
+    const struct netdev_ops *ops = netdev_find_backend();
+    if (ops) {
+        netdev_open(cdev_ext, ops);
+    } else {
+        printf("OK: no external device, only %s is reachable \n", ANP_IP_LO);
+    }
+    netdev_open(cdev_lo, &loop_netdev_ops);
 }
 
 
@@ -80,17 +171,80 @@ static int get_mac(const char *iface, uint8_t *mac)
 }
 
 
+/*
+ * Picks the device queue for an outgoing frame. All frames of one flow must leave on the same
+ * queue: the tun driver remembers on which queue it last saw a flow (tun_flow_update) and
+ * steers the incoming packets of that flow back to it, so the flow is then only ever
+ * processed by one RX thread and stays in order. Non-IP frames (ARP) go over queue 0.
+ */
+static int netdev_tx_queue(struct anp_netdev *dev, struct subuff *sub, uint16_t ethertype)
+{
+    if (dev->num_queues < 2 || ethertype != ETH_P_IP) {
+        return 0;
+    }
+    struct iphdr *ih = (struct iphdr *) (sub->data + ETH_HDR_LEN);
+    uint32_t hash = ih->saddr ^ ih->daddr;
+    if (ih->proto == IPP_TCP) {
+        struct tcp_hdr *th = (struct tcp_hdr *) ((uint8_t *) ih + ih->ihl * 4);
+        // xor keeps the hash symmetric, both directions of a flow hash the same
+        hash ^= th->sport ^ th->dport;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash % dev->num_queues;
+}
+
+// finishes a CHECKSUM_PARTIAL checksum in software, for devices without NETDEV_F_CSUM
+static void netdev_csum_help(struct subuff *sub)
+{
+    uint8_t *start = sub->head + sub->csum_start;
+    uint16_t *csum = (uint16_t *) (start + sub->csum_offset);
+    // the field holds the pseudo header sum, so summing over it completes the checksum
+    *csum = sub_csum(sub, start - sub->data);
+    sub->ip_summed = CHECKSUM_NONE;
+}
+
+// the caller keeps its reference, the tx queue takes one of its own, so the frame must not
+// be changed until the TX thread has sent it (TCP sends clones of its segments)
+static int netdev_queue_xmit(struct anp_netdev *dev, struct subuff *sub, int queue)
+{
+    sub->tx_queue = queue;
+    return tx_queue_push(dev->txq, sub_get(sub));
+}
+
 int netdev_transmit(struct subuff *sub, uint8_t *dst_hw, uint16_t ethertype)
 {
     struct anp_netdev *dev = sub->dev;
+    if (NULL == dev->ops) {
+        // the external device is down (ANP_NETDEV=none)
+        return -ENETUNREACH;
+    }
     sub_push(sub, ETH_HDR_LEN);
     struct eth_hdr *hdr = (struct eth_hdr *)sub->data;
     int ret = 0;
     memcpy(hdr->dmac, dst_hw, dev->addr_len);
     memcpy(hdr->smac, dev->hwaddr, dev->addr_len);
     hdr->ethertype = htons(ethertype);
-    ret = tdev_write((char *)sub->data, sub->len);
-    return ret;
+    if (sub->gso_size && !(dev->features & NETDEV_F_TSO)) {
+        printf("Error: super-segment of %u bytes on a device without TSO, dropping \n", sub->len);
+        return -EINVAL;
+    }
+    if (sub->ip_summed == CHECKSUM_PARTIAL && !(dev->features & NETDEV_F_CSUM)) {
+        netdev_csum_help(sub);
+    }
+    capture_frame(dev, sub, CAPTURE_OUT);
+    // a queued segment can be acked and freed by the time tx_burst() returns
+    int len = sub->len;
+    if (dev->txq) {
+        ret = netdev_queue_xmit(dev, sub, netdev_tx_queue(dev, sub, ethertype));
+        return ret < 0 ? ret : len;
+    }
+    ret = dev->ops->tx_burst(dev, netdev_tx_queue(dev, sub, ethertype), &sub, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == 1 ? len : -EAGAIN;
 }
 
 static int process_packet(struct subuff *sub)
@@ -114,21 +268,28 @@ static int process_packet(struct subuff *sub)
     return 0;
 }
 
-void *netdev_rx_loop()
+// one of these runs for every device queue, arg is its struct netdev_queue
+void *netdev_rx_loop(void *arg)
 {
     int ret;
+    struct netdev_queue *q = arg;
+    struct anp_netdev *dev = q->dev;
+    int queue = q->id;
+    struct subuff *subs[ANP_RX_BURST];
     while (!stop) {
-        // The max size of ethernet packet over 1500 MTU (including additional headers */
-        // https://searchnetworking.techtarget.com/answer/Minimum-and-maximum-Ethernet-frame-sizes
-        struct subuff *sub = alloc_sub(ANP_MTU_15_MAX_SIZE);
-        ret = tdev_read((char *)sub->data, ANP_MTU_15_MAX_SIZE);
+        ret = dev->ops->rx_burst(dev, queue, subs, ANP_RX_BURST);
         if (ret < 0) {
-            printf("Error in reading the tap device, %d and errno %d \n", ret, errno);
-            free_sub(sub);
+            printf("Error in reading the %s device queue %d, %d \n", dev->ops->name, queue, ret);
             return NULL;
         }
-        // whatever we have received, pass it along
-        process_packet(sub);
+        // whatever we have received, pass it along. The sockets it finds stay valid until
+        // we leave, while waiting for the next burst nothing is held.
+        epoch_enter();
+        for (int i = 0; i < ret; i++) {
+            capture_frame(dev, subs[i], CAPTURE_IN);
+            process_packet(subs[i]);
+        }
+        epoch_exit();
     }
     return NULL;
 }
@@ -137,13 +298,57 @@ struct anp_netdev* netdev_get(uint32_t sip)
 {
     if (cdev_ext->addr == sip) {
         return cdev_ext;
+    } else if (cdev_lo->addr == sip) {
+        return cdev_lo;
     } else {
         return NULL;
     }
 }
 
+int anp_rx_ring_stats(int queue, struct anp_rx_ring_stats *stats)
+{
+    struct rx_ring *ring;
+
+    if (queue < 0 || queue >= ANP_NETDEV_QUEUES || !(ring = cdev_ext->rx_rings[queue]) || !stats) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&ring->lock);
+    stats->size = ring->size;
+    stats->free = ring->tail - ring->head;
+    stats->low_water = ring->low_water;
+    stats->allocs = ring->allocs;
+    stats->misses = ring->misses;
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+int anp_tx_queue_stats(struct anp_tx_queue_stats *stats)
+{
+    if (!cdev_ext->txq || !stats) {
+        return -EINVAL;
+    }
+    tx_queue_stats(cdev_ext->txq, stats);
+    return 0;
+}
+
+int anp_capture_stats(struct anp_capture_stats *stats)
+{
+    if (!capture_on || !stats) {
+        return -EINVAL;
+    }
+    capture_stats(stats);
+    return 0;
+}
+
 void free_netdev()
 {
+    if (cdev_ext->txq) {
+        tx_queue_free(cdev_ext->txq);
+    }
+    if (cdev_ext->ops) {
+        cdev_ext->ops->close(cdev_ext);
+    }
+    cdev_lo->ops->close(cdev_lo);
     free(cdev_lo);
     free(cdev_ext);
 }
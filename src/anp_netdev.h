@@ -20,20 +20,67 @@
 
 #include <stdint.h>
 #include "subuff.h"
+#include "config.h"
 
 struct eth_hdr;
+struct rx_ring;
+struct tx_queue;
+struct anp_netdev;
+
+// device features (offloads)
+#define NETDEV_F_CSUM  0x1 // tx: completes CHECKSUM_PARTIAL checksums
+#define NETDEV_F_TSO   0x2 // tx: segments TCP super-segments (gso_size)
+#define NETDEV_F_GRO   0x4 // rx: may deliver coalesced frames larger than the mtu
+#define NETDEV_F_LLTX  0x8 // tx: tx_burst() is cheap and thread safe, no tx queue needed
+
+/*
+ * What a device backend (tap, AF_PACKET, AF_XDP) implements. open() sets up the device and
+ * fills in num_queues, features and rx_buf_size of the netdev (and rx_rings if the frames
+ * have to land in memory of the backend). It configures the link for the mtu of the netdev,
+ * and lowers the mtu when the device can not carry frames that large. rx_burst() waits up to
+ * ANP_RX_POLL_MSEC for frames on a queue and returns how many subuffs (taken from the rx ring
+ * of that queue, data at the frame and len its length) it put into subs, 0 on a timeout. tx_burst() returns how many of the frames
+ * it took, the caller keeps ownership of the subuffs either way. A frame to send can continue
+ * in the frags of its subuff, sub_to_iovec() and sub_copy_bits() gather it. Both return -errno on errors.
+ */
+struct netdev_ops {
+    const char *name;
+    int (*open)(struct anp_netdev *dev);
+    int (*rx_burst)(struct anp_netdev *dev, int queue, struct subuff **subs, int max);
+    int (*tx_burst)(struct anp_netdev *dev, int queue, struct subuff **subs, int count);
+    void (*close)(struct anp_netdev *dev);
+};
+
+// what the rx thread of a queue gets to work on
+struct netdev_queue {
+    struct anp_netdev *dev;
+    int id;
+};
 
 struct anp_netdev {
     uint32_t addr;
     uint8_t addr_len;
     uint8_t hwaddr[6];
     uint32_t mtu;
+    uint32_t features;
+    // the backend and its private state
+    const struct netdev_ops *ops;
+    void *priv;
+    int num_queues;
+    // largest frame rx_burst() can hand us
+    uint32_t rx_buf_size;
+    struct rx_ring *rx_rings[ANP_NETDEV_QUEUES];
+    struct netdev_queue queues[ANP_NETDEV_QUEUES];
+    // drained by the TX thread of the device, NULL when frames go out on the caller's thread
+    struct tx_queue *txq;
+    // interface index in the capture file
+    uint32_t capture_if;
 };
 
 void client_netdev_init();
 int netdev_transmit(struct subuff *skb, uint8_t *dst, uint16_t ethertype);
 struct anp_netdev* netdev_get(uint32_t sip);
-void *netdev_rx_loop();
+void *netdev_rx_loop(void *arg);
 void free_netdev();
 
 #endif //ANPNETSTACK_ANP_NETDEV_H
@@ -19,6 +19,7 @@
 #define _GNU_SOURCE
 
 #include <dlfcn.h>
+#include <sys/sendfile.h>
 #include "systems_headers.h"
 #include "linklist.h"
 #include "anpwrapper.h"
@@ -27,6 +28,8 @@
 #include "tcp.h"
 #include "config.h"
 #include "cond_wait.h"
+#include "sock_poll.h"
+#include "zerocopy.h"
 
 
 
@@ -40,6 +43,33 @@ static ssize_t (*_recv)(int fd, void *buf, size_t n, int flags) = NULL;
 static int (*_connect)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = NULL;
 static int (*_socket)(int domain, int type, int protocol) = NULL;
 static int (*_close)(int sockfd) = NULL;
+static int (*_bind)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = NULL;
+static int (*_listen)(int sockfd, int backlog) = NULL;
+static int (*_accept)(int sockfd, struct sockaddr *addr, socklen_t *addrlen) = NULL;
+static int (*_accept4)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) = NULL;
+static ssize_t (*_write)(int fd, const void *buf, size_t count) = NULL;
+static ssize_t (*_read)(int fd, void *buf, size_t count) = NULL;
+static ssize_t (*_writev)(int fd, const struct iovec *iov, int iovcnt) = NULL;
+static ssize_t (*_readv)(int fd, const struct iovec *iov, int iovcnt) = NULL;
+static ssize_t (*_sendmsg)(int sockfd, const struct msghdr *msg, int flags) = NULL;
+static ssize_t (*_recvmsg)(int sockfd, struct msghdr *msg, int flags) = NULL;
+static int (*_sendmmsg)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) = NULL;
+static int (*_recvmmsg)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+                        struct timespec *timeout) = NULL;
+static ssize_t (*_sendfile)(int out_fd, int in_fd, off_t *offset, size_t count) = NULL;
+static ssize_t (*_sendfile64)(int out_fd, int in_fd, off64_t *offset, size_t count) = NULL;
+static ssize_t (*_splice)(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+                          unsigned int flags) = NULL;
+static int (*_fcntl)(int fd, int cmd, ...) = NULL;
+static int (*_fcntl64)(int fd, int cmd, ...) = NULL;
+static int (*_getsockopt)(int sockfd, int level, int optname, void *optval, socklen_t *optlen) = NULL;
+static int (*_setsockopt)(int sockfd, int level, int optname, const void *optval, socklen_t optlen) = NULL;
+static int (*_epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event) = NULL;
+static int (*_epoll_pwait)(int epfd, struct epoll_event *events, int maxevents, int timeout,
+                           const sigset_t *sigmask) = NULL;
+static int (*_poll)(struct pollfd *fds, nfds_t nfds, int timeout) = NULL;
+static int (*_select)(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+                      struct timeval *timeout) = NULL;
 
 static int is_socket_supported(int domain, int type, int protocol)
 {
@@ -65,10 +95,11 @@ int socket(int domain, int type, int protocol) {
     if (is_socket_supported(domain, type, protocol)) {
         struct sock *socket = alloc_sock();
 
+        // ENOMEM, or EMFILE if the fd table is full
         if (socket == NULL) {
-            errno = ENOMEM;
             return -1;
         }
+        socket->nonblock = (type & SOCK_NONBLOCK) != 0;
 
         #ifdef M3_DEBUG
                 printf("assigned socket fd: %d\n", socket->fd);
@@ -90,15 +121,28 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
         // call connect, maybe make new thread? no need prob
         ret = tcp_connect(socket);
         if (ret < 0) {
-            printf("failed to send syn\n");
             errno = socket->err;
-            reset_sock(socket);
+            // a connection that exists or is being set up stays as it is
+            if (errno != EISCONN && errno != EALREADY) {
+                printf("failed to send syn\n");
+                reset_sock(socket);
+            }
             goto end;
         }
+        // poll() reports it writable once the handshake is done, SO_ERROR why it failed
+        if (socket->nonblock) {
+            if (__atomic_load_n(&socket->tcp_state, __ATOMIC_ACQUIRE) == TCP_ESTABLISHED) {
+                return 0;
+            }
+            errno = EINPROGRESS;
+            return -1;
+        }
 
         // wait certain amount of time for reply synack
         pthread_mutex_lock(&socket->conds.state_change_mutex);
-        timed_wait_cond(&socket->conds.state_change_cond, &socket->conds.state_change_mutex, 2000000000);
+        // over loopback the handshake may be done already
+        if (socket->tcp_state == TCP_SYN_SENT)
+            timed_wait_cond(&socket->conds.state_change_cond, &socket->conds.state_change_mutex, 2000000000);
 
         pthread_rwlock_rdlock(&socket->rwlock);
         if (socket->tcp_state != TCP_ESTABLISHED) {
@@ -120,11 +164,89 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     return _connect(sockfd, addr, addrlen);
 }
 
+int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        int ret = tcp_bind(socket, addr, addrlen);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _bind(sockfd, addr, addrlen);
+}
+
+int listen(int sockfd, int backlog)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        int ret = tcp_listen(socket, backlog);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _listen(sockfd, backlog);
+}
+
+static void socket_peer_addr(struct sock *socket, struct sockaddr *addr, socklen_t *addrlen)
+{
+    if (addr && addrlen) {
+        struct sockaddr_in peer = {
+            .sin_family = AF_INET,
+            .sin_port = htons(socket->dport),
+            .sin_addr.s_addr = htonl(socket->daddr),
+        };
+        memcpy(addr, &peer, ANP_MIN(*addrlen, sizeof(peer)));
+        *addrlen = sizeof(peer);
+    }
+}
+
+static int socket_accept(struct sock *socket, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    // the fd of a socket is not a kernel fd, SOCK_CLOEXEC has nothing to do
+    if (flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct sock *child = tcp_accept(socket);
+    if (!child) {
+        errno = socket->err;
+        return -1;
+    }
+    child->nonblock = (flags & SOCK_NONBLOCK) != 0;
+    socket_peer_addr(child, addr, addrlen);
+    return child->fd;
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        return socket_accept(socket, addr, addrlen, 0);
+    }
+    // the default path
+    return _accept(sockfd, addr, addrlen);
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        return socket_accept(socket, addr, addrlen, flags);
+    }
+    // the default path
+    return _accept4(sockfd, addr, addrlen, flags);
+}
+
 ssize_t send(int sockfd, const void *buf, size_t len, int flags)
 {
     struct sock *socket = get_sock_by_fd(sockfd);
     if(socket) {
-        int ret = tcp_send(socket, buf, len);
+        int ret = tcp_send(socket, buf, len, flags);
         if (ret < 0) {
             errno = socket->err;
         }
@@ -138,7 +260,7 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags)
 ssize_t recv (int sockfd, void *buf, size_t len, int flags){
     struct sock *socket = get_sock_by_fd(sockfd);
     if(socket) {
-        int ret = tcp_receive(socket, buf, len);
+        int ret = tcp_receive(socket, buf, len, flags);
         if (ret < 0) {
             errno = socket->err;
         }
@@ -149,6 +271,271 @@ ssize_t recv (int sockfd, void *buf, size_t len, int flags){
     return _recv(sockfd, buf, len, flags);
 }
 
+// the stack reads and writes its own kernel fds through these as well, also from the
+// constructors of other libraries that may run before _function_override_init()
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        int ret = tcp_send(socket, buf, count, 0);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    if (!_write) {
+        _write = dlsym(RTLD_NEXT, "write");
+    }
+    return _write(fd, buf, count);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        int ret = tcp_receive(socket, buf, count, 0);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    if (!_read) {
+        _read = dlsym(RTLD_NEXT, "read");
+    }
+    return _read(fd, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        int ret = tcp_sendmsg(socket, iov, iovcnt, 0);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    if (!_writev) {
+        _writev = dlsym(RTLD_NEXT, "writev");
+    }
+    return _writev(fd, iov, iovcnt);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        int ret = tcp_recvmsg(socket, iov, iovcnt, 0);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    if (!_readv) {
+        _readv = dlsym(RTLD_NEXT, "readv");
+    }
+    return _readv(fd, iov, iovcnt);
+}
+
+static size_t msg_length(const struct msghdr *msg)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        len += msg->msg_iov[i].iov_len;
+    }
+    return len;
+}
+
+// a connected stream, msg_name is ignored and there is no control data to send
+static ssize_t socket_sendmsg(struct sock *socket, const struct msghdr *msg, int flags)
+{
+    int ret = tcp_sendmsg(socket, msg->msg_iov, msg->msg_iovlen, flags);
+    if (ret < 0) {
+        errno = socket->err;
+    }
+    return ret;
+}
+
+// MSG_ERRQUEUE has the completions of MSG_ZEROCOPY sends, see zerocopy.c
+static ssize_t socket_recvmsg(struct sock *socket, struct msghdr *msg, int flags)
+{
+    int ret;
+
+    if (flags & MSG_ERRQUEUE) {
+        ret = zc_recv_errqueue(socket, msg);
+    } else {
+        ret = tcp_recvmsg(socket, msg->msg_iov, msg->msg_iovlen, flags);
+        if (ret >= 0) {
+            socket_peer_addr(socket, msg->msg_name, &msg->msg_namelen);
+            msg->msg_controllen = 0;
+            msg->msg_flags = 0;
+        }
+    }
+    if (ret < 0) {
+        errno = socket->err;
+    }
+    return ret;
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        return socket_sendmsg(socket, msg, flags);
+    }
+    // the default path
+    return _sendmsg(sockfd, msg, flags);
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        return socket_recvmsg(socket, msg, flags);
+    }
+    // the default path
+    return _recvmsg(sockfd, msg, flags);
+}
+
+// the messages go one after another into the byte stream, until one does not fit entirely
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        unsigned int i;
+        for (i = 0; i < vlen; i++) {
+            ssize_t ret = socket_sendmsg(socket, &msgvec[i].msg_hdr, flags);
+            if (ret < 0) {
+                return i > 0 ? (int) i : -1;
+            }
+            msgvec[i].msg_len = ret;
+            if ((size_t) ret < msg_length(&msgvec[i].msg_hdr)) {
+                return (int) (i + 1);
+            }
+        }
+        return (int) i;
+    }
+    // the default path
+    return _sendmmsg(sockfd, msgvec, vlen, flags);
+}
+
+// what is left of the recvmmsg timeout in poll() milliseconds, 0 once it ran out
+static int mmsg_time_left(const struct timespec *timeout, const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t left_ns = ((int64_t) timeout->tv_sec - (now.tv_sec - start->tv_sec)) * 1000000000LL
+                      + timeout->tv_nsec - (now.tv_nsec - start->tv_nsec);
+    if (left_ns <= 0) {
+        return 0;
+    }
+    int64_t ms = (left_ns + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int) ms;
+}
+
+// without MSG_WAITFORONE every message waits for data, the timeout bounds all the waits together
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        struct timespec start;
+        if (timeout) {
+            if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000L) {
+                errno = EINVAL;
+                return -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        unsigned int i;
+        for (i = 0; i < vlen; i++) {
+            int msg_flags = flags & ~MSG_WAITFORONE;
+            // wait here for as long as the timeout allows, the receive itself must not block then
+            if (timeout && !socket->nonblock && !(msg_flags & (MSG_DONTWAIT | MSG_ERRQUEUE))) {
+                struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+                int n = sock_poll(&pfd, 1, mmsg_time_left(timeout, &start));
+                if (n <= 0) {
+                    if (n == 0) {
+                        errno = EAGAIN;
+                    }
+                    return i > 0 ? (int) i : -1;
+                }
+                msg_flags |= MSG_DONTWAIT;
+            }
+            ssize_t ret = socket_recvmsg(socket, &msgvec[i].msg_hdr, msg_flags);
+            if (ret < 0) {
+                return i > 0 ? (int) i : -1;
+            }
+            msgvec[i].msg_len = ret;
+            // the end of the stream
+            if (ret == 0 && !(flags & MSG_ERRQUEUE)) {
+                return (int) (i + 1);
+            }
+            if (flags & MSG_WAITFORONE) {
+                flags |= MSG_DONTWAIT;
+            }
+        }
+        return (int) i;
+    }
+    // the default path
+    return _recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    struct sock *socket = get_sock_by_fd(out_fd);
+    if (socket) {
+        ssize_t ret = tcp_sendfile(socket, in_fd, offset, count);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _sendfile(out_fd, in_fd, offset, count);
+}
+
+// what sendfile() calls are compiled to with _FILE_OFFSET_BITS=64, off_t is 64 bits already
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+    struct sock *socket = get_sock_by_fd(out_fd);
+    if (socket) {
+        ssize_t ret = tcp_sendfile(socket, in_fd, (off_t *) offset, count);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _sendfile64(out_fd, in_fd, offset, count);
+}
+
+// only from a pipe into a socket, the data is copied through the send ring
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags)
+{
+    struct sock *socket = get_sock_by_fd(fd_out);
+    if (get_sock_by_fd(fd_in)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (socket) {
+        if (off_in || off_out) {
+            errno = ESPIPE;
+            return -1;
+        }
+        ssize_t ret = tcp_send_fd(socket, fd_in, len, (flags & SPLICE_F_NONBLOCK) || socket->nonblock);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
 int close (int sockfd){
     struct sock *socket = get_sock_by_fd(sockfd);
     if(socket) {
@@ -164,6 +551,144 @@ int close (int sockfd){
     return _close(sockfd);
 }
 
+static int socket_fcntl(struct sock *socket, int cmd, void *arg)
+{
+    int ret = tcp_fcntl(socket, cmd, (long) arg);
+    if (ret < 0) {
+        errno = socket->err;
+    }
+    return ret;
+}
+
+// every argument fcntl() takes, an int or a pointer, is passed on as a pointer
+int fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        return socket_fcntl(socket, cmd, arg);
+    }
+    // the default path
+    if (!_fcntl) {
+        _fcntl = dlsym(RTLD_NEXT, "fcntl");
+    }
+    return _fcntl(fd, cmd, arg);
+}
+
+// what fcntl() calls are compiled to with _FILE_OFFSET_BITS=64
+int fcntl64(int fd, int cmd, ...)
+{
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        return socket_fcntl(socket, cmd, arg);
+    }
+    // the default path
+    if (!_fcntl64) {
+        _fcntl64 = dlsym(RTLD_NEXT, "fcntl64");
+    }
+    return _fcntl64(fd, cmd, arg);
+}
+
+int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        int ret = tcp_getsockopt(socket, level, optname, optval, optlen);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _getsockopt(sockfd, level, optname, optval, optlen);
+}
+
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
+{
+    struct sock *socket = get_sock_by_fd(sockfd);
+    if (socket) {
+        int ret = tcp_setsockopt(socket, level, optname, optval, optlen);
+        if (ret < 0) {
+            errno = socket->err;
+        }
+        return ret;
+    }
+    // the default path
+    return _setsockopt(sockfd, level, optname, optval, optlen);
+}
+
+// sockets go into the epoll set as their eventfds, see sock_poll.c
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    struct sock *socket = get_sock_by_fd(fd);
+    if (socket) {
+        return sock_epoll_ctl(epfd, op, socket, event);
+    }
+    // the default path
+    if (!_epoll_ctl) {
+        _epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+    }
+    return _epoll_ctl(epfd, op, fd, event);
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask)
+{
+    struct timespec start;
+    int n;
+
+    if (!_epoll_pwait) {
+        _epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // events of sockets that are not ready for what was asked are dropped, then wait on
+    do {
+        n = _epoll_pwait(epfd, events, maxevents, sock_poll_timeout(timeout, &start), sigmask);
+        if (n > 0) {
+            n = sock_epoll_filter(epfd, events, n);
+        }
+    } while (n == 0 && sock_poll_timeout(timeout, &start) != 0);
+    return n;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    return epoll_pwait(epfd, events, maxevents, timeout, NULL);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if (sock_poll_any(fds, nfds)) {
+        return sock_poll(fds, nfds, timeout);
+    }
+    // the default path
+    if (!_poll) {
+        _poll = dlsym(RTLD_NEXT, "poll");
+    }
+    return _poll(fds, nfds, timeout);
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout)
+{
+    // sets that small can not hold a socket
+    if (nfds > SOCK_FD_START) {
+        return sock_select(nfds, readfds, writefds, exceptfds, timeout);
+    }
+    // the default path
+    if (!_select) {
+        _select = dlsym(RTLD_NEXT, "select");
+    }
+    return _select(nfds, readfds, writefds, exceptfds, timeout);
+}
+
 void _function_override_init()
 {
     __start_main = dlsym(RTLD_NEXT, "__libc_start_main");
@@ -172,4 +697,27 @@ void _function_override_init()
     _send = dlsym(RTLD_NEXT, "send");
     _recv = dlsym(RTLD_NEXT, "recv");
     _close = dlsym(RTLD_NEXT, "close");
+    _bind = dlsym(RTLD_NEXT, "bind");
+    _listen = dlsym(RTLD_NEXT, "listen");
+    _accept = dlsym(RTLD_NEXT, "accept");
+    _accept4 = dlsym(RTLD_NEXT, "accept4");
+    _write = dlsym(RTLD_NEXT, "write");
+    _read = dlsym(RTLD_NEXT, "read");
+    _writev = dlsym(RTLD_NEXT, "writev");
+    _readv = dlsym(RTLD_NEXT, "readv");
+    _sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+    _recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+    _sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
+    _recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
+    _sendfile = dlsym(RTLD_NEXT, "sendfile");
+    _sendfile64 = dlsym(RTLD_NEXT, "sendfile64");
+    _splice = dlsym(RTLD_NEXT, "splice");
+    _fcntl = dlsym(RTLD_NEXT, "fcntl");
+    _fcntl64 = dlsym(RTLD_NEXT, "fcntl64");
+    _getsockopt = dlsym(RTLD_NEXT, "getsockopt");
+    _setsockopt = dlsym(RTLD_NEXT, "setsockopt");
+    _epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+    _epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+    _poll = dlsym(RTLD_NEXT, "poll");
+    _select = dlsym(RTLD_NEXT, "select");
 }
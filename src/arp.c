@@ -29,6 +29,8 @@
 
 static uint8_t broadcast_hw[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 static LIST_HEAD(arp_cache);
+// the cache is updated from every RX queue thread and read from the TX paths
+static pthread_rwlock_t arp_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 // allocate an ARP packet
 static struct subuff *alloc_arp_sub()
@@ -42,11 +44,13 @@ static struct subuff *alloc_arp_sub()
 static int process_arp_entry(struct arp_hdr *hdr, struct arp_ipv4 *data){
     struct list_head *item;
     struct arp_cache_entry *entry;
+    pthread_rwlock_wrlock(&arp_cache_lock);
     list_for_each(item, &arp_cache) {
         entry = list_entry(item, struct arp_cache_entry, list);
         if (entry->arpIpv4.src_ip == data->src_ip) {
             printf("ARP an entry updated \n");
             memcpy(entry->arpIpv4.src_mac, data->src_mac, 6);
+            pthread_rwlock_unlock(&arp_cache_lock);
             // if it matches we consumed it
             return 0;
         }
@@ -57,6 +61,7 @@ static int process_arp_entry(struct arp_hdr *hdr, struct arp_ipv4 *data){
     entry->state = ARP_RESOLVED;
     memcpy(&entry->arpIpv4, data, sizeof(*data));
     list_add_tail(&entry->list, &arp_cache);
+    pthread_rwlock_unlock(&arp_cache_lock);
     u32_ip_to_str("[ARP] A new entry for", data->src_ip);
     broadcast_cond(&arp_entry_cond);
     debug_arp_payload("original ", data);
@@ -207,29 +212,36 @@ void arp_reply(struct subuff *sub, struct anp_netdev *netdev)
  * Returns the HW address of the given source IP address
  * NULL if not found
  */
-unsigned char* arp_get_hwaddr(uint32_t lookup_ip)
+// copies the address out under the lock, a reply can overwrite the entry at any time
+int arp_get_hwaddr(uint32_t lookup_ip, uint8_t *hwaddr)
 {
     struct list_head *item;
     struct arp_cache_entry *entry;
+    int ret = -1;
+    pthread_rwlock_rdlock(&arp_cache_lock);
     list_for_each(item, &arp_cache) {
         entry = list_entry(item, struct arp_cache_entry, list);
         if (entry->state == ARP_RESOLVED &&
             entry->arpIpv4.src_ip == lookup_ip) {
-            uint8_t *copy = (uint8_t *) &entry->arpIpv4.src_mac;
-            return copy;
+            memcpy(hwaddr, entry->arpIpv4.src_mac, sizeof(entry->arpIpv4.src_mac));
+            ret = 0;
+            break;
         }
     }
-    // no entry found
-    return NULL;
+    pthread_rwlock_unlock(&arp_cache_lock);
+    // -1 if no entry found
+    return ret;
 }
 
 void free_arp_cache()
 {
     struct list_head *item, *tmp;
     struct arp_cache_entry *entry;
+    pthread_rwlock_wrlock(&arp_cache_lock);
     list_for_each_safe(item, tmp, &arp_cache) {
         entry = list_entry(item, struct arp_cache_entry, list);
         list_del(item);
         free(entry);
     }
+    pthread_rwlock_unlock(&arp_cache_lock);
 }
@@ -105,7 +105,7 @@ void free_arp();
 void arp_rx(struct subuff *skb);
 void arp_reply(struct subuff *skb, struct anp_netdev *netdev);
 int arp_request(uint32_t src_ip, uint32_t dst_ip, struct anp_netdev *netdev);
-unsigned char* arp_get_hwaddr(uint32_t src_ip);
+int arp_get_hwaddr(uint32_t src_ip, uint8_t *hwaddr);
 
 static inline struct arp_hdr *arp_hdr(struct subuff *sub)
 {
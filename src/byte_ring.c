@@ -0,0 +1,81 @@
+#include "byte_ring.h"
+#include "utilities.h"
+
+int byte_ring_init(struct byte_ring *ring, uint32_t size)
+{
+    // the indices are free running, a power of two size lets them wrap around
+    assert((size & (size - 1)) == 0);
+
+    ring->buf = malloc(size);
+    if (!ring->buf) {
+        printf("Error: byte ring of %u bytes could not be allocated \n", size);
+        return -ENOMEM;
+    }
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    return 0;
+}
+
+void byte_ring_destroy(struct byte_ring *ring)
+{
+    free(ring->buf);
+    ring->buf = NULL;
+    ring->size = 0;
+}
+
+// moves what the ring holds into a buffer of size bytes (a power of two, no less than what
+// it holds), neither side may use it meanwhile
+int byte_ring_resize(struct byte_ring *ring, uint32_t size)
+{
+    uint32_t used = byte_ring_used(ring);
+    assert((size & (size - 1)) == 0 && size >= used);
+
+    uint8_t *buf = malloc(size);
+    if (!buf) {
+        printf("Error: byte ring of %u bytes could not be allocated \n", size);
+        return -ENOMEM;
+    }
+    byte_ring_read(ring, buf, used);
+    free(ring->buf);
+    ring->buf = buf;
+    ring->size = size;
+    ring->head = used;
+    ring->tail = 0;
+    return 0;
+}
+
+// drops whatever is in the ring, neither side may use it meanwhile
+void byte_ring_reset(struct byte_ring *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// copies as much of data as fits, at most two memcpy()s when it wraps around the end
+uint32_t byte_ring_write(struct byte_ring *ring, const void *data, uint32_t len)
+{
+    uint32_t head = ring->head;
+    uint32_t off = head & (ring->size - 1);
+
+    len = ANP_MIN(len, byte_ring_free(ring));
+    uint32_t first = ANP_MIN(len, ring->size - off);
+    memcpy(ring->buf + off, data, first);
+    memcpy(ring->buf, (const uint8_t *) data + first, len - first);
+    // the bytes are the reader's once head moves past them
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+uint32_t byte_ring_read(struct byte_ring *ring, void *to, uint32_t len)
+{
+    uint32_t tail = ring->tail;
+    uint32_t off = tail & (ring->size - 1);
+
+    len = ANP_MIN(len, byte_ring_used(ring));
+    uint32_t first = ANP_MIN(len, ring->size - off);
+    memcpy(to, ring->buf + off, first);
+    memcpy((uint8_t *) to + first, ring->buf, len - first);
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
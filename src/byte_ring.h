@@ -0,0 +1,32 @@
+#ifndef ANPNETSTACK_BYTE_RING_H
+#define ANPNETSTACK_BYTE_RING_H
+
+#include "systems_headers.h"
+
+// A ring of bytes, e.g. the data of a socket that the application did not read yet. One
+// thread writes and one reads, head and tail are free running and each has a single writer.
+struct byte_ring {
+    uint8_t *buf;
+    uint32_t size;  // power of two
+    uint32_t head;  // bytes written so far
+    uint32_t tail;  // bytes read so far
+};
+
+int byte_ring_init(struct byte_ring *ring, uint32_t size);
+void byte_ring_destroy(struct byte_ring *ring);
+void byte_ring_reset(struct byte_ring *ring);
+int byte_ring_resize(struct byte_ring *ring, uint32_t size);
+uint32_t byte_ring_write(struct byte_ring *ring, const void *data, uint32_t len);
+uint32_t byte_ring_read(struct byte_ring *ring, void *to, uint32_t len);
+
+static inline uint32_t byte_ring_used(struct byte_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t byte_ring_free(struct byte_ring *ring)
+{
+    return ring->size - byte_ring_used(ring);
+}
+
+#endif //ANPNETSTACK_BYTE_RING_H
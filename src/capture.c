@@ -0,0 +1,286 @@
+/*
+ * Packet capture into a pcapng file, for when the debug printfs are too slow to leave on.
+ * netdev_rx_loop() and netdev_transmit() copy every ANP_CAPTURE_SAMPLE-th frame, cut to
+ * the snap length, into a ring of the calling thread. The capture thread empties the rings
+ * every ANP_CAPTURE_FLUSH_MSEC and writes them out, so the datapath never touches the file.
+ * When a ring is full the frame is dropped (and counted), the datapath does not wait.
+ * ANP_CAPTURE=<file> in the environment turns it on, ANP_CAPTURE_SNAPLEN and
+ * ANP_CAPTURE_SAMPLE override the defaults from config.h.
+ * https://www.ietf.org/archive/id/draft-tuexen-opsawg-pcapng-05.html
+ */
+
+#include "capture.h"
+#include "anp_netdev.h"
+#include "config.h"
+#include "utilities.h"
+#include "ethernet.h"
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_END 0
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_PAD(_len) (((_len) + 3) & ~3u)
+
+extern volatile bool stop;
+
+bool capture_on = false;
+
+static FILE *file;
+static uint32_t snaplen = ANP_CAPTURE_SNAPLEN;
+static uint32_t sample = ANP_CAPTURE_SAMPLE;
+static uint32_t ring_size;
+static uint32_t num_ifs;
+// the rings of all threads, a thread adds its own the first time it captures
+static LIST_HEAD(rings);
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+// serializes writing to the file, the capture thread and capture_add_dev()
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t written;
+static uint64_t bytes;
+
+static __thread struct capture_ring *my_ring;
+
+static int capture_drain();
+
+static uint32_t capture_env(const char *name, uint32_t def, uint32_t min, uint32_t max)
+{
+    const char *str = getenv(name);
+    if (NULL == str) {
+        return def;
+    }
+    unsigned long val = strtoul(str, NULL, 10);
+    if (val < min || val > max) {
+        printf("Error: %s %s is out of range, using %u \n", name, str, def);
+        return def;
+    }
+    return val;
+}
+
+// an option of a block, padded to 32 bits, returns the bytes it takes up
+static uint32_t pcapng_opt(uint8_t *buf, uint16_t code, const void *val, uint16_t len)
+{
+    uint16_t hdr[2] = { code, len };
+    memcpy(buf, hdr, sizeof(hdr));
+    if (len > 0) {
+        memcpy(buf + sizeof(hdr), val, len);
+    }
+    memset(buf + sizeof(hdr) + len, 0, PCAPNG_PAD(len) - len);
+    return sizeof(hdr) + PCAPNG_PAD(len);
+}
+
+static void pcapng_write(const void *block, uint32_t len)
+{
+    fwrite(block, 1, len, file);
+    bytes += len;
+}
+
+// pcapng wants every block to end with its length once more
+static void pcapng_write_block(uint8_t *block, uint32_t len)
+{
+    memcpy(block + 4, &len, sizeof(len));
+    memcpy(block + len - 4, &len, sizeof(len));
+    pcapng_write(block, len);
+}
+
+static void capture_exit()
+{
+    capture_drain();
+}
+
+int capture_init()
+{
+    const char *path = getenv("ANP_CAPTURE");
+    uint8_t shb[28] = { 0 };
+    uint32_t *w = (uint32_t *) shb;
+
+    if (NULL == path) {
+        return 0;
+    }
+    snaplen = capture_env("ANP_CAPTURE_SNAPLEN", ANP_CAPTURE_SNAPLEN, ETH_HDR_LEN, ANP_MTU_65K_MAX_SIZE);
+    sample = capture_env("ANP_CAPTURE_SAMPLE", ANP_CAPTURE_SAMPLE, 1, UINT32_MAX);
+    // as many slots of the snap length as fit ANP_CAPTURE_RING_BYTES, a power of two
+    ring_size = 16;
+    while ((uint64_t) ring_size * 2 * (sizeof(struct capture_rec) + snaplen) <= ANP_CAPTURE_RING_BYTES) {
+        ring_size *= 2;
+    }
+    file = fopen(path, "w");
+    if (NULL == file) {
+        printf("Error: could not open the capture file %s, errno %d \n", path, errno);
+        return -errno;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    // section header, length unknown (-1)
+    w[0] = PCAPNG_SHB;
+    w[2] = PCAPNG_BYTE_ORDER_MAGIC;
+    w[3] = 1;
+    w[4] = w[5] = 0xffffffff;
+    pthread_mutex_lock(&file_lock);
+    pcapng_write_block(shb, sizeof(shb));
+    pthread_mutex_unlock(&file_lock);
+    capture_on = true;
+    atexit(capture_exit);
+    printf("OK: capturing to %s, snaplen %u, 1 in %u frames, %u slots per thread \n", path, snaplen,
+           sample, ring_size);
+    return 0;
+}
+
+// every device gets an interface description block, frames refer to it by its index
+int capture_add_dev(struct anp_netdev *dev, const char *name)
+{
+    uint8_t idb[64 + IFNAMSIZ] = { 0 };
+    uint32_t *w = (uint32_t *) idb;
+    uint32_t len = 16;
+    uint8_t tsresol = 9;
+
+    if (!capture_on) {
+        return 0;
+    }
+    w[0] = PCAPNG_IDB;
+    w[2] = PCAPNG_LINKTYPE_ETHERNET;
+    w[3] = snaplen;
+    len += pcapng_opt(idb + len, PCAPNG_IF_NAME, name, ANP_MIN(strlen(name), IFNAMSIZ));
+    // timestamps are in ns, not the default us
+    len += pcapng_opt(idb + len, PCAPNG_IF_TSRESOL, &tsresol, 1);
+    len += pcapng_opt(idb + len, PCAPNG_OPT_END, NULL, 0);
+    len += 4;
+    pthread_mutex_lock(&file_lock);
+    dev->capture_if = num_ifs++;
+    pcapng_write_block(idb, len);
+    fflush(file);
+    pthread_mutex_unlock(&file_lock);
+    return 0;
+}
+
+static struct capture_ring *capture_ring_alloc()
+{
+    struct capture_ring *ring = calloc(1, sizeof(*ring));
+
+    if (!ring) {
+        return NULL;
+    }
+    ring->size = ring_size;
+    ring->slot_size = (sizeof(struct capture_rec) + snaplen + 7) & ~7u;
+    ring->slots = malloc((size_t) ring->size * ring->slot_size);
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+    list_init(&ring->list);
+    pthread_mutex_lock(&rings_lock);
+    list_add_tail(&ring->list, &rings);
+    pthread_mutex_unlock(&rings_lock);
+    return ring;
+}
+
+void capture_record(struct anp_netdev *dev, struct subuff *sub, int dir)
+{
+    uint32_t len = sub->len;
+    struct capture_ring *ring = my_ring;
+    struct timespec ts;
+
+    if (!ring && !(ring = my_ring = capture_ring_alloc())) {
+        return;
+    }
+    if (++ring->sample < sample) {
+        return;
+    }
+    ring->sample = 0;
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->size) {
+        __atomic_fetch_add(&ring->drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct capture_rec *rec = (struct capture_rec *) (ring->slots + (size_t) (head & (ring->size - 1)) * ring->slot_size);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->len = len;
+    rec->caplen = ANP_MIN(len, snaplen);
+    rec->ifid = dev->capture_if;
+    rec->dir = dir;
+    sub_copy_bits(sub, 0, rec->data, rec->caplen);
+    __atomic_fetch_add(&ring->captured, 1, __ATOMIC_RELAXED);
+    // the slot is the writer's once head moves past it
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// an enhanced packet block, the flags tell inbound from outbound frames
+static void capture_write_rec(struct capture_rec *rec)
+{
+    uint32_t hdr[7] = {
+        PCAPNG_EPB, 0, rec->ifid, rec->ts >> 32, (uint32_t) rec->ts, rec->caplen, rec->len
+    };
+    uint8_t trailer[16];
+    uint32_t pad = 0, len = sizeof(hdr) + PCAPNG_PAD(rec->caplen) + sizeof(trailer);
+    uint32_t tlen = 0;
+
+    hdr[1] = len;
+    pcapng_write(hdr, sizeof(hdr));
+    pcapng_write(rec->data, rec->caplen);
+    pcapng_write(&pad, PCAPNG_PAD(rec->caplen) - rec->caplen);
+    tlen += pcapng_opt(trailer + tlen, PCAPNG_EPB_FLAGS, &rec->dir, sizeof(rec->dir));
+    tlen += pcapng_opt(trailer + tlen, PCAPNG_OPT_END, NULL, 0);
+    memcpy(trailer + tlen, &len, sizeof(len));
+    pcapng_write(trailer, sizeof(trailer));
+}
+
+// writes out what every ring has, returns the number of frames
+static int capture_drain()
+{
+    struct list_head *item;
+    int n = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    pthread_mutex_lock(&file_lock);
+    list_for_each(item, &rings) {
+        struct capture_ring *ring = list_entry(item, struct capture_ring, list);
+        uint32_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        for (; tail != head; tail++, n++) {
+            capture_write_rec((struct capture_rec *) (ring->slots + (size_t) (tail & (ring->size - 1)) * ring->slot_size));
+        }
+        // hands the slots back to the producer
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (n > 0) {
+        written += n;
+        fflush(file);
+    }
+    pthread_mutex_unlock(&file_lock);
+    pthread_mutex_unlock(&rings_lock);
+    return n;
+}
+
+// the capture thread, capture_exit() writes out what is left when the process exits
+void *capture_loop(void *arg __attribute__((unused)))
+{
+    while (!stop) {
+        usleep(ANP_CAPTURE_FLUSH_MSEC * 1000);
+        capture_drain();
+    }
+    capture_drain();
+    return NULL;
+}
+
+void capture_stats(struct anp_capture_stats *stats)
+{
+    struct list_head *item;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&rings_lock);
+    list_for_each(item, &rings) {
+        struct capture_ring *ring = list_entry(item, struct capture_ring, list);
+        stats->captured += __atomic_load_n(&ring->captured, __ATOMIC_RELAXED);
+        stats->drops += __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+        stats->rings++;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    pthread_mutex_lock(&file_lock);
+    stats->written = written;
+    stats->bytes = bytes;
+    pthread_mutex_unlock(&file_lock);
+}
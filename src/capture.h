@@ -0,0 +1,53 @@
+#ifndef ANPNETSTACK_CAPTURE_H
+#define ANPNETSTACK_CAPTURE_H
+
+#include "systems_headers.h"
+#include "linklist.h"
+#include "anpnetstack.h"
+
+struct anp_netdev;
+struct subuff;
+
+#define CAPTURE_IN  1
+#define CAPTURE_OUT 2
+
+// what a producer writes into a slot, followed by caplen bytes of the frame
+struct capture_rec {
+    uint64_t ts;        // ns since the epoch
+    uint32_t len;       // the whole frame
+    uint32_t caplen;    // the part of it that follows
+    uint32_t ifid;
+    uint32_t dir;       // CAPTURE_IN or CAPTURE_OUT
+    uint8_t data[];
+};
+
+// One of these per thread that captures, the thread pushes and the writer pops, so head and
+// tail each have a single writer and no lock is needed.
+struct capture_ring {
+    struct list_head list;
+    uint8_t *slots;
+    uint32_t size;                              // power of two
+    uint32_t slot_size;
+    uint32_t sample;                            // frames since the last sampled one
+    uint32_t head __attribute__((aligned(64))); // next slot to fill, producer only
+    uint32_t tail __attribute__((aligned(64))); // next slot to write out, writer only
+    uint64_t captured;
+    uint64_t drops;
+};
+
+extern bool capture_on;
+
+int capture_init();
+int capture_add_dev(struct anp_netdev *dev, const char *name);
+void capture_record(struct anp_netdev *dev, struct subuff *sub, int dir);
+void *capture_loop(void *arg);
+void capture_stats(struct anp_capture_stats *stats);
+
+// the hot path, a single predictable branch while the capture is off
+#define capture_frame(_dev, _sub, _dir)                                 \
+    do {                                                                \
+        if (__builtin_expect(capture_on, 0))                            \
+            capture_record(_dev, _sub, _dir);                           \
+    } while (0)
+
+#endif //ANPNETSTACK_CAPTURE_H
@@ -35,7 +35,126 @@
 #define ANP_MTU_9K   9000
 
 //https://searchnetworking.techtarget.com/answer/Minimum-and-maximum-Ethernet-frame-sizes
-#define ANP_MTU_15_MAX_SIZE 1522
+// the largest Ethernet frame for an mtu, header, vlan tag and fcs included
+#define ANP_FRAME_SIZE(_mtu) ((_mtu) + 22)
+#define ANP_MTU_15_MAX_SIZE ANP_FRAME_SIZE(ANP_MTU_15)
+// the largest (GSO) frame the tap device hands us when segmentation offloads are on
+#define ANP_MTU_65K_MAX_SIZE ANP_FRAME_SIZE(ANP_MTU_65K)
+
+// mtu of the external device (and of the tap device or veth pair behind it), e.g.
+// ANP_MTU_9K for jumbo frames, the ANP_MTU environment variable overrides it. TCP sizes its
+// segments from it. The loopback device always has ANP_MTU_65K.
+#define ANP_MTU ANP_MTU_15
+
+// the device backend, "tap", "tap-uring" (the same tap device driven through io_uring),
+// "packet" (AF_PACKET on a veth pair), "xdp" (AF_XDP on the same veth pair) or "none" (only
+// 127.0.0.1 works, needs neither root nor /dev/net/tap), the ANP_NETDEV environment variable
+// overrides it
+#define ANP_NETDEV_BACKEND "tap"
+
+// frames that can be on their way through the loopback device, a power of two
+#define ANP_LOOP_QUEUE_SIZE 1024
+
+// number of device queues (IFF_MULTI_QUEUE for tap, PACKET_FANOUT sockets for packet),
+// every queue gets its own RX thread
+// https://www.kernel.org/doc/Documentation/networking/tuntap.txt (3.3 multiqueue tuntap interface)
+#define ANP_NETDEV_QUEUES 4
+
+// receive descriptors (and frame buffers) preallocated for every device queue, a power of two
+#define ANP_RX_RING_SIZE 256
+// at most this many frames are taken from a device queue in one go
+#define ANP_RX_BURST 64
+// how long an RX thread sleeps in the device before it checks whether it should stop
+#define ANP_RX_POLL_MSEC 100
+
+// frames waiting for the TX thread of a device, a power of two, 0 sends them right away on
+// the calling thread instead
+#define ANP_TX_QUEUE_SIZE 1024
+// at most this many frames are handed to the device in one go
+#define ANP_TX_BURST 64
+
+// the veth pair of the packet backend, the stack sits on the first, the kernel end gets
+// ANP_IP_TAP_DEV and the ANP_SUBNET_TAP route, just like the tap device
+#define ANP_PACKET_IFNAME "anp0"
+#define ANP_PACKET_PEER   "anp1"
+// TPACKET_V3 ring geometry, per queue. A block is handed to us as a whole once it is full or
+// ANP_PACKET_BLOCK_TMO_MSEC after its first frame, frames never straddle blocks.
+#define ANP_PACKET_BLOCK_SIZE (1 << 18)
+#define ANP_PACKET_BLOCK_NR   16
+#define ANP_PACKET_BLOCK_TMO_MSEC 1
+// tx ring of ANP_PACKET_TX_FRAME_SIZE * ANP_PACKET_TX_FRAME_NR bytes. A slot holds one frame
+// plus the tpacket header, the slots grow (and become fewer) with larger mtus.
+#define ANP_PACKET_TX_FRAME_SIZE 2048
+#define ANP_PACKET_TX_FRAME_NR   512
+// AF_XDP UMEM chunk size, every chunk holds one frame (plus XDP_PACKET_HEADROOM in front),
+// the first ANP_RX_RING_SIZE chunks of a queue are for rx, then ANP_XDP_TX_FRAMES for tx.
+// It also limits the mtu of the xdp backend.
+#define ANP_XDP_FRAME_SIZE 4096
+#define ANP_XDP_TX_FRAMES  256
+
+// subuff size classes, the buffer sizes alloc_sub() rounds up to: headers only (ACKs,
+// syns), one 1500 mtu frame, one jumbo frame and a 64KB super-segment. Larger requests go
+// straight to the heap. A thread caches free subuffs of a class in two magazines, the
+// depot of a class keeps at most ANP_SUB_POOL_DEPOT_MAGS full and empty ones more.
+#define ANP_SUB_POOL_HDR_SIZE   128
+#define ANP_SUB_POOL_MTU_SIZE   2048
+#define ANP_SUB_POOL_JUMBO_SIZE ANP_FRAME_SIZE(ANP_MTU_9K)
+#define ANP_SUB_POOL_GSO_SIZE   ANP_MTU_65K_MAX_SIZE
+#define ANP_SUB_POOL_DEPOT_MAGS 16
+// payload pieces a subuff can point to outside of its own buffer
+#define ANP_SUB_MAX_FRAGS 4
+
+// bytes a socket buffers for the application to read (a power of two), without window
+// scaling no more than 64KB of it can be advertised
+#define ANP_SOCK_RCVBUF (1 << 16)
+// the fd table of get_sock_by_fd(), ANP_FD_CHUNKS chunks of ANP_FD_CHUNK (a power of two)
+// sockets from SOCK_FD_START on, which bounds the number of open sockets
+#define ANP_FD_CHUNK  1024
+#define ANP_FD_CHUNKS 1024
+
+// retired objects that make a thread try to free them right away, rather than waiting
+// for the timer thread
+#define ANP_EPOCH_BATCH 64
+
+// the pollfds poll() translates on the stack before it allocates
+#define ANP_POLL_STACK_FDS   64
+
+// buckets the connection hash starts with (it doubles when it has more sockets than
+// buckets) and the number of locks they share, both powers of two
+#define ANP_SOCK_HASH_BUCKETS 256
+#define ANP_SOCK_HASH_LOCKS   64
+
+// bytes send() can hand to a socket before it blocks, the stack segments them as acks come in
+#define ANP_SOCK_SNDBUF (1 << 18)
+// the range SO_SNDBUF and SO_RCVBUF can set both rings to, rounded up to a power of two
+#define ANP_SOCK_BUF_MIN (1 << 12)
+#define ANP_SOCK_BUF_MAX (1 << 24)
+// how long an ack is held back with TCP_QUICKACK off, waiting for a second segment
+#define ANP_TCP_DELACK_MSEC 40
+
+// bytes of a file sendfile() maps at a time, and copies through the stack when it can not
+// be mapped (splice() from a pipe as well)
+#define ANP_SENDFILE_CHUNK (1 << 22)
+#define ANP_SENDFILE_COPY  (1 << 14)
+
+// half-open connections a listener keeps a socket for (no more than its backlog). Beyond
+// that the synack carries the connection in a syn cookie, or without ANP_SYN_COOKIES the
+// syn is dropped.
+#define ANP_SYN_BACKLOG 256
+#define ANP_SYN_COOKIES
+
+// pcapng capture, on when ANP_CAPTURE names a file. Frames are cut to the snap length and
+// only every ANP_CAPTURE_SAMPLE-th one is taken (per thread), the environment variables of
+// the same name override both. Every capturing thread has a ring of ANP_CAPTURE_RING_BYTES
+// that the capture thread writes out every ANP_CAPTURE_FLUSH_MSEC.
+#define ANP_CAPTURE_SNAPLEN 128
+#define ANP_CAPTURE_SAMPLE 1
+#define ANP_CAPTURE_RING_BYTES (1 << 20)
+#define ANP_CAPTURE_FLUSH_MSEC 10
+
+// prepend a virtio_net_hdr to every tap frame (IFF_VNET_HDR) and enable checksum and TCP
+// segmentation offloads (TUNSETOFFLOAD). The stack then sends and receives 64KB super-segments.
+#define ANP_TAP_VNET_HDR 1
 
 #define TCP_MSL_MSECS 2500 //120000
 
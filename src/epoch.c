@@ -0,0 +1,190 @@
+/*
+ * Every thread that enters a critical section gets a record with the global epoch it
+ * entered in. The global epoch moves from e to e + 1 once every thread inside a critical
+ * section has entered in e. An object retired in epoch e was unlinked before, so only
+ * threads that entered in e or earlier can hold it, and all of them have left once the
+ * global epoch reached e + 2.
+ */
+#include "epoch.h"
+#include "config.h"
+
+#define EPOCH_ACTIVE 1
+
+struct epoch_rec {
+    // (epoch << 1) | EPOCH_ACTIVE inside a critical section, 0 outside
+    uint64_t state;
+    int nest;
+    bool in_use;
+    struct epoch_rec *next;
+} __attribute__((aligned(64)));
+
+static uint64_t global_epoch = 1;
+// every record ever handed out, they are reused by later threads but never freed
+static struct epoch_rec *recs;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rec_key;
+static __thread struct epoch_rec *self;
+
+// retired objects that may still be in use
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_head *limbo;
+static int nr_limbo;
+
+static void epoch_rec_put(struct epoch_rec *rec)
+{
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    rec->nest = 0;
+    __atomic_store_n(&rec->in_use, false, __ATOMIC_RELEASE);
+}
+
+// the record of an exiting thread goes back to the pool, e.g. of a timer handler
+static void epoch_thread_exit(void *arg)
+{
+    epoch_rec_put(arg);
+}
+
+static void epoch_key_init()
+{
+    pthread_key_create(&rec_key, epoch_thread_exit);
+}
+
+static struct epoch_rec *epoch_rec_get()
+{
+    struct epoch_rec *rec;
+
+    for (rec = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        bool in_use = false;
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&rec->in_use, &in_use, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return rec;
+        }
+    }
+    rec = aligned_alloc(64, sizeof(*rec));
+    if (!rec) {
+        // without a record nothing the thread reads is safe
+        printf("Error: no memory for an epoch record \n");
+        exit(-ENOMEM);
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->in_use = true;
+    rec->next = __atomic_load_n(&recs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&recs, &rec->next, rec, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return rec;
+}
+
+static void epoch_set_self(struct epoch_rec *rec)
+{
+    pthread_once(&key_once, epoch_key_init);
+    self = rec;
+    pthread_setspecific(rec_key, rec);
+}
+
+void epoch_enter()
+{
+    if (!self) {
+        epoch_set_self(epoch_rec_get());
+    }
+    if (self->nest++ > 0) {
+        return;
+    }
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->state, (epoch << 1) | EPOCH_ACTIVE, __ATOMIC_RELAXED);
+    // announced before the critical section reads anything
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit()
+{
+    if (--self->nest > 0) {
+        return;
+    }
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+struct epoch_rec *epoch_hand_over()
+{
+    struct epoch_rec *rec = epoch_rec_get();
+
+    rec->nest = 1;
+    __atomic_store_n(&rec->state, __atomic_load_n(&self->state, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return rec;
+}
+
+// the new thread is inside a critical section then, it leaves with epoch_exit()
+void epoch_adopt(struct epoch_rec *rec)
+{
+    epoch_set_self(rec);
+}
+
+// a handed over record the thread never adopted, e.g. it could not be created
+void epoch_release(struct epoch_rec *rec)
+{
+    epoch_rec_put(rec);
+}
+
+// returns the global epoch, advanced by one if no thread is behind
+static uint64_t epoch_try_advance()
+{
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (struct epoch_rec *rec = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        uint64_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    // fails only if another thread advanced it from epoch meanwhile
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+// the object must be unreachable already, threads entering from here on can not find it
+void epoch_retire(struct epoch_head *head, void (*func)(struct epoch_head *))
+{
+    head->func = func;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    head->epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&limbo_lock);
+    head->next = limbo;
+    limbo = head;
+    bool poll = ++nr_limbo >= ANP_EPOCH_BATCH;
+    pthread_mutex_unlock(&limbo_lock);
+    // churn would otherwise pile up between two timer ticks
+    if (poll) {
+        epoch_poll();
+    }
+}
+
+void epoch_poll()
+{
+    struct epoch_head *done = NULL, **pos, *head;
+
+    if (__atomic_load_n(&nr_limbo, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    uint64_t epoch = epoch_try_advance();
+
+    pthread_mutex_lock(&limbo_lock);
+    for (pos = &limbo; *pos;) {
+        head = *pos;
+        if (head->epoch + 2 <= epoch) {
+            *pos = head->next;
+            head->next = done;
+            done = head;
+            nr_limbo--;
+        } else {
+            pos = &head->next;
+        }
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    // outside the lock, a free function may retire something itself
+    while (done) {
+        head = done;
+        done = done->next;
+        head->func(head);
+    }
+}
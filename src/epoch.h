@@ -0,0 +1,33 @@
+#ifndef ANPNETSTACK_EPOCH_H
+#define ANPNETSTACK_EPOCH_H
+
+#include "systems_headers.h"
+
+/*
+ * Epoch based reclamation. A thread reads shared objects (sockets, timers, the connection
+ * hash) between epoch_enter() and epoch_exit(), without their locks. Whoever unlinks such
+ * an object passes it to epoch_retire(), it is freed once every thread that could still
+ * see it has left its critical section.
+ */
+
+// embedded in a retired object, func frees it
+struct epoch_head {
+    struct epoch_head *next;
+    uint64_t epoch;
+    void (*func)(struct epoch_head *);
+};
+
+struct epoch_rec;
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(struct epoch_head *head, void (*func)(struct epoch_head *));
+// frees what is past its grace period, called from the timer thread every tick
+void epoch_poll();
+// a new thread can not enter in time to protect what its creator hands it. The creator
+// pins a record at its own epoch instead, and the thread adopts it as its critical section.
+struct epoch_rec *epoch_hand_over();
+void epoch_adopt(struct epoch_rec *rec);
+void epoch_release(struct epoch_rec *rec);
+
+#endif //ANPNETSTACK_EPOCH_H
@@ -18,24 +18,32 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "systems_headers.h"
-#include "tap_netdev.h"
 #include "anp_netdev.h"
 #include "route.h"
 #include "anpwrapper.h"
 #include "timer.h"
+#include "config.h"
+#include "tx_queue.h"
+#include "capture.h"
+#include "sock_hash.h"
+#include "syncookie.h"
 
 extern char**environ;
+extern struct anp_netdev *cdev_ext;
+extern struct anp_netdev *cdev_lo;
 
-#define THREAD_RX      0
-#define THREAD_TIMER   1
-#define THREAD_MAX     2
+#define THREAD_TIMER   0
+// followed by one RX thread per device queue, the loopback device has one queue, and the
+// TX thread of the external device, and the capture thread
+#define THREAD_RX      1
+#define THREAD_MAX     (THREAD_RX + ANP_NETDEV_QUEUES + 1 + 1 + 1)
 
 static pthread_t threads[THREAD_MAX];
 volatile bool stop = false;
 
-static void create_thread(pthread_t id, void *(*func) (void *))
+static void create_thread(pthread_t id, void *(*func) (void *), void *arg)
 {
-    int ret = pthread_create(&threads[id], NULL, func, NULL);
+    int ret = pthread_create(&threads[id], NULL, func, arg);
     if ( 0 != ret) {
         printf("thread creation failed %d , errno %d \n", ret, errno);
         exit(-errno);
@@ -49,9 +57,22 @@ void ctrl_c_handler(int val) {
 
 static void init_threads()
 {
-    // we have two async activities
-    create_thread(THREAD_RX, netdev_rx_loop);
-    create_thread(THREAD_TIMER, timers_start);
+    struct anp_netdev *devs[] = { cdev_ext, cdev_lo };
+    int id = THREAD_RX;
+    // we have the timers, a receive loop for every device queue and a transmit loop for
+    // every device with a tx queue
+    create_thread(THREAD_TIMER, timers_start, NULL);
+    for (size_t d = 0; d < sizeof(devs) / sizeof(devs[0]); d++) {
+        for (int i = 0; i < devs[d]->num_queues; i++) {
+            create_thread(id++, netdev_rx_loop, &devs[d]->queues[i]);
+        }
+        if (devs[d]->txq) {
+            create_thread(id++, tx_queue_loop, devs[d]->txq);
+        }
+    }
+    if (capture_on) {
+        create_thread(id++, capture_loop, NULL);
+    }
 }
 
 void __attribute__ ((constructor)) _init_anp_netstack() {
@@ -71,9 +92,16 @@ void __attribute__ ((constructor)) _init_anp_netstack() {
 #endif
     printf("Hello there, I am ANP networking stack!\n");
     _function_override_init();
-    // this is the external end, at 10.0.0.5
-    tdev_init();
-    // this is the client end, at 10.0.0.4
+    // before the devices, they get an interface in the capture file when they are opened
+    capture_init();
+    if (sock_hash_init() < 0) {
+        exit(-1);
+    }
+    if (syncookie_init() < 0) {
+        exit(-1);
+    }
+    // this is the client end, at 10.0.0.4, opening its backend also sets up the external
+    // end at 10.0.0.5 (tap device or veth peer)
     client_netdev_init();
     // insert and init some default routes about, lo, local delivery, and the gateway
     route_init();
@@ -41,11 +41,14 @@ int ip_rx(struct subuff *sub)
         goto drop_pkt;
     }
 
-    csum = do_csum(ih, ih->ihl * 4, 0);
+    // the device may have vouched for the packet already (checksum offload)
+    if (sub->ip_summed == CHECKSUM_NONE) {
+        csum = do_csum(ih, ih->ihl * 4, 0);
 
-    if (csum != 0) {
-        printf("Error: invalid checksum, dropping packet");
-        goto drop_pkt;
+        if (csum != 0) {
+            printf("Error: invalid checksum, dropping packet");
+            goto drop_pkt;
+        }
     }
 
     ih->saddr = ntohl(ih->saddr);
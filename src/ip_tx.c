@@ -37,16 +37,19 @@ int dst_neigh_output(struct subuff *sub)
     uint32_t dst_addr = ntohl(iphdr->daddr);
     uint32_t src_addr = ntohl(iphdr->saddr);
 
-    uint8_t *target_dst_mac;
+    uint8_t target_dst_mac[6];
+
+    // nothing to resolve on loopback, the frame comes straight back to us
+    if (rt->flags & RT_LOOPBACK) {
+        return netdev_transmit(sub, anp_netdev->hwaddr, ETH_P_IP);
+    }
 
     if (rt->flags & RT_GATEWAY) {
         // in case, we are not briged but NAT'ed with a gateway
         dst_addr = rt->gateway;
     }
 
-    target_dst_mac = arp_get_hwaddr(dst_addr);
-
-    if (target_dst_mac) {
+    if (arp_get_hwaddr(dst_addr, target_dst_mac) == 0) {
         return netdev_transmit(sub, target_dst_mac, ETH_P_IP);
     } else {
         arp_request(src_addr, dst_addr, anp_netdev);
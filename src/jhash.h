@@ -0,0 +1,25 @@
+#ifndef ANPNETSTACK_JHASH_H
+#define ANPNETSTACK_JHASH_H
+
+#include "systems_headers.h"
+
+// https://elixir.bootlin.com/linux/latest/source/include/linux/jhash.h
+#define rol32(_x, _k) (((_x) << (_k)) | ((_x) >> (32 - (_k))))
+
+static inline uint32_t jhash_3words(uint32_t a, uint32_t b, uint32_t c, uint32_t initval)
+{
+    initval += 0xdeadbeef + (3 << 2);
+    a += initval;
+    b += initval;
+    c += initval;
+    c ^= b; c -= rol32(b, 14);
+    a ^= c; a -= rol32(c, 11);
+    b ^= a; b -= rol32(a, 25);
+    c ^= b; c -= rol32(b, 16);
+    a ^= c; a -= rol32(c, 4);
+    b ^= a; b -= rol32(a, 14);
+    c ^= b; c -= rol32(b, 24);
+    return c;
+}
+
+#endif //ANPNETSTACK_JHASH_H
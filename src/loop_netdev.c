@@ -0,0 +1,142 @@
+/*
+ * The loopback device behind cdev_lo (127.0.0.1). Transmitting copies the frame into a
+ * receive buffer of the device and puts it on a lock-free queue, the device's rx thread
+ * takes it from there into ip_rx(). No kernel is involved, so this also works without
+ * root and without /dev/net/tap. Like the kernel's loopback it needs no checksums and
+ * passes super-segments as they are.
+ */
+
+#include "loop_netdev.h"
+#include "mpsc_ring.h"
+#include "rx_ring.h"
+#include "config.h"
+
+#include <sys/eventfd.h>
+
+static int loop_open(struct anp_netdev *dev)
+{
+    struct loop_netdev *ldev = calloc(sizeof(struct loop_netdev), 1);
+    int err = -ENOMEM;
+
+    if (NULL == ldev) {
+        return -ENOMEM;
+    }
+    ldev->queue = mpsc_ring_alloc(ANP_LOOP_QUEUE_SIZE);
+    if (NULL == ldev->queue) {
+        printf("Error: could not set up the loopback queue, errno %d \n", errno);
+        goto fail;
+    }
+    ldev->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (0 > ldev->wake_fd) {
+        err = -errno;
+        printf("Error: could not set up the loopback wakeup, errno %d \n", errno);
+        goto fail_queue;
+    }
+    dev->priv = ldev;
+    dev->num_queues = 1;
+    dev->features = NETDEV_F_CSUM | NETDEV_F_TSO | NETDEV_F_GRO | NETDEV_F_LLTX;
+    dev->rx_buf_size = ANP_MTU_65K_MAX_SIZE;
+    return 0;
+
+fail_queue:
+    free(ldev->queue->slots);
+    free(ldev->queue);
+fail:
+    free(ldev);
+    return err;
+}
+
+static int loop_pop(struct loop_netdev *ldev, struct subuff **subs, int max)
+{
+    int n = 0;
+
+    while (n < max && NULL != (subs[n] = mpsc_ring_pop(ldev->queue))) {
+        n++;
+    }
+    return n;
+}
+
+static int loop_rx_burst(struct anp_netdev *dev, int queue __attribute__((unused)), struct subuff **subs, int max)
+{
+    struct loop_netdev *ldev = dev->priv;
+    uint64_t val;
+    int n = loop_pop(ldev, subs, max);
+
+    if (n > 0) {
+        return n;
+    }
+    // announce that we sleep and look once more, a sender that pushed before it saw the
+    // flag is caught by the second look, all others write wake_fd
+    __atomic_store_n(&ldev->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    n = loop_pop(ldev, subs, max);
+    if (0 == n) {
+        struct pollfd pfd = { .fd = ldev->wake_fd, .events = POLLIN };
+        if (0 > poll(&pfd, 1, ANP_RX_POLL_MSEC) && errno != EINTR) {
+            __atomic_store_n(&ldev->sleeping, 0, __ATOMIC_SEQ_CST);
+            return -errno;
+        }
+        read(ldev->wake_fd, &val, sizeof(val));
+        n = loop_pop(ldev, subs, max);
+    }
+    __atomic_store_n(&ldev->sleeping, 0, __ATOMIC_SEQ_CST);
+    return n;
+}
+
+static int loop_tx_burst(struct anp_netdev *dev, int queue __attribute__((unused)), struct subuff **subs, int count)
+{
+    struct loop_netdev *ldev = dev->priv;
+    struct rx_ring *ring = dev->rx_rings[0];
+    uint64_t one = 1;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct subuff *sub = subs[i];
+        if (sub->len > ring->buf_size) {
+            printf("Error: frame of %u bytes is too large for the loopback device \n", sub->len);
+            break;
+        }
+        // the caller keeps its subuff (e.g. for retransmission), the receiver gets a copy
+        struct subuff *copy = rx_ring_get(ring);
+        if (!copy) {
+            __atomic_fetch_add(&ldev->drops, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        sub_copy_bits(sub, 0, copy->data, sub->len);
+        copy->len = sub->len;
+        copy->ip_summed = CHECKSUM_UNNECESSARY;
+        copy->gso_type = sub->gso_type;
+        copy->gso_size = sub->gso_size;
+        if (!mpsc_ring_push(ldev->queue, copy)) {
+            __atomic_fetch_add(&ldev->drops, 1, __ATOMIC_RELAXED);
+            free_sub(copy);
+            break;
+        }
+    }
+    // pairs with the fence in loop_rx_burst()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (i > 0 && __atomic_load_n(&ldev->sleeping, __ATOMIC_SEQ_CST)) {
+        write(ldev->wake_fd, &one, sizeof(one));
+    }
+    return i;
+}
+
+// frames still on the queue are not freed, the rx ring they belong to outlives the device
+static void loop_close(struct anp_netdev *dev)
+{
+    struct loop_netdev *ldev = dev->priv;
+
+    close(ldev->wake_fd);
+    free(ldev->queue->slots);
+    free(ldev->queue);
+    free(ldev);
+    dev->priv = NULL;
+}
+
+const struct netdev_ops loop_netdev_ops = {
+    .name = "loopback",
+    .open = loop_open,
+    .rx_burst = loop_rx_burst,
+    .tx_burst = loop_tx_burst,
+    .close = loop_close,
+};
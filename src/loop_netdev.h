@@ -0,0 +1,22 @@
+#ifndef ANPNETSTACK_LOOP_NETDEV_H
+#define ANPNETSTACK_LOOP_NETDEV_H
+
+#include "systems_headers.h"
+#include "anp_netdev.h"
+
+struct mpsc_ring;
+
+// the private state of the loopback device
+struct loop_netdev {
+    // transmitted frames on their way back to the rx thread
+    struct mpsc_ring *queue;
+    // the rx thread sleeps on this when the queue is empty, senders only kick it then
+    int wake_fd;
+    int sleeping;
+    // frames dropped because the queue was full
+    uint64_t drops;
+};
+
+extern const struct netdev_ops loop_netdev_ops;
+
+#endif //ANPNETSTACK_LOOP_NETDEV_H
@@ -0,0 +1,69 @@
+#include "mpsc_ring.h"
+#include "systems_headers.h"
+
+struct mpsc_ring *mpsc_ring_alloc(uint32_t size)
+{
+    struct mpsc_ring *ring = calloc(1, sizeof(*ring));
+    // the indices are free running, a power of two size lets them wrap around
+    assert((size & (size - 1)) == 0);
+
+    if (!ring) {
+        printf("Error: mpsc ring calloc failed \n");
+        return NULL;
+    }
+    ring->slots = calloc(size, sizeof(struct mpsc_slot));
+    if (!ring->slots) {
+        printf("Error: mpsc ring of %u slots could not be allocated \n", size);
+        free(ring);
+        return NULL;
+    }
+    ring->size = size;
+    // a slot is free for push number seq and holds the item of pop number seq - 1
+    for (uint32_t i = 0; i < size; i++) {
+        ring->slots[i].seq = i;
+    }
+    return ring;
+}
+
+// false when the ring is full
+bool mpsc_ring_push(struct mpsc_ring *ring, void *item)
+{
+    uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    struct mpsc_slot *slot;
+
+    for (;;) {
+        slot = &ring->slots[pos & (ring->size - 1)];
+        int32_t diff = (int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            // the slot is free, claim it unless another producer was faster
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the consumer has not got to the item that was here one lap ago
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// NULL when the ring is empty, must only be called from one thread at a time
+void *mpsc_ring_pop(struct mpsc_ring *ring)
+{
+    uint32_t pos = ring->tail;
+    struct mpsc_slot *slot = &ring->slots[pos & (ring->size - 1)];
+
+    if ((int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1)) < 0) {
+        return NULL;
+    }
+    void *item = slot->item;
+    // free for the push one lap later
+    __atomic_store_n(&slot->seq, pos + ring->size, __ATOMIC_RELEASE);
+    ring->tail = pos + 1;
+    return item;
+}
@@ -0,0 +1,24 @@
+#ifndef ANPNETSTACK_MPSC_RING_H
+#define ANPNETSTACK_MPSC_RING_H
+
+#include "systems_headers.h"
+
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+struct mpsc_slot {
+    uint32_t seq;
+    void *item;
+};
+
+// A bounded lock-free queue of pointers, any number of threads push, one thread pops.
+struct mpsc_ring {
+    struct mpsc_slot *slots;
+    uint32_t size;                              // power of two
+    uint32_t head __attribute__((aligned(64))); // next slot to push to, shared by producers
+    uint32_t tail __attribute__((aligned(64))); // next slot to pop from, consumer only
+};
+
+struct mpsc_ring *mpsc_ring_alloc(uint32_t size);
+bool mpsc_ring_push(struct mpsc_ring *ring, void *item);
+void *mpsc_ring_pop(struct mpsc_ring *ring);
+
+#endif //ANPNETSTACK_MPSC_RING_H
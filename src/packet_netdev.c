@@ -0,0 +1,359 @@
+/*
+ * The AF_PACKET backend. The stack sits on one end of a veth pair and the kernel on the
+ * other, frames are exchanged through TPACKET_V3 rings that are mmap'ed into our address
+ * space. The kernel fills whole blocks of rx frames and wakes us up once per block, so one
+ * poll() can bring in hundreds of frames without a read() for every one of them. On tx we
+ * fill ring slots and a single send() makes the kernel go over all of them.
+ * https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
+ */
+
+#include "packet_netdev.h"
+#include "utilities.h"
+#include "config.h"
+#include "rx_ring.h"
+
+// where the frame starts in a tx slot, right behind the tpacket3_hdr
+#define PACKET_TX_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+#define PACKET_RX_RING_LEN ((size_t) ANP_PACKET_BLOCK_SIZE * ANP_PACKET_BLOCK_NR)
+#define PACKET_TX_RING_LEN ((size_t) ANP_PACKET_TX_FRAME_SIZE * ANP_PACKET_TX_FRAME_NR)
+
+// the smallest power of two slot (at least ANP_PACKET_TX_FRAME_SIZE) a frame of the mtu fits
+static uint32_t packet_tx_frame_size(uint32_t mtu)
+{
+    uint32_t size = ANP_PACKET_TX_FRAME_SIZE;
+    while (size < PACKET_TX_DATA_OFF + ANP_FRAME_SIZE(mtu)) {
+        size <<= 1;
+    }
+    return size;
+}
+
+/*
+ * Creates the veth pair and configures the kernel end the same way tap_open() configures
+ * the tap device. The pair outlives us, a second run finds it and only sets the mtu again.
+ * The xdp backend uses the same pair.
+ */
+int packet_setup_veth(uint32_t mtu)
+{
+    int ret;
+    if (0 == run_bash_command("ip link show dev %s > /dev/null 2>&1", ANP_PACKET_IFNAME)) {
+        ret = run_bash_command("ip link set dev %s mtu %u", ANP_PACKET_IFNAME, mtu);
+        if (0 == ret)
+            ret = run_bash_command("ip link set dev %s mtu %u", ANP_PACKET_PEER, mtu);
+        if (0 != ret) {
+            printf("ERROR failed setting mtu %u on the veth pair \n", mtu);
+            return ret;
+        }
+        printf("OK: using the existing veth pair %s - %s, mtu %u \n", ANP_PACKET_IFNAME, ANP_PACKET_PEER, mtu);
+        return 0;
+    }
+    ret = run_bash_command("ip link add %s type veth peer name %s", ANP_PACKET_IFNAME, ANP_PACKET_PEER);
+    if (0 != ret) {
+        printf("ERROR failed creating the veth pair %s - %s \n", ANP_PACKET_IFNAME, ANP_PACKET_PEER);
+        return ret;
+    }
+    // frames for the stack must not be taken for the kernel end of our side, nor forwarded
+    run_bash_command("sysctl -q -w net.ipv4.conf.%s.forwarding=0", ANP_PACKET_IFNAME);
+    run_bash_command("sysctl -q -w net.ipv6.conf.%s.disable_ipv6=1", ANP_PACKET_IFNAME);
+    run_bash_command("sysctl -q -w net.ipv6.conf.%s.disable_ipv6=1", ANP_PACKET_PEER);
+    ret = run_bash_command("ip link set dev %s address %s", ANP_PACKET_IFNAME, ANP_MAC_CLIENT_EXT);
+    if (0 == ret)
+        ret = run_bash_command("ip link set dev %s mtu %u", ANP_PACKET_IFNAME, mtu);
+    if (0 == ret)
+        ret = run_bash_command("ip link set dev %s mtu %u", ANP_PACKET_PEER, mtu);
+    if (0 == ret)
+        ret = run_bash_command("ip link set dev %s up", ANP_PACKET_IFNAME);
+    if (0 == ret)
+        ret = run_bash_command("ip link set dev %s up", ANP_PACKET_PEER);
+    if (0 != ret) {
+        printf("ERROR failed getting the veth pair up \n");
+        return ret;
+    }
+    ret = run_bash_command("ip route add dev %s %s", ANP_PACKET_PEER, ANP_SUBNET_TAP);
+    if (0 != ret) {
+        printf("ERROR failed setting the device route %s \n", ANP_SUBNET_TAP);
+        return ret;
+    }
+    // (MUST be last, the ordering is important).
+    ret = run_bash_command("ip address add dev %s local %s", ANP_PACKET_PEER, ANP_IP_TAP_DEV);
+    if (0 != ret) {
+        printf("ERROR failed setting the device address, %s \n", ANP_IP_TAP_DEV);
+        return ret;
+    }
+    printf("OK: veth pair %s - %s is up, %s \n", ANP_PACKET_IFNAME, ANP_PACKET_PEER, ANP_IP_TAP_DEV);
+    return 0;
+}
+
+static int packet_open_queue(struct packet_netdev *pdev, struct packet_queue *pq, int fanout)
+{
+    int version = TPACKET_V3, one = 1;
+    // for the rx ring the frame size only has to pass the sanity checks, frames are packed
+    // into the blocks back to back and can be as large as a block
+    struct tpacket_req3 rx_req = {
+        .tp_block_size = ANP_PACKET_BLOCK_SIZE,
+        .tp_block_nr = ANP_PACKET_BLOCK_NR,
+        .tp_frame_size = ANP_PACKET_TX_FRAME_SIZE,
+        .tp_frame_nr = PACKET_RX_RING_LEN / ANP_PACKET_TX_FRAME_SIZE,
+        .tp_retire_blk_tov = ANP_PACKET_BLOCK_TMO_MSEC,
+    };
+    // the ring keeps its size, larger slots just mean less of them
+    struct tpacket_req3 tx_req = {
+        .tp_block_size = ANP_PACKET_BLOCK_SIZE,
+        .tp_block_nr = PACKET_TX_RING_LEN / ANP_PACKET_BLOCK_SIZE,
+        .tp_frame_size = pdev->tx_frame_size,
+        .tp_frame_nr = pdev->tx_frame_nr,
+    };
+    struct sockaddr_ll sll;
+
+    // protocol 0 until bind(), so nothing arrives before the rings are there
+    pq->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (0 > pq->fd) {
+        printf("ERR: could not open a packet socket, errno %d \n", errno);
+        return -errno;
+    }
+    if (0 > setsockopt(pq->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))
+        || 0 > setsockopt(pq->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req))
+        || 0 > setsockopt(pq->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req))) {
+        printf("ERR: could not set up the TPACKET_V3 rings, errno %d \n", errno);
+        goto fail;
+    }
+    // both rings are in one mapping, rx first
+    pq->map_len = PACKET_RX_RING_LEN + PACKET_TX_RING_LEN;
+    pq->map = mmap(NULL, pq->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, pq->fd, 0);
+    if (MAP_FAILED == pq->map) {
+        printf("ERR: could not mmap the packet rings, errno %d \n", errno);
+        pq->map = NULL;
+        goto fail;
+    }
+    pq->rx_ring = pq->map;
+    pq->tx_ring = pq->map + PACKET_RX_RING_LEN;
+    pthread_mutex_init(&pq->tx_lock, NULL);
+    // our frames go straight to the veth driver, and we do not want to see them on rx
+    // (both are optimizations, older kernels do without)
+    setsockopt(pq->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    setsockopt(pq->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+    _clear_var(sll);
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = pdev->ifindex;
+    if (0 > bind(pq->fd, (struct sockaddr *) &sll, sizeof(sll))) {
+        printf("ERR: could not bind the packet socket to %s, errno %d \n", ANP_PACKET_IFNAME, errno);
+        goto fail;
+    }
+    // with more queues the kernel spreads the flows over the sockets of the group
+    if (fanout >= 0 && 0 > setsockopt(pq->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))) {
+        printf("ERR: could not join the packet fanout group, errno %d \n", errno);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (pq->map) {
+        munmap(pq->map, pq->map_len);
+        pq->map = NULL;
+    }
+    close(pq->fd);
+    return -errno;
+}
+
+static int packet_open(struct anp_netdev *dev)
+{
+    struct packet_netdev *pdev = calloc(sizeof(struct packet_netdev), 1);
+    struct ifreq ifr;
+    int ret, fanout = -1;
+
+    if (NULL == pdev) {
+        return -ENOMEM;
+    }
+    ret = packet_setup_veth(dev->mtu);
+    if (0 != ret) {
+        free(pdev);
+        return ret;
+    }
+    pdev->tx_frame_size = packet_tx_frame_size(dev->mtu);
+    pdev->tx_frame_nr = PACKET_TX_RING_LEN / pdev->tx_frame_size;
+    _clear_var(ifr);
+    strncpy(ifr.ifr_name, ANP_PACKET_IFNAME, IFNAMSIZ - 1);
+    int fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (0 > fd || 0 > ioctl(fd, SIOCGIFINDEX, &ifr)) {
+        printf("ERR: no such device %s, errno %d \n", ANP_PACKET_IFNAME, errno);
+        free(pdev);
+        return -ENODEV;
+    }
+    close(fd);
+    pdev->ifindex = ifr.ifr_ifindex;
+
+    if (ANP_NETDEV_QUEUES > 1) {
+        fanout = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    }
+    for (int i = 0; i < ANP_NETDEV_QUEUES; i++) {
+        ret = packet_open_queue(pdev, &pdev->queues[i], fanout);
+        if (0 != ret) {
+            // we can live with less queues, but not without any
+            if (0 == i) {
+                free(pdev);
+                return ret;
+            }
+            printf("WARN: only %d out of %d packet queues could be opened \n", i, ANP_NETDEV_QUEUES);
+            break;
+        }
+        pdev->num_queues = i + 1;
+    }
+    dev->priv = pdev;
+    dev->num_queues = pdev->num_queues;
+    // no vnet header on the rings, so we checksum and segment ourselves. What the kernel
+    // sends can still be a coalesced (GSO) frame of up to 64KB.
+    dev->features = NETDEV_F_GRO;
+    dev->rx_buf_size = ANP_MTU_65K_MAX_SIZE;
+    return 0;
+}
+
+static struct tpacket_block_desc *packet_rx_block(struct packet_queue *pq)
+{
+    return (struct tpacket_block_desc *) (pq->rx_ring + (size_t) pq->rx_block * ANP_PACKET_BLOCK_SIZE);
+}
+
+// takes the block we are at from the kernel, if the kernel is done with it
+static bool packet_rx_open_block(struct packet_queue *pq)
+{
+    struct tpacket_block_desc *bd = packet_rx_block(pq);
+
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        return false;
+    }
+    pq->rx_frame = (struct tpacket3_hdr *) ((uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+    pq->rx_frames_left = bd->hdr.bh1.num_pkts;
+    return true;
+}
+
+// hands the block back to the kernel and moves on to the next one
+static void packet_rx_release_block(struct packet_queue *pq)
+{
+    struct tpacket_block_desc *bd = packet_rx_block(pq);
+
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    pq->rx_block = (pq->rx_block + 1) % ANP_PACKET_BLOCK_NR;
+    pq->rx_frame = NULL;
+    pq->rx_frames_left = 0;
+}
+
+static int packet_rx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int max)
+{
+    struct packet_netdev *pdev = dev->priv;
+    struct packet_queue *pq = &pdev->queues[queue];
+    struct rx_ring *ring = dev->rx_rings[queue];
+    int n = 0;
+
+    if (NULL == pq->rx_frame && !packet_rx_open_block(pq)) {
+        struct pollfd pfd = { .fd = pq->fd, .events = POLLIN | POLLERR };
+        if (0 > poll(&pfd, 1, ANP_RX_POLL_MSEC) && errno != EINTR) {
+            return -errno;
+        }
+        if (!packet_rx_open_block(pq)) {
+            return 0;
+        }
+    }
+    while (n < max) {
+        if (0 == pq->rx_frames_left) {
+            packet_rx_release_block(pq);
+            if (!packet_rx_open_block(pq)) {
+                break;
+            }
+            continue;
+        }
+        struct tpacket3_hdr *ph = pq->rx_frame;
+        struct sockaddr_ll *sll = (struct sockaddr_ll *) ((uint8_t *) ph + TPACKET_ALIGN(sizeof(*ph)));
+        pq->rx_frame = (struct tpacket3_hdr *) ((uint8_t *) ph + ph->tp_next_offset);
+        pq->rx_frames_left--;
+
+        if (sll->sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+        if (ph->tp_snaplen != ph->tp_len || ph->tp_snaplen > ring->buf_size) {
+            printf("Error: truncated frame of %u bytes on packet queue %d, dropping \n", ph->tp_len, queue);
+            continue;
+        }
+        // goes back into the ring when the packet is dropped or consumed
+        struct subuff *sub = rx_ring_get(ring);
+        // out of memory, the frame stays in the block for the next burst
+        if (!sub) {
+            pq->rx_frame = ph;
+            pq->rx_frames_left++;
+            break;
+        }
+        memcpy(sub->data, (uint8_t *) ph + ph->tp_mac, ph->tp_snaplen);
+        sub->len = ph->tp_snaplen;
+        // a partial checksum means the frame came from the kernel end and never left the host
+        if (ph->tp_status & (TP_STATUS_CSUMNOTREADY | TP_STATUS_CSUM_VALID)) {
+            sub->ip_summed = CHECKSUM_UNNECESSARY;
+        }
+        subs[n++] = sub;
+    }
+    // do not sit on a block we have seen all of, the kernel may need it
+    if (NULL != pq->rx_frame && 0 == pq->rx_frames_left) {
+        packet_rx_release_block(pq);
+    }
+    return n;
+}
+
+static int packet_tx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int count)
+{
+    struct packet_netdev *pdev = dev->priv;
+    struct packet_queue *pq = &pdev->queues[queue % pdev->num_queues];
+    int i, ret = 0;
+
+    pthread_mutex_lock(&pq->tx_lock);
+    for (i = 0; i < count; i++) {
+        struct tpacket3_hdr *ph = (struct tpacket3_hdr *) (pq->tx_ring + (size_t) pq->tx_frame * pdev->tx_frame_size);
+        uint32_t status = __atomic_load_n(&ph->tp_status, __ATOMIC_ACQUIRE);
+        if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+            // the ring is full, wait for the kernel to send what is in it and look again
+            if (0 == i && 0 > send(pq->fd, NULL, 0, 0) && errno != ENOBUFS) {
+                ret = -errno;
+                break;
+            }
+            status = __atomic_load_n(&ph->tp_status, __ATOMIC_ACQUIRE);
+            if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+                ret = -EAGAIN;
+                break;
+            }
+        }
+        if (subs[i]->len > pdev->tx_frame_size - PACKET_TX_DATA_OFF) {
+            printf("Error: frame of %u bytes does not fit a packet tx slot \n", subs[i]->len);
+            ret = -EMSGSIZE;
+            break;
+        }
+        sub_copy_bits(subs[i], 0, (uint8_t *) ph + PACKET_TX_DATA_OFF, subs[i]->len);
+        ph->tp_len = subs[i]->len;
+        ph->tp_next_offset = 0;
+        __atomic_store_n(&ph->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        pq->tx_frame = (pq->tx_frame + 1) % pdev->tx_frame_nr;
+    }
+    // one syscall for the whole burst, the kernel walks the ring up to the first empty slot
+    if (i > 0 && 0 > send(pq->fd, NULL, 0, MSG_DONTWAIT) && errno != EAGAIN && errno != ENOBUFS) {
+        ret = -errno;
+    }
+    pthread_mutex_unlock(&pq->tx_lock);
+    return (i > 0 || 0 == ret) ? i : ret;
+}
+
+// the veth pair stays, see packet_setup_veth()
+static void packet_close(struct anp_netdev *dev)
+{
+    struct packet_netdev *pdev = dev->priv;
+
+    for (int i = 0; i < pdev->num_queues; i++) {
+        munmap(pdev->queues[i].map, pdev->queues[i].map_len);
+        close(pdev->queues[i].fd);
+    }
+    free(pdev);
+    dev->priv = NULL;
+}
+
+const struct netdev_ops packet_netdev_ops = {
+    .name = "packet",
+    .open = packet_open,
+    .rx_burst = packet_rx_burst,
+    .tx_burst = packet_tx_burst,
+    .close = packet_close,
+};
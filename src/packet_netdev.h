@@ -0,0 +1,41 @@
+#ifndef ANPNETSTACK_PACKET_NETDEV_H
+#define ANPNETSTACK_PACKET_NETDEV_H
+
+#include "systems_headers.h"
+#include "config.h"
+#include "anp_netdev.h"
+
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+
+// one AF_PACKET socket with its mmap'ed TPACKET_V3 rx and tx ring
+struct packet_queue {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    // rx: blocks the kernel fills, we own a block while its status has TP_STATUS_USER
+    uint8_t *rx_ring;
+    uint32_t rx_block;                  // the block we are at
+    struct tpacket3_hdr *rx_frame;      // next frame in that block
+    uint32_t rx_frames_left;            // frames of the block we did not look at yet
+    // tx: fixed size slots, filled by us and flushed with a send()
+    uint8_t *tx_ring;
+    uint32_t tx_frame;
+    pthread_mutex_t tx_lock;
+};
+
+// the private state of the packet backend
+struct packet_netdev {
+    int ifindex;
+    int num_queues;
+    // tx slot geometry, a slot has to hold a whole frame of dev->mtu
+    uint32_t tx_frame_size;
+    uint32_t tx_frame_nr;
+    struct packet_queue queues[ANP_NETDEV_QUEUES];
+};
+
+extern const struct netdev_ops packet_netdev_ops;
+
+int packet_setup_veth(uint32_t mtu);
+
+#endif //ANPNETSTACK_PACKET_NETDEV_H
@@ -0,0 +1,135 @@
+#include "rx_ring.h"
+#include "systems_headers.h"
+#include "subuff.h"
+
+static void rx_ring_reset_sub(struct rx_ring *ring, struct subuff *sub, uint8_t *buf)
+{
+    memset(sub, 0, sizeof(*sub));
+    list_init(&sub->list);
+    sub->head = buf;
+    sub->data = buf;
+    sub->end = buf + ring->buf_size;
+    sub->ring = ring;
+    sub->refcnt = 1;
+}
+
+struct rx_ring *rx_ring_alloc(uint32_t size, uint32_t buf_size)
+{
+    // malloc and not calloc, pages are only touched when a frame is actually written into them
+    uint8_t *buffers = malloc((size_t) size * buf_size);
+    if (!buffers) {
+        printf("Error: rx ring of %u x %u bytes could not be allocated \n", size, buf_size);
+        return NULL;
+    }
+    struct rx_ring *ring = rx_ring_alloc_on(size, buf_size, buffers);
+    if (!ring) {
+        free(buffers);
+    }
+    return ring;
+}
+
+/*
+ * Same as rx_ring_alloc(), but over buffers the caller owns (e.g. memory that is registered
+ * with the device), descriptor i always describes buffers + i * buf_size.
+ */
+struct rx_ring *rx_ring_alloc_on(uint32_t size, uint32_t buf_size, uint8_t *buffers)
+{
+    struct rx_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        printf("Error: rx ring calloc failed \n");
+        return NULL;
+    }
+    // the ring indices are free running, a power of two size lets them wrap around
+    assert((size & (size - 1)) == 0);
+
+    ring->size = size;
+    ring->buf_size = buf_size;
+    ring->descs = calloc(size, sizeof(struct subuff));
+    ring->free = calloc(size, sizeof(struct subuff *));
+    ring->buffers = buffers;
+    if (!ring->descs || !ring->free) {
+        printf("Error: rx ring of %u descriptors could not be allocated \n", size);
+        free(ring->descs);
+        free(ring->free);
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+
+    for (uint32_t i = 0; i < size; i++) {
+        rx_ring_reset_sub(ring, &ring->descs[i], ring->buffers + (size_t) i * buf_size);
+        ring->free[i] = &ring->descs[i];
+    }
+    ring->head = 0;
+    ring->tail = size;
+    ring->low_water = size;
+    return ring;
+}
+
+// called with the lock held and at least one free descriptor
+static struct subuff *rx_ring_take(struct rx_ring *ring)
+{
+    struct subuff *sub = ring->free[ring->head & (ring->size - 1)];
+    ring->head++;
+    ring->allocs++;
+    if (ring->tail - ring->head < ring->low_water) {
+        ring->low_water = ring->tail - ring->head;
+    }
+    return sub;
+}
+
+/*
+ * Takes a descriptor for the next frame. When all of them are still held (e.g. queued on
+ * sockets that are not being read) this falls back to a heap allocated subuff, counted as
+ * a miss so the ring size can be tuned.
+ */
+struct subuff *rx_ring_get(struct rx_ring *ring)
+{
+    struct subuff *sub = NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->head == ring->tail) {
+        ring->misses++;
+        pthread_mutex_unlock(&ring->lock);
+        return alloc_sub(ring->buf_size);
+    }
+    sub = rx_ring_take(ring);
+    pthread_mutex_unlock(&ring->lock);
+    return sub;
+}
+
+// rx_ring_get() without the fallback, for callers that need the ring's own buffers
+struct subuff *rx_ring_try_get(struct rx_ring *ring)
+{
+    struct subuff *sub = NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->head != ring->tail) {
+        sub = rx_ring_take(ring);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return sub;
+}
+
+// called from free_sub() for subuffs that came from a ring
+void rx_ring_put(struct subuff *sub)
+{
+    struct rx_ring *ring = sub->ring;
+
+    // the receive path may have moved head within the buffer, the index tells where it is
+    rx_ring_reset_sub(ring, sub, ring->buffers + (size_t) (sub - ring->descs) * ring->buf_size);
+    pthread_mutex_lock(&ring->lock);
+    ring->free[ring->tail & (ring->size - 1)] = sub;
+    ring->tail++;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+uint32_t rx_ring_free_count(struct rx_ring *ring)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&ring->lock);
+    count = ring->tail - ring->head;
+    pthread_mutex_unlock(&ring->lock);
+    return count;
+}
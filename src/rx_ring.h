@@ -0,0 +1,32 @@
+#ifndef ANPNETSTACK_RX_RING_H
+#define ANPNETSTACK_RX_RING_H
+
+#include "systems_headers.h"
+#include "subuff.h"
+
+// A fixed ring of receive descriptors, every one with its own frame buffer. The RX thread
+// takes descriptors from the head, free_sub() hands them back at the tail from whatever
+// thread drops or consumes the packet. All buffers live in one slab and are never zeroed.
+struct rx_ring {
+    pthread_mutex_t lock;
+    struct subuff *descs;
+    uint8_t *buffers;
+    struct subuff **free;
+    uint32_t size;          // power of two
+    uint32_t buf_size;
+    uint32_t head;          // next free descriptor to hand out
+    uint32_t tail;          // where the next returned descriptor goes
+    // statistics
+    uint32_t low_water;
+    uint64_t allocs;
+    uint64_t misses;
+};
+
+struct rx_ring *rx_ring_alloc(uint32_t size, uint32_t buf_size);
+struct rx_ring *rx_ring_alloc_on(uint32_t size, uint32_t buf_size, uint8_t *buffers);
+struct subuff *rx_ring_get(struct rx_ring *ring);
+struct subuff *rx_ring_try_get(struct rx_ring *ring);
+void rx_ring_put(struct subuff *sub);
+uint32_t rx_ring_free_count(struct rx_ring *ring);
+
+#endif //ANPNETSTACK_RX_RING_H
@@ -2,63 +2,159 @@
 #include "config.h"
 #include "timer.h"
 #include "tcp.h"
+#include "zerocopy.h"
+#include "sock_hash.h"
+#include "epoch.h"
+#include "sock_poll.h"
+#include <sys/eventfd.h>
 
 
 
 static LIST_HEAD(active_socks);
-static int next_fd = SOCK_FD_START;
 static pthread_rwlock_t socks_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+// fd - SOCK_FD_START indexes a table of ANP_FD_CHUNKS chunks of ANP_FD_CHUNK sockets,
+// allocated as they are needed and kept until exit, so get_sock_by_fd() reads it without
+// a lock. socks_lock guards the writers, the free list and next_fd, the first fd never
+// handed out, which bounds every fd we own.
+#define FD_CHUNK_MASK (ANP_FD_CHUNK - 1)
+static struct sock **fd_table[ANP_FD_CHUNKS];
+static int next_fd = SOCK_FD_START;
+// closed fds, handed out again before next_fd grows
+static int *free_fds;
+static int nr_free_fds;
+static int free_fds_size;
+
+static struct sock **fd_slot(int fd) {
+    int idx = fd - SOCK_FD_START;
+    struct sock **chunk = __atomic_load_n(&fd_table[idx / ANP_FD_CHUNK], __ATOMIC_ACQUIRE);
+
+    return chunk ? &chunk[idx & FD_CHUNK_MASK] : NULL;
+}
+
+// under socks_lock, -1 with errno set if there is no fd left
+static int fd_alloc() {
+    if (nr_free_fds > 0)
+        return free_fds[--nr_free_fds];
+
+    int idx = next_fd - SOCK_FD_START;
+    if (idx >= ANP_FD_CHUNKS * ANP_FD_CHUNK) {
+        errno = EMFILE;
+        return -1;
+    }
+    if (!fd_table[idx / ANP_FD_CHUNK]) {
+        struct sock **chunk = calloc(ANP_FD_CHUNK, sizeof(*chunk));
+        if (!chunk) {
+            errno = ENOMEM;
+            return -1;
+        }
+        __atomic_store_n(&fd_table[idx / ANP_FD_CHUNK], chunk, __ATOMIC_RELEASE);
+    }
+    // fds below it are valid to look up from here on
+    __atomic_store_n(&next_fd, next_fd + 1, __ATOMIC_RELEASE);
+    return SOCK_FD_START + idx;
+}
+
+// under socks_lock
+static void fd_release(int fd) {
+    __atomic_store_n(fd_slot(fd), NULL, __ATOMIC_RELEASE);
+    if (nr_free_fds == free_fds_size) {
+        int size = free_fds_size ? free_fds_size * 2 : ANP_FD_CHUNK;
+        int *fds = realloc(free_fds, size * sizeof(*fds));
+        // the fd is lost then, but not the socket
+        if (!fds)
+            return;
+        free_fds = fds;
+        free_fds_size = size;
+    }
+    free_fds[nr_free_fds++] = fd;
+}
+
 static void free_sock(struct sock *s) {
 	if (!s)
 		return;
 
 	if (s->tcb)
 		free(s->tcb);
+	byte_ring_destroy(&s->rcv_ring);
+	byte_ring_destroy(&s->snd_ring);
 
     pthread_mutex_destroy(&s->conds.state_change_mutex);
     pthread_cond_destroy(&s->conds.state_change_cond);
 	pthread_mutex_destroy(&s->conds.ack_mutex);
 	pthread_cond_destroy(&s->conds.ack_cond);
+	pthread_mutex_destroy(&s->conds.rcv_mutex);
+	pthread_cond_destroy(&s->conds.rcv_cond);
     pthread_rwlock_destroy(&s->rwlock);
 
 	timer_cancel(s->timers.retransmit);
 	timer_cancel(s->timers.persistent);
 	timer_cancel(s->timers.keep_alive);
 	timer_cancel(s->timers.time_wait);
+	timer_cancel(s->timers.delack);
+	// unacked segments hold zero copy sends and sendfile() mappings, which end with them
+	sub_queue_free(&s->snd_queue);
+	zc_queue_put(s->zc_queue);
+	// a kernel fd, our close() passes it on
+	if (s->efd >= 0)
+		close(s->efd);
 
 	free(s);
 }
 
+static void sock_reclaim(struct epoch_head *head) {
+    free_sock(list_entry(head, struct sock, epoch));
+}
+
+static void tcb_reclaim(struct epoch_head *head) {
+    free(list_entry(head, struct tcb, epoch));
+}
+
 struct sock *alloc_sock() {
     struct sock *sock = calloc(sizeof *sock, 1);
 
 	if (!sock)
-		goto end;
+		return NULL;
 
 	pthread_rwlock_wrlock(&socks_lock);
-    sock->fd = next_fd++;
-    change_state(sock, TCP_CLOSED);
+    sock->efd = -1;
+    sock->tcp_state = TCP_CLOSED;
 	sock->err = 0;
-    sock->tcb = calloc(sizeof *sock->tcb, 1);
-    if (!sock->tcb) {
-        free_sock(sock);
-        sock = NULL;
-        goto end;
-    }
+    // what free_sock() tears down is set up first, so it can take a half built socket
     pthread_mutex_init(&sock->conds.state_change_mutex, NULL);
     pthread_cond_init(&sock->conds.state_change_cond, NULL);
 	pthread_mutex_init(&sock->conds.ack_mutex, NULL);
 	pthread_cond_init(&sock->conds.ack_cond, NULL);
+	pthread_mutex_init(&sock->conds.rcv_mutex, NULL);
+	pthread_cond_init(&sock->conds.rcv_cond, NULL);
     pthread_rwlock_init(&sock->rwlock, NULL);
 	sock->timers.retransmit = NULL;
 	sock->timers.persistent = NULL;
 	sock->timers.keep_alive = NULL;
 	sock->timers.time_wait = NULL;
+	sock->timers.delack = NULL;
+	sock->quickack = true;
+	sock->rcvlowat = 1;
+	sock->notsent_lowat = UINT32_MAX;
 	sub_queue_init(&sock->snd_queue);
-	sub_queue_init(&sock->rcv_queue);
+	list_init(&sock->accept_queue);
+	list_init(&sock->syn_queue);
+	list_init(&sock->accept_list);
+	list_init(&sock->ep_items);
     list_init(&sock->list);
+    sock->tcb = calloc(sizeof *sock->tcb, 1);
+    if (!sock->tcb || byte_ring_init(&sock->rcv_ring, ANP_SOCK_RCVBUF) < 0 ||
+        byte_ring_init(&sock->snd_ring, ANP_SOCK_SNDBUF) < 0 ||
+        (sock->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || (sock->fd = fd_alloc()) < 0) {
+        // e.g. the EMFILE of fd_alloc(), close() of the eventfd must not clobber it
+        int err = errno;
+        free_sock(sock);
+        errno = err;
+        sock = NULL;
+        goto end;
+    }
     list_add_tail(&sock->list, &active_socks);
+    __atomic_store_n(fd_slot(sock->fd), sock, __ATOMIC_RELEASE);
 
 end:
     pthread_rwlock_unlock(&socks_lock);
@@ -73,10 +169,12 @@ void reset_sock(struct sock *sock) {
 
     change_state(sock, TCP_CLOSED);
 	sock->err = 0;
+	// e.g. the sender reads it under ack_mutex only
 	if (sock->tcb)
-		free(sock->tcb);
+		epoch_retire(&sock->tcb->epoch, tcb_reclaim);
 
 	sock->tcb = calloc(sizeof *sock->tcb, 1);
+	sock_hash_del(sock);
 	sock->sport = 0;
 	sock->dport = 0;
 	sock->saddr = 0;
@@ -89,76 +187,108 @@ void reset_sock(struct sock *sock) {
 	sock->timers.keep_alive = NULL;
 	timer_cancel(sock->timers.time_wait);
 	sock->timers.time_wait = NULL;
-	sub_queue_free(&sock->rcv_queue);
+	timer_cancel(sock->timers.delack);
+	sock->timers.delack = NULL;
+	sock->delack_segs = 0;
+	byte_ring_reset(&sock->rcv_ring);
+	byte_ring_reset(&sock->snd_ring);
+	sock->snd_zc = false;
 	sub_queue_free(&sock->snd_queue);
 
 	pthread_rwlock_unlock(&sock->rwlock);
 }
 
+// every intercepted call asks, most of them about kernel fds which fail the range check
 struct sock *get_sock_by_fd(int fd) {
-    struct list_head *item;
-    struct sock *entry;
-
-    pthread_rwlock_rdlock(&socks_lock);
-    list_for_each(item, &active_socks) {
-        entry = list_entry(item, struct sock, list);
-        if (entry->fd == fd) {
-            printf("found socket: %d\n", fd);
-            goto end;
-        }
-    }
-    // if we reach here we didn't find the socket linked to the fd;
-    entry = NULL;
+    if (fd < SOCK_FD_START || fd >= __atomic_load_n(&next_fd, __ATOMIC_ACQUIRE))
+        return NULL;
 
-end:
-    pthread_rwlock_unlock(&socks_lock);
-    return entry;
+    struct sock **slot = fd_slot(fd);
+    return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
 }
 
+// the same cost for 10 or 100k connections, see sock_hash.c
 struct sock *get_sock_by_connection(uint16_t sport, uint16_t dport, uint32_t saddr, uint32_t daddr) {
+    return sock_hash_lookup(sport, dport, saddr, daddr);
+}
+
+// the socket listening on port, bound either to addr or to any address. Listeners are in
+// the connection hash with a zero remote end, see tcp_listen().
+struct sock *get_listen_sock(uint16_t port, uint32_t addr) {
+    struct sock *entry = sock_hash_lookup(port, 0, addr, 0);
+
+    if (!entry || entry->tcp_state != TCP_LISTEN)
+        entry = sock_hash_lookup(port, 0, INADDR_ANY, 0);
+    return entry && entry->tcp_state == TCP_LISTEN ? entry : NULL;
+}
+
+bool sock_port_in_use(uint16_t port, uint32_t addr) {
     struct list_head *item;
     struct sock *entry;
+    bool ret = false;
 
     pthread_rwlock_rdlock(&socks_lock);
     list_for_each(item, &active_socks) {
         entry = list_entry(item, struct sock, list);
-        if (sport == entry->sport && dport == entry->dport &&
-            saddr == entry->saddr && daddr == entry->daddr) {
-            printf("found socket for sport: %d and dport: %d\n", entry->sport, entry->dport);
-            goto end;
+        if (entry->sport == port &&
+            (entry->saddr == INADDR_ANY || addr == INADDR_ANY || entry->saddr == addr)) {
+            ret = true;
+            break;
         }
     }
-    // if we reach here we didn't find the socket linked to the fd;
-    entry = NULL;
-
-end:
     pthread_rwlock_unlock(&socks_lock);
-    return entry;
+    return ret;
 }
 
+/*
+ * The RX thread and timer handlers may still hold the socket without a lock. It is
+ * unlinked and closed here, and freed by the epoch code once all of them have let go.
+ */
 void remove_sock(int fd) {
-	struct list_head *item;
     struct sock *entry;
-    int rc;
 
+    epoch_enter();
+    entry = get_sock_by_fd(fd);
+    if (entry)
+        remove_sock_entry(entry);
+    epoch_exit();
+}
+
+// remove_sock() of a socket the caller holds, from within an epoch. Nothing happens if it
+// was removed already, even when its fd belongs to another socket by now.
+void remove_sock_entry(struct sock *entry) {
+    int fd = entry->fd;
+
+    // in this order, a passive open in tcp_rx() allocates a socket with its listener locked
+    pthread_rwlock_wrlock(&entry->rwlock);
     pthread_rwlock_wrlock(&socks_lock);
-    list_for_each(item, &active_socks) {
-        entry = list_entry(item, struct sock, list);
-        if (entry->fd == fd) {
-            if ((rc = pthread_rwlock_trywrlock(&entry->rwlock)) == EBUSY) {
-                printf("Cannot remove socket with fd: %d. Lock is held elsewhere\n", fd);
-                return;
-            }
-        #ifdef M3_DEBUG
-        printf("removing socket attached to: %d\n", fd);
-        #endif
-			list_del(&entry->list);
-            pthread_rwlock_unlock(&entry->rwlock);
-			free_sock(entry);
-            goto end;
-        }
+    // a concurrent close() of the fd was first
+    if (get_sock_by_fd(fd) != entry) {
+        pthread_rwlock_unlock(&socks_lock);
+        pthread_rwlock_unlock(&entry->rwlock);
+        return;
     }
-
-end:
+#ifdef M3_DEBUG
+    printf("removing socket attached to: %d\n", fd);
+#endif
+    list_del(&entry->list);
+    sock_hash_del(entry);
+    fd_release(fd);
     pthread_rwlock_unlock(&socks_lock);
+    sock_poll_release(entry);
+
+    // whoever still finds it sees a closed socket, and arms no new timer
+    change_state(entry, TCP_CLOSED);
+    timer_cancel(entry->timers.retransmit);
+    entry->timers.retransmit = NULL;
+    timer_cancel(entry->timers.persistent);
+    entry->timers.persistent = NULL;
+    timer_cancel(entry->timers.keep_alive);
+    entry->timers.keep_alive = NULL;
+    timer_cancel(entry->timers.time_wait);
+    entry->timers.time_wait = NULL;
+    timer_cancel(entry->timers.delack);
+    entry->timers.delack = NULL;
+    pthread_rwlock_unlock(&entry->rwlock);
+    epoch_retire(&entry->epoch, sock_reclaim);
 }
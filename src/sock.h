@@ -6,6 +6,8 @@
 #include "linklist.h"
 #include "systems_headers.h"
 #include "subuff.h"
+#include "byte_ring.h"
+#include "epoch.h"
 
 
 
@@ -18,6 +20,9 @@ struct sock_conds {
     pthread_cond_t state_change_cond;
     pthread_mutex_t ack_mutex;
     pthread_cond_t ack_cond;
+    // a reader that found the receive ring empty sleeps here, see tcp_rcv_wake()
+    pthread_mutex_t rcv_mutex;
+    pthread_cond_t rcv_cond;
 };
 
 // https://www.geeksforgeeks.org/tcp-timers/
@@ -32,31 +37,82 @@ struct tcp_timers {
     struct timer *persistent;
     struct timer *keep_alive;
     struct timer *time_wait;
+    // an ack held back when TCP_QUICKACK is off
+    struct timer *delack;
 };
 
 struct sock {
     struct list_head list;
+    // the connection hash, keyed on the 4-tuple below once it is complete
+    struct sock *hash_next;
+    uint32_t hash;
+    bool hashed;
     int fd;
     int tcp_state;
+    // the error of the last call that failed, for errno
     int err;
+    // an error of the connection itself (e.g. a timed out handshake), for poll() and SO_ERROR
+    int so_error;
+    // O_NONBLOCK, calls return EAGAIN (or connect() EINPROGRESS) rather than wait
+    bool nonblock;
+    // TCP_NODELAY and TCP_CORK, read by the sender under conds.ack_mutex
+    bool nodelay;
+    bool cork;
+    // TCP_QUICKACK, without it tcp_rx() acks every second segment, delack_segs counts them
+    bool quickack;
+    int delack_segs;
+    // SO_RCVLOWAT and TCP_NOTSENT_LOWAT, bytes that make the socket readable or writable
+    uint32_t rcvlowat;
+    uint32_t notsent_lowat;
     struct tcb *tcb;
     uint16_t sport;
     uint16_t dport;
     uint32_t saddr;
     uint32_t daddr;
+    // largest segment payload, the smaller of what our device and the peer can take
+    uint16_t mss;
     pthread_rwlock_t rwlock;
     struct sock_conds conds;
     struct tcp_timers timers;
-    struct subuff_head rcv_queue;
+    // received data the application has yet to read, its free space is our receive window.
+    // tcp_rx() writes it under the rwlock, the reader takes from it without any lock.
+    struct byte_ring rcv_ring;
+    int rcv_sleepers;
     struct subuff_head snd_queue;
-    // TODO: add ring buffer for receiving/sending data here?
+    // a listening socket keeps its established, not yet accepted connections here,
+    // guarded by conds.state_change_mutex so accept() can wait on state_change_cond
+    struct list_head accept_queue;
+    int accept_len;
+    int backlog;
+    // connections in syn-received that came in on a listening socket, same mutex
+    struct list_head syn_queue;
+    int syn_len;
+    // entry of a passively opened connection on its listener's syn_queue or accept_queue,
+    // and that listener (NULL once the connection is accepted or dropped), same mutex
+    struct list_head accept_list;
+    struct sock *listener;
+    // completions of MSG_ZEROCOPY sends, allocated with the first one
+    struct zc_queue *zc_queue;
+    // data send() took that is not cut into segments yet, and whether a MSG_ZEROCOPY send
+    // is segmenting the application's buffer meanwhile, both guarded by conds.ack_mutex
+    struct byte_ring snd_ring;
+    bool snd_zc;
+    // remove_sock() hands it to the epoch code to be freed
+    struct epoch_head epoch;
+    // what poll(), select() and epoll wait on in place of the socket, see sock_poll.h
+    int efd;
+    bool poll_pending;
+    struct list_head ep_items;
 };
 
 struct sock *alloc_sock();
 void reset_sock(struct sock *sock);
 struct sock *get_sock_by_fd(int fd);
 struct sock *get_sock_by_connection(uint16_t sport, uint16_t dport, uint32_t saddr, uint32_t daddr);
+struct sock *get_listen_sock(uint16_t port, uint32_t addr);
+bool sock_port_in_use(uint16_t port, uint32_t addr);
 void remove_sock(int fd);
+void remove_sock_entry(struct sock *entry);
 
 
 
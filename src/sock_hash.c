@@ -0,0 +1,239 @@
+/*
+ * A chained hash table of connected sockets, keyed on (sport, dport, saddr, daddr) with
+ * jhash and a random seed, so that peers can not pick tuples that land in one bucket.
+ *
+ * Lookups take no lock, they walk the chains inside an epoch critical section (epoch.h)
+ * and a removed socket is only freed after they left. Writers lock one of the
+ * ANP_SOCK_HASH_LOCKS stripes, bucket i by stripe i % ANP_SOCK_HASH_LOCKS. The number of
+ * buckets is a power of two and a multiple of the number of stripes, so a socket keeps
+ * its stripe when the table doubles. The table grows once there are more sockets than
+ * buckets, with all stripes held. Readers that raced with the move of the sockets to the
+ * new table notice it by resize_seq and look again.
+ */
+#include "sock_hash.h"
+#include "sock.h"
+#include "config.h"
+#include "utilities.h"
+#include "anpnetstack.h"
+#include "epoch.h"
+#include "jhash.h"
+#include <sys/random.h>
+
+// its own cache line, the lookup counters of one stripe do not slow down the others
+struct sock_hash_stripe {
+    pthread_mutex_t lock;
+    uint64_t lookups;
+    uint64_t probes;
+} __attribute__((aligned(64)));
+
+struct sock_hash_table {
+    struct epoch_head epoch;
+    uint32_t size;
+    struct sock *buckets[];
+};
+
+static struct sock_hash_stripe stripes[ANP_SOCK_HASH_LOCKS];
+static struct sock_hash_table *table;
+// odd while sock_hash_grow() moves the sockets
+static uint32_t resize_seq;
+static uint32_t nr_socks;
+static uint32_t seed;
+static uint64_t resizes;
+
+static uint32_t sock_hash_key(uint16_t sport, uint16_t dport, uint32_t saddr, uint32_t daddr)
+{
+    return jhash_3words(saddr, daddr, ((uint32_t) sport << 16) | dport, seed);
+}
+
+static struct sock_hash_stripe *sock_hash_stripe(uint32_t hash)
+{
+    return &stripes[hash & (ANP_SOCK_HASH_LOCKS - 1)];
+}
+
+static struct sock_hash_table *sock_hash_table_alloc(uint32_t size)
+{
+    struct sock_hash_table *t = calloc(1, sizeof(*t) + size * sizeof(t->buckets[0]));
+    if (t) {
+        t->size = size;
+    }
+    return t;
+}
+
+static void sock_hash_table_free(struct epoch_head *head)
+{
+    free(list_entry(head, struct sock_hash_table, epoch));
+}
+
+int sock_hash_init()
+{
+    assert((ANP_SOCK_HASH_LOCKS & (ANP_SOCK_HASH_LOCKS - 1)) == 0);
+    assert(ANP_SOCK_HASH_BUCKETS % ANP_SOCK_HASH_LOCKS == 0);
+
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        seed = time(NULL) ^ getpid();
+    }
+    for (int i = 0; i < ANP_SOCK_HASH_LOCKS; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+    table = sock_hash_table_alloc(ANP_SOCK_HASH_BUCKETS);
+    if (!table) {
+        printf("Error: socket hash of %d buckets could not be allocated \n", ANP_SOCK_HASH_BUCKETS);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void sock_hash_lock_all()
+{
+    for (int i = 0; i < ANP_SOCK_HASH_LOCKS; i++) {
+        pthread_mutex_lock(&stripes[i].lock);
+    }
+}
+
+static void sock_hash_unlock_all()
+{
+    for (int i = ANP_SOCK_HASH_LOCKS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+}
+
+/*
+ * Doubles the table, sockets move by the hash they were added with. A reader on an old
+ * chain can follow a moved socket into a new chain, those only lead to sockets moved
+ * before, so its walk still ends.
+ */
+static void sock_hash_grow()
+{
+    sock_hash_lock_all();
+    struct sock_hash_table *old = table, *new;
+    // someone else grew it meanwhile
+    if (nr_socks <= old->size) {
+        sock_hash_unlock_all();
+        return;
+    }
+    new = sock_hash_table_alloc(old->size * 2);
+    if (!new) {
+        // longer chains, but everything still works
+        printf("Error: socket hash could not grow to %u buckets \n", old->size * 2);
+        sock_hash_unlock_all();
+        return;
+    }
+    __atomic_store_n(&resize_seq, resize_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < old->size; i++) {
+        struct sock *sock = old->buckets[i], *next;
+        for (; sock; sock = next) {
+            struct sock **bucket = &new->buckets[sock->hash & (new->size - 1)];
+            next = sock->hash_next;
+            __atomic_store_n(&sock->hash_next, *bucket, __ATOMIC_RELAXED);
+            *bucket = sock;
+        }
+    }
+    __atomic_store_n(&table, new, __ATOMIC_RELEASE);
+    __atomic_store_n(&resize_seq, resize_seq + 1, __ATOMIC_RELEASE);
+    resizes++;
+    sock_hash_unlock_all();
+    epoch_retire(&old->epoch, sock_hash_table_free);
+}
+
+// the socket must have its 4-tuple, it is found by sock_hash_lookup() from here on
+void sock_hash_add(struct sock *sock)
+{
+    sock_hash_del(sock);
+    uint32_t hash = sock_hash_key(sock->sport, sock->dport, sock->saddr, sock->daddr);
+    struct sock_hash_stripe *stripe = sock_hash_stripe(hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    struct sock **bucket = &table->buckets[hash & (table->size - 1)];
+    sock->hash = hash;
+    sock->hash_next = *bucket;
+    // published with its tuple and link
+    __atomic_store_n(bucket, sock, __ATOMIC_RELEASE);
+    sock->hashed = true;
+    uint32_t size = table->size;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (__atomic_add_fetch(&nr_socks, 1, __ATOMIC_RELAXED) > size) {
+        sock_hash_grow();
+    }
+}
+
+void sock_hash_del(struct sock *sock)
+{
+    if (!sock->hashed) {
+        return;
+    }
+    struct sock_hash_stripe *stripe = sock_hash_stripe(sock->hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    struct sock **pos = &table->buckets[sock->hash & (table->size - 1)];
+    while (*pos && *pos != sock) {
+        pos = &(*pos)->hash_next;
+    }
+    // hash_next stays, a reader standing on the socket continues along the chain. If the
+    // socket is added again right away it may miss the rest of this chain, a lost segment.
+    if (*pos) {
+        __atomic_store_n(pos, sock->hash_next, __ATOMIC_RELEASE);
+    }
+    sock->hashed = false;
+    pthread_mutex_unlock(&stripe->lock);
+    __atomic_sub_fetch(&nr_socks, 1, __ATOMIC_RELAXED);
+}
+
+// the caller must be in an epoch critical section for as long as it uses the socket
+struct sock *sock_hash_lookup(uint16_t sport, uint16_t dport, uint32_t saddr, uint32_t daddr)
+{
+    uint32_t hash = sock_hash_key(sport, dport, saddr, daddr);
+    struct sock_hash_stripe *stripe = sock_hash_stripe(hash);
+    uint64_t probes = 0;
+    uint32_t seq;
+    struct sock *sock;
+
+    epoch_enter();
+retry:
+    seq = __atomic_load_n(&resize_seq, __ATOMIC_ACQUIRE);
+    struct sock_hash_table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    sock = __atomic_load_n(&t->buckets[hash & (t->size - 1)], __ATOMIC_ACQUIRE);
+    for (; sock; sock = __atomic_load_n(&sock->hash_next, __ATOMIC_ACQUIRE)) {
+        probes++;
+        if (sock->hash == hash && sock->sport == sport && sock->dport == dport &&
+            sock->saddr == saddr && sock->daddr == daddr) {
+            break;
+        }
+    }
+    // a miss may be wrong if the sockets moved meanwhile, a hit is not
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!sock && ((seq & 1) || __atomic_load_n(&resize_seq, __ATOMIC_RELAXED) != seq)) {
+        goto retry;
+    }
+    epoch_exit();
+    // other readers of the stripe count as well
+    __atomic_fetch_add(&stripe->lookups, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stripe->probes, probes, __ATOMIC_RELAXED);
+    return sock;
+}
+
+int anp_sock_hash_stats(struct anp_sock_hash_stats *stats)
+{
+    if (!stats) {
+        return -EINVAL;
+    }
+    memset(stats, 0, sizeof(*stats));
+    sock_hash_lock_all();
+    stats->buckets = table->size;
+    stats->sockets = nr_socks;
+    stats->resizes = resizes;
+    for (uint32_t i = 0; i < table->size; i++) {
+        uint32_t chain = 0;
+        for (struct sock *sock = table->buckets[i]; sock; sock = sock->hash_next) {
+            chain++;
+        }
+        stats->max_chain = ANP_MAX(stats->max_chain, chain);
+    }
+    for (int i = 0; i < ANP_SOCK_HASH_LOCKS; i++) {
+        stats->lookups += __atomic_load_n(&stripes[i].lookups, __ATOMIC_RELAXED);
+        stats->probes += __atomic_load_n(&stripes[i].probes, __ATOMIC_RELAXED);
+    }
+    sock_hash_unlock_all();
+    return 0;
+}
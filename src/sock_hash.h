@@ -0,0 +1,14 @@
+#ifndef ANPNETSTACK_SOCK_HASH_H
+#define ANPNETSTACK_SOCK_HASH_H
+
+#include "systems_headers.h"
+
+struct sock;
+
+// Connected sockets by their 4-tuple, for tcp_rx() to find the socket of a segment.
+int sock_hash_init();
+void sock_hash_add(struct sock *sock);
+void sock_hash_del(struct sock *sock);
+struct sock *sock_hash_lookup(uint16_t sport, uint16_t dport, uint32_t saddr, uint32_t daddr);
+
+#endif //ANPNETSTACK_SOCK_HASH_H
@@ -0,0 +1,363 @@
+/*
+ * The eventfd of a socket is a hint, not its state. sock_poll_wake() writes it once and
+ * sets poll_pending, later wakes are free until a waiter clears poll_pending again. A
+ * level triggered waiter leaves it signaled while the socket is ready, and drains it when
+ * it is not. An edge triggered one only clears poll_pending, so the next transition writes
+ * again and epoll sees a new edge, without a syscall on our side.
+ *
+ * An epoll registration of a socket is an item on sock->ep_items, the eventfd is added to
+ * the epoll set with the socket's fd and SOCK_EPOLL_TAG as its data. sock_epoll_filter()
+ * tells them from the application's own data by the tag, and finds the item again under
+ * ep_lock, so a report that races with EPOLL_CTL_DEL never sees a freed item.
+ */
+#include "sock_poll.h"
+#include "sock.h"
+#include "tcp.h"
+#include "config.h"
+#include "epoch.h"
+#include "utilities.h"
+#include <sys/eventfd.h>
+
+struct sock_epitem {
+    int epfd;
+    // what the application asked for and gets back
+    uint32_t events;
+    epoll_data_t data;
+    // on sock->ep_items
+    struct list_head list;
+};
+
+// the upper half of the epoll data of an eventfd, the lower one is the socket's fd
+#define SOCK_EPOLL_TAG 0x414e5045ULL
+
+static pthread_mutex_t ep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sock_poll_wake(struct sock *sock)
+{
+    if (!__atomic_exchange_n(&sock->poll_pending, true, __ATOMIC_SEQ_CST))
+        eventfd_write(sock->efd, 1);
+}
+
+/*
+ * What the socket is ready for out of events. If that is nothing its eventfd is drained,
+ * unless the waiter is edge triggered. signaled tells whether the kernel saw the eventfd
+ * readable, there is nothing to drain otherwise.
+ */
+static uint32_t sock_poll_ready(struct sock *sock, uint32_t events, bool edge, bool signaled)
+{
+    // errors and hang ups are reported whether asked for or not
+    events |= POLLERR | POLLHUP;
+    if (edge) {
+        __atomic_store_n(&sock->poll_pending, false, __ATOMIC_SEQ_CST);
+        return tcp_poll(sock) & events;
+    }
+    uint32_t mask = tcp_poll(sock) & events;
+    if (mask || !signaled)
+        return mask;
+
+    eventfd_t val;
+    __atomic_store_n(&sock->poll_pending, false, __ATOMIC_SEQ_CST);
+    eventfd_read(sock->efd, &val);
+    // a transition between tcp_poll() and the drain, its wake may be gone with it
+    mask = tcp_poll(sock) & events;
+    if (mask)
+        sock_poll_wake(sock);
+    return mask;
+}
+
+int sock_poll_timeout(int timeout, const struct timespec *start)
+{
+    struct timespec now;
+
+    if (timeout <= 0)
+        return timeout;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t passed = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+    return passed < timeout ? timeout - passed : 0;
+}
+
+static uint64_t sock_epoll_data(struct sock *sock)
+{
+    return SOCK_EPOLL_TAG << 32 | (uint32_t) sock->fd;
+}
+
+static struct sock_epitem *sock_epitem_find(struct sock *sock, int epfd)
+{
+    struct list_head *pos;
+
+    list_for_each(pos, &sock->ep_items) {
+        struct sock_epitem *item = list_entry(pos, struct sock_epitem, list);
+        if (item->epfd == epfd)
+            return item;
+    }
+    return NULL;
+}
+
+// under ep_lock
+static void sock_epitem_free(struct sock_epitem *item)
+{
+    list_del(&item->list);
+    free(item);
+}
+
+/*
+ * The eventfd goes into the epoll set in place of the socket, always for EPOLLIN. Flags
+ * that decide how the kernel reports it are passed on as they are.
+ */
+int sock_epoll_ctl(int epfd, int op, struct sock *sock, struct epoll_event *event)
+{
+    struct epoll_event ev = {0};
+    struct sock_epitem *item;
+    int ret = -1;
+
+    if (op != EPOLL_CTL_DEL && !event) {
+        errno = EFAULT;
+        return -1;
+    }
+    pthread_mutex_lock(&ep_lock);
+    item = sock_epitem_find(sock, epfd);
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (item) {
+                errno = EEXIST;
+                goto out;
+            }
+            if (!(item = malloc(sizeof(*item)))) {
+                errno = ENOMEM;
+                goto out;
+            }
+            item->epfd = epfd;
+            list_add_tail(&item->list, &sock->ep_items);
+            break;
+        case EPOLL_CTL_MOD:
+        case EPOLL_CTL_DEL:
+            if (!item) {
+                errno = ENOENT;
+                goto out;
+            }
+            break;
+        default:
+            errno = EINVAL;
+            goto out;
+    }
+    if (event) {
+        item->events = event->events;
+        item->data = event->data;
+        ev.events = EPOLLIN | (event->events & (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP));
+        ev.data.u64 = sock_epoll_data(sock);
+    }
+    // a kernel fd, our epoll_ctl() passes it on
+    ret = epoll_ctl(epfd, op, sock->efd, &ev);
+    if ((ret < 0 && op == EPOLL_CTL_ADD) || (ret == 0 && op == EPOLL_CTL_DEL))
+        sock_epitem_free(item);
+    // the eventfd may be drained while the socket is ready for what it is asked for now
+    else if (ret == 0 && (tcp_poll(sock) & (item->events | POLLERR | POLLHUP)))
+        sock_poll_wake(sock);
+
+out:
+    pthread_mutex_unlock(&ep_lock);
+    return ret;
+}
+
+void sock_poll_release(struct sock *sock)
+{
+    struct list_head *pos, *tmp;
+
+    pthread_mutex_lock(&ep_lock);
+    list_for_each_safe(pos, tmp, &sock->ep_items) {
+        struct sock_epitem *item = list_entry(pos, struct sock_epitem, list);
+        // the eventfd lives on until the socket is freed, it would report for a closed fd
+        epoll_ctl(item->epfd, EPOLL_CTL_DEL, sock->efd, NULL);
+        sock_epitem_free(item);
+    }
+    pthread_mutex_unlock(&ep_lock);
+}
+
+int sock_epoll_filter(int epfd, struct epoll_event *events, int n)
+{
+    int out = 0;
+
+    epoch_enter();
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u64 >> 32 != SOCK_EPOLL_TAG) {
+            events[out++] = events[i];
+            continue;
+        }
+        // the socket or its registration may be gone meanwhile, the report is dropped then
+        struct sock *sock = get_sock_by_fd((int) (uint32_t) events[i].data.u64);
+        if (!sock)
+            continue;
+        pthread_mutex_lock(&ep_lock);
+        struct sock_epitem *item = sock_epitem_find(sock, epfd);
+        uint32_t wanted = item ? item->events : 0;
+        epoll_data_t data = item ? item->data : (epoll_data_t) { 0 };
+        pthread_mutex_unlock(&ep_lock);
+        if (!item)
+            continue;
+        uint32_t mask = sock_poll_ready(sock, wanted, wanted & EPOLLET, true);
+        if (mask) {
+            events[out].events = mask;
+            events[out].data = data;
+            out++;
+        } else if (wanted & EPOLLONESHOT) {
+            // the kernel disabled it with this report, which the application never sees
+            struct epoll_event ev = { .events = EPOLLIN | (wanted & (EPOLLET | EPOLLONESHOT)),
+                                      .data.u64 = sock_epoll_data(sock) };
+            epoll_ctl(epfd, EPOLL_CTL_MOD, sock->efd, &ev);
+        }
+    }
+    epoch_exit();
+    return out;
+}
+
+bool sock_poll_any(struct pollfd *fds, nfds_t nfds)
+{
+    for (nfds_t i = 0; i < nfds; i++) {
+        if (fds[i].fd >= SOCK_FD_START && get_sock_by_fd(fds[i].fd))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * poll() with sockets among fds: they are polled through their eventfds, together with
+ * the kernel fds. The eventfd can be signaled while the socket is not ready for what the
+ * caller wants, the wait goes on for the rest of the timeout then. No epoch is held while
+ * we sleep, which can be forever, so the sockets are looked up again after it.
+ */
+int sock_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct pollfd local[ANP_POLL_STACK_FDS];
+    struct pollfd *kfds = nfds <= ANP_POLL_STACK_FDS ? local : malloc(nfds * sizeof(*kfds));
+    struct timespec start;
+    int ret;
+
+    if (!kfds) {
+        errno = ENOMEM;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        int wait = sock_poll_timeout(timeout, &start);
+        epoch_enter();
+        for (nfds_t i = 0; i < nfds; i++) {
+            struct sock *sock = get_sock_by_fd(fds[i].fd);
+            kfds[i] = fds[i];
+            if (sock) {
+                kfds[i].fd = sock->efd;
+                kfds[i].events = POLLIN;
+                // no need to sleep if it is ready already
+                if (sock_poll_ready(sock, fds[i].events, false, false))
+                    wait = 0;
+            }
+        }
+        epoch_exit();
+        ret = poll(kfds, nfds, wait);
+        if (ret < 0)
+            break;
+        ret = 0;
+        epoch_enter();
+        for (nfds_t i = 0; i < nfds; i++) {
+            struct sock *sock;
+            if (kfds[i].fd == fds[i].fd)
+                fds[i].revents = kfds[i].revents;
+            else if ((sock = get_sock_by_fd(fds[i].fd)))
+                // the fd may be another socket by now, whose eventfd we did not wait on
+                fds[i].revents = sock_poll_ready(sock, fds[i].events, false,
+                                                 sock->efd == kfds[i].fd && (kfds[i].revents & POLLIN));
+            else
+                // closed while we waited
+                fds[i].revents = POLLNVAL;
+            if (fds[i].revents)
+                ret++;
+        }
+        epoch_exit();
+    } while (ret == 0 && sock_poll_timeout(timeout, &start) != 0);
+
+    if (kfds != local)
+        free(kfds);
+    return ret;
+}
+
+/*
+ * Sockets are far beyond FD_SETSIZE, where the FD_ macros refuse to work with
+ * _FORTIFY_SOURCE. An application that selects on them sizes its sets by nfds.
+ */
+#define SET_BITS (8 * sizeof(unsigned long))
+
+static bool set_has(fd_set *set, int fd)
+{
+    return set && (((unsigned long *) set)[fd / SET_BITS] & (1UL << (fd % SET_BITS)));
+}
+
+static void set_clear(fd_set *set, int fd)
+{
+    ((unsigned long *) set)[fd / SET_BITS] &= ~(1UL << (fd % SET_BITS));
+}
+
+// select() through sock_poll(), the sets are walked a word at a time as they can be large
+int sock_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout)
+{
+    const int bits = SET_BITS;
+    fd_set *sets[] = { readfds, writefds, exceptfds };
+    const short events[] = { POLLIN, POLLOUT, POLLPRI };
+    struct pollfd *fds = NULL;
+    nfds_t n = 0, size = 0;
+    int ret = -1;
+
+    for (int w = 0; w < (nfds + bits - 1) / bits; w++) {
+        unsigned long word = 0;
+        for (int s = 0; s < 3; s++)
+            word |= sets[s] ? ((unsigned long *) sets[s])[w] : 0;
+        for (; word; word &= word - 1) {
+            int fd = w * bits + __builtin_ctzl(word);
+            if (fd >= nfds)
+                break;
+            if (n == size) {
+                size = size ? 2 * size : ANP_POLL_STACK_FDS;
+                struct pollfd *grown = realloc(fds, size * sizeof(*fds));
+                if (!grown) {
+                    errno = ENOMEM;
+                    goto out;
+                }
+                fds = grown;
+            }
+            fds[n].fd = fd;
+            fds[n].events = 0;
+            for (int s = 0; s < 3; s++) {
+                if (set_has(sets[s], fd))
+                    fds[n].events |= events[s];
+            }
+            n++;
+        }
+    }
+
+    int64_t wait = timeout ? (int64_t) timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000 : -1;
+    if (sock_poll(fds, n, ANP_MIN(wait, INT_MAX)) < 0)
+        goto out;
+
+    ret = 0;
+    for (nfds_t i = 0; i < n; i++) {
+        if (fds[i].revents & POLLNVAL) {
+            errno = EBADF;
+            ret = -1;
+            goto out;
+        }
+    }
+    for (nfds_t i = 0; i < n; i++) {
+        short rev = fds[i].revents;
+        int fd = fds[i].fd;
+        if (set_has(readfds, fd) && !(rev & (POLLIN | POLLHUP | POLLERR)))
+            set_clear(readfds, fd);
+        if (set_has(writefds, fd) && !(rev & (POLLOUT | POLLERR)))
+            set_clear(writefds, fd);
+        if (set_has(exceptfds, fd) && !(rev & POLLPRI))
+            set_clear(exceptfds, fd);
+        for (int s = 0; s < 3; s++)
+            ret += set_has(sets[s], fd);
+    }
+
+out:
+    free(fds);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef ANPNETSTACK_SOCK_POLL_H
+#define ANPNETSTACK_SOCK_POLL_H
+
+#include "systems_headers.h"
+#include <sys/epoll.h>
+#include <sys/select.h>
+
+struct sock;
+
+/*
+ * Every socket has an eventfd (sock->efd) the kernel can wait on in place of it. The stack
+ * signals it on transitions that may make the socket readable or writable, the wrappers
+ * below wait on it and then ask tcp_poll() what the socket is actually ready for.
+ */
+void sock_poll_wake(struct sock *sock);
+// drops the socket from every epoll set it is in, called by remove_sock()
+void sock_poll_release(struct sock *sock);
+
+int sock_epoll_ctl(int epfd, int op, struct sock *sock, struct epoll_event *event);
+// rewrites the events of sockets in place, returns how many events are left
+int sock_epoll_filter(int epfd, struct epoll_event *events, int n);
+// what is left of a timeout in ms (-1 is forever) that started at start
+int sock_poll_timeout(int timeout, const struct timespec *start);
+bool sock_poll_any(struct pollfd *fds, nfds_t nfds);
+int sock_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int sock_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+
+#endif //ANPNETSTACK_SOCK_POLL_H
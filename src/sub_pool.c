@@ -0,0 +1,327 @@
+/*
+ * Size classed pools for subuffs, a subuff and its buffer are one allocation. Every thread
+ * caches free subuffs in two magazines per class (Bonwick's magazine layer), alloc_sub()
+ * and free_sub() pop and push there without a lock. Only when both magazines of a thread
+ * are empty (or full) it goes to the depot of the class to swap a whole magazine, and only
+ * when the depot has nothing either does it fall back to malloc(), counted as a miss.
+ * https://www.usenix.org/legacy/event/usenix01/full_papers/bonwick/bonwick.pdf
+ */
+
+#include "sub_pool.h"
+#include "config.h"
+#include "utilities.h"
+
+static struct sub_class classes[ANP_SUB_POOL_CLASSES] = {
+    { .size = ANP_SUB_POOL_HDR_SIZE,   .mag_size = 64, .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = ANP_SUB_POOL_MTU_SIZE,   .mag_size = 32, .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = ANP_SUB_POOL_JUMBO_SIZE, .mag_size = 16, .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = ANP_SUB_POOL_GSO_SIZE,   .mag_size = 8,  .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static __thread struct sub_cache *my_cache;
+// the caches of all threads for the stats, a thread's cache leaves it when the thread exits
+static LIST_HEAD(caches);
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static int sub_pool_class(unsigned int size)
+{
+    for (int i = 0; i < ANP_SUB_POOL_CLASSES; i++) {
+        if (size <= classes[i].size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct sub_magazine *sub_magazine_alloc(struct sub_class *cls)
+{
+    struct sub_magazine *mag = malloc(sizeof(*mag) + cls->mag_size * sizeof(struct subuff *));
+
+    if (mag) {
+        mag->next = NULL;
+        mag->count = 0;
+    }
+    return mag;
+}
+
+// a miss, the class grows by one subuff
+static struct subuff *sub_pool_new(struct sub_class *cls)
+{
+    struct subuff *sub = malloc(sizeof(*sub) + cls->size);
+
+    if (!sub) {
+        printf("Error: subuff of %u bytes could not be allocated \n", cls->size);
+        return NULL;
+    }
+    pthread_mutex_lock(&cls->lock);
+    cls->objects++;
+    cls->high_water = ANP_MAX(cls->high_water, cls->objects);
+    pthread_mutex_unlock(&cls->lock);
+    return sub;
+}
+
+// called with the class lock held
+static void sub_magazine_destroy(struct sub_class *cls, struct sub_magazine *mag)
+{
+    for (uint32_t i = 0; i < mag->count; i++) {
+        free(mag->subs[i]);
+    }
+    cls->objects -= mag->count;
+    free(mag);
+}
+
+// hands a magazine to the depot, what the depot has no room for goes back to the heap
+static void sub_depot_put(struct sub_class *cls, struct sub_magazine *mag)
+{
+    pthread_mutex_lock(&cls->lock);
+    if (mag->count > 0 && cls->nr_full < ANP_SUB_POOL_DEPOT_MAGS) {
+        mag->next = cls->full;
+        cls->full = mag;
+        cls->nr_full++;
+    } else if (0 == mag->count && cls->nr_empty < ANP_SUB_POOL_DEPOT_MAGS) {
+        mag->next = cls->empty;
+        cls->empty = mag;
+        cls->nr_empty++;
+    } else {
+        sub_magazine_destroy(cls, mag);
+    }
+    pthread_mutex_unlock(&cls->lock);
+}
+
+// thread exit, everything the thread cached goes to the depot
+static void sub_cache_destroy(void *arg)
+{
+    struct sub_cache *cache = arg;
+
+    pthread_mutex_lock(&caches_lock);
+    list_del(&cache->list);
+    for (int i = 0; i < ANP_SUB_POOL_CLASSES; i++) {
+        struct sub_class *cls = &classes[i];
+        if (cache->loaded[i]) {
+            sub_depot_put(cls, cache->loaded[i]);
+        }
+        if (cache->previous[i]) {
+            sub_depot_put(cls, cache->previous[i]);
+        }
+        pthread_mutex_lock(&cls->lock);
+        cls->allocs += cache->stats[i].allocs;
+        cls->frees += cache->stats[i].frees;
+        cls->hits += cache->stats[i].hits;
+        cls->misses += cache->stats[i].misses;
+        pthread_mutex_unlock(&cls->lock);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    free(cache);
+    my_cache = NULL;
+}
+
+static void sub_cache_key_init()
+{
+    pthread_key_create(&cache_key, sub_cache_destroy);
+}
+
+static struct sub_cache *sub_cache_get()
+{
+    if (my_cache) {
+        return my_cache;
+    }
+    struct sub_cache *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+    pthread_once(&cache_once, sub_cache_key_init);
+    pthread_setspecific(cache_key, cache);
+    pthread_mutex_lock(&caches_lock);
+    list_add_tail(&cache->list, &caches);
+    pthread_mutex_unlock(&caches_lock);
+    my_cache = cache;
+    return cache;
+}
+
+// both magazines of the thread are empty, swap the previous one for a full one of the depot
+static bool sub_cache_refill(struct sub_cache *cache, int idx)
+{
+    struct sub_class *cls = &classes[idx];
+    struct sub_magazine *mag;
+
+    pthread_mutex_lock(&cls->lock);
+    mag = cls->full;
+    if (mag) {
+        cls->full = mag->next;
+        cls->nr_full--;
+    }
+    pthread_mutex_unlock(&cls->lock);
+    if (!mag) {
+        return false;
+    }
+    if (cache->previous[idx]) {
+        sub_depot_put(cls, cache->previous[idx]);
+    }
+    cache->previous[idx] = cache->loaded[idx];
+    cache->loaded[idx] = mag;
+    return true;
+}
+
+// both magazines of the thread are full, swap the previous one for an empty one
+static bool sub_cache_drain(struct sub_cache *cache, int idx)
+{
+    struct sub_class *cls = &classes[idx];
+    struct sub_magazine *mag;
+
+    pthread_mutex_lock(&cls->lock);
+    mag = cls->empty;
+    if (mag) {
+        cls->empty = mag->next;
+        cls->nr_empty--;
+    }
+    pthread_mutex_unlock(&cls->lock);
+    if (!mag && !(mag = sub_magazine_alloc(cls))) {
+        return false;
+    }
+    if (cache->previous[idx]) {
+        sub_depot_put(cls, cache->previous[idx]);
+    }
+    cache->previous[idx] = cache->loaded[idx];
+    cache->loaded[idx] = mag;
+    return true;
+}
+
+static struct subuff *sub_cache_pop(struct sub_cache *cache, int idx)
+{
+    struct sub_magazine *mag = cache->loaded[idx];
+
+    if (!mag || 0 == mag->count) {
+        struct sub_magazine *prev = cache->previous[idx];
+        if (prev && prev->count > 0) {
+            cache->previous[idx] = mag;
+            cache->loaded[idx] = mag = prev;
+        } else if (sub_cache_refill(cache, idx)) {
+            mag = cache->loaded[idx];
+        } else {
+            return NULL;
+        }
+    }
+    return mag->subs[--mag->count];
+}
+
+static bool sub_cache_push(struct sub_cache *cache, int idx, struct subuff *sub)
+{
+    struct sub_class *cls = &classes[idx];
+    struct sub_magazine *mag = cache->loaded[idx];
+
+    if (!mag && !(mag = cache->loaded[idx] = sub_magazine_alloc(cls))) {
+        return false;
+    }
+    if (mag->count == cls->mag_size) {
+        struct sub_magazine *prev = cache->previous[idx];
+        if (prev && prev->count < cls->mag_size) {
+            cache->previous[idx] = mag;
+            cache->loaded[idx] = mag = prev;
+        } else if (sub_cache_drain(cache, idx)) {
+            mag = cache->loaded[idx];
+        } else {
+            return false;
+        }
+    }
+    mag->subs[mag->count++] = sub;
+    return true;
+}
+
+/*
+ * Unlike the calloc() this replaces, only the first ANP_SUB_POOL_HDR_SIZE bytes are cleared,
+ * the headers are built there, the payload behind them is always copied in by the caller.
+ */
+struct subuff *sub_pool_alloc(unsigned int size)
+{
+    int idx = sub_pool_class(size);
+    struct sub_cache *cache = NULL;
+    struct subuff *sub = NULL;
+
+    if (idx < 0) {
+        // larger than any class, straight from the heap
+        sub = calloc(1, sizeof(*sub) + size);
+        if (!sub) {
+            return NULL;
+        }
+    } else {
+        cache = sub_cache_get();
+        if (cache) {
+            cache->stats[idx].allocs++;
+            sub = sub_cache_pop(cache, idx);
+        }
+        if (sub) {
+            cache->stats[idx].hits++;
+        } else {
+            if (cache) {
+                cache->stats[idx].misses++;
+            }
+            if (!(sub = sub_pool_new(&classes[idx]))) {
+                return NULL;
+            }
+        }
+    }
+    memset(sub, 0, sizeof(*sub));
+    sub->pool = idx + 1;
+    sub->refcnt = 1;
+    sub->head = (uint8_t *) (sub + 1);
+    sub->data = sub->head;
+    sub->end = sub->head + size;
+    memset(sub->head, 0, ANP_MIN(size, ANP_SUB_POOL_HDR_SIZE));
+    list_init(&sub->list);
+    return sub;
+}
+
+void sub_pool_free(struct subuff *sub)
+{
+    int idx = sub->pool - 1;
+    struct sub_cache *cache;
+
+    if (idx < 0) {
+        free(sub);
+        return;
+    }
+    cache = sub_cache_get();
+    if (cache) {
+        cache->stats[idx].frees++;
+    }
+    if (!cache || !sub_cache_push(cache, idx, sub)) {
+        pthread_mutex_lock(&classes[idx].lock);
+        classes[idx].objects--;
+        pthread_mutex_unlock(&classes[idx].lock);
+        free(sub);
+    }
+}
+
+int anp_sub_pool_stats(int idx, struct anp_sub_pool_stats *stats)
+{
+    struct sub_class *cls;
+    struct list_head *item;
+
+    if (idx < 0 || idx >= ANP_SUB_POOL_CLASSES || !stats) {
+        return -EINVAL;
+    }
+    cls = &classes[idx];
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&caches_lock);
+    pthread_mutex_lock(&cls->lock);
+    stats->size = cls->size;
+    stats->objects = cls->objects;
+    stats->high_water = cls->high_water;
+    stats->allocs = cls->allocs;
+    stats->frees = cls->frees;
+    stats->hits = cls->hits;
+    stats->misses = cls->misses;
+    pthread_mutex_unlock(&cls->lock);
+    list_for_each(item, &caches) {
+        struct sub_cache *cache = list_entry(item, struct sub_cache, list);
+        stats->allocs += cache->stats[idx].allocs;
+        stats->frees += cache->stats[idx].frees;
+        stats->hits += cache->stats[idx].hits;
+        stats->misses += cache->stats[idx].misses;
+    }
+    pthread_mutex_unlock(&caches_lock);
+    stats->in_use = stats->allocs - stats->frees;
+    return 0;
+}
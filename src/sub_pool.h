@@ -0,0 +1,54 @@
+#ifndef ANPNETSTACK_SUB_POOL_H
+#define ANPNETSTACK_SUB_POOL_H
+
+#include "systems_headers.h"
+#include "linklist.h"
+#include "subuff.h"
+#include "anpnetstack.h"
+
+// a stack of free subuffs of one size class, a thread holds two per class, the depot the rest
+struct sub_magazine {
+    struct sub_magazine *next;
+    uint32_t count;
+    struct subuff *subs[];
+};
+
+// the part of a size class the threads share, touched once per magazine of allocations
+struct sub_class {
+    uint32_t size;          // buffer bytes behind the subuff
+    uint32_t mag_size;      // subuffs per magazine
+    pthread_mutex_t lock;
+    struct sub_magazine *full;
+    struct sub_magazine *empty;
+    uint32_t nr_full;
+    uint32_t nr_empty;
+    // subuffs of the class that exist, in use or cached anywhere
+    uint64_t objects;
+    uint64_t high_water;
+    // the counters of threads that are gone
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct sub_cache_stats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// what a thread keeps to itself, no lock or atomic is needed to use it
+struct sub_cache {
+    struct list_head list;
+    struct sub_magazine *loaded[ANP_SUB_POOL_CLASSES];
+    struct sub_magazine *previous[ANP_SUB_POOL_CLASSES];
+    // written by the owner only, the stats read them as they are
+    struct sub_cache_stats stats[ANP_SUB_POOL_CLASSES];
+};
+
+struct subuff *sub_pool_alloc(unsigned int size);
+void sub_pool_free(struct subuff *sub);
+
+#endif //ANPNETSTACK_SUB_POOL_H
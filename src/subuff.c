@@ -18,14 +18,92 @@
 #include "systems_headers.h"
 #include "subuff.h"
 #include "linklist.h"
+#include "rx_ring.h"
+#include "sub_pool.h"
+#include "zerocopy.h"
+#include "utilities.h"
 
 void free_sub(struct subuff *sub)
 {
-    if (sub->refcnt < 1) {
-        //printf(" >> %s : freeing the sub at %p \n", __FUNCTION__, sub);
-        free(sub->head);
-        free(sub);
+    if (__atomic_sub_fetch(&sub->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
     }
+    //printf(" >> %s : freeing the sub at %p \n", __FUNCTION__, sub);
+    struct subuff *parent = sub->clone_of;
+    zc_put(sub->zc);
+    if (sub->ring) {
+        rx_ring_put(sub);
+    } else {
+        sub_pool_free(sub);
+    }
+    // the data area of a clone goes with the last reference on the subuff it came from
+    if (parent) {
+        free_sub(parent);
+    }
+}
+
+struct subuff *sub_get(struct subuff *sub)
+{
+    __atomic_add_fetch(&sub->refcnt, 1, __ATOMIC_RELAXED);
+    return sub;
+}
+
+/*
+ * A new subuff over the same data area, only the struct is allocated. The clone can push
+ * headers in front of data without touching the original's data and len, but the header
+ * room itself is shared, sub_cloned() tells whether another clone may be using it.
+ */
+struct subuff *sub_clone(struct subuff *sub)
+{
+    struct subuff *parent = sub->clone_of ? sub->clone_of : sub;
+    struct subuff *clone = sub_pool_alloc(0);
+
+    if (!clone) {
+        return NULL;
+    }
+    uint8_t pool = clone->pool;
+    memcpy(clone, sub, sizeof(*clone));
+    list_init(&clone->list);
+    clone->pool = pool;
+    clone->ring = NULL;
+    clone->refcnt = 1;
+    clone->clone_of = sub_get(parent);
+    // the frags stay valid as long as the parent does
+    clone->zc = NULL;
+    return clone;
+}
+
+// a private copy of the buffer, headers and all, the frags are shared
+struct subuff *sub_copy(struct subuff *sub)
+{
+    uint32_t size = sub->end - sub->head;
+    struct subuff *copy = alloc_sub(size);
+
+    if (!copy) {
+        return NULL;
+    }
+    uint8_t pool = copy->pool;
+    uint8_t *head = copy->head;
+    memcpy(head, sub->head, size);
+    memcpy(copy, sub, sizeof(*copy));
+    list_init(&copy->list);
+    copy->pool = pool;
+    copy->head = head;
+    copy->data = head + (sub->data - sub->head);
+    copy->end = head + size;
+    copy->payload = NULL;
+    copy->ring = NULL;
+    copy->refcnt = 1;
+    copy->clone_of = NULL;
+    copy->zc = zc_get(sub->clone_of ? sub->clone_of->zc : sub->zc);
+    return copy;
+}
+
+// whether anything but the caller's reference holds the data area of sub
+bool sub_cloned(struct subuff *sub)
+{
+    struct subuff *parent = sub->clone_of ? sub->clone_of : sub;
+    return __atomic_load_n(&parent->refcnt, __ATOMIC_ACQUIRE) > 1;
 }
 
 void *sub_reserve(struct subuff *sub, unsigned int len)
@@ -46,19 +124,98 @@ uint8_t *sub_push(struct subuff *sub, unsigned int len)
     return sub->data;
 }
 
-void sub_reset_header(struct subuff *sub)
+// the subuff and its buffer come from the pool of the smallest size class that fits
+struct subuff *alloc_sub(unsigned int size)
 {
-    sub->data = sub->end - sub->dlen;
-    sub->len = sub->dlen;
+    return sub_pool_alloc(size);
 }
 
-struct subuff *alloc_sub(unsigned int size)
+// appends memory the subuff does not own to the frame, the caller keeps it valid
+int sub_add_frag(struct subuff *sub, void *data, uint32_t len)
 {
-    struct subuff *sub = calloc(sizeof(*sub), 1);
-    sub->data = calloc(size, 1);
-    sub->head = sub->data;
-    sub->end = sub->data + size;
-    sub->refcnt = 0;
-    list_init(&sub->list);
-    return sub;
+    if (sub->nr_frags == ANP_SUB_MAX_FRAGS) {
+        return -EMSGSIZE;
+    }
+    sub->frags[sub->nr_frags].data = data;
+    sub->frags[sub->nr_frags].len = len;
+    sub->nr_frags++;
+    sub->len += len;
+    sub->data_len += len;
+    return 0;
+}
+
+// copies len bytes of the frame, starting offset bytes after data, wherever they are
+void sub_copy_bits(struct subuff *sub, uint32_t offset, void *to, uint32_t len)
+{
+    uint32_t headlen = sub_headlen(sub);
+    uint8_t *dst = to;
+
+    if (offset < headlen) {
+        uint32_t n = ANP_MIN(len, headlen - offset);
+        memcpy(dst, sub->data + offset, n);
+        dst += n;
+        len -= n;
+        offset = headlen;
+    }
+    offset -= headlen;
+    for (int i = 0; i < sub->nr_frags && len > 0; i++) {
+        struct sub_frag *frag = &sub->frags[i];
+        if (offset >= frag->len) {
+            offset -= frag->len;
+            continue;
+        }
+        uint32_t n = ANP_MIN(len, frag->len - offset);
+        memcpy(dst, frag->data + offset, n);
+        dst += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+// the frame as an iovec, the linear part and then the frags, returns the entries used
+int sub_to_iovec(struct subuff *sub, struct iovec *iov, int max)
+{
+    int n = 0;
+
+    if (max < 1 + sub->nr_frags) {
+        return -EMSGSIZE;
+    }
+    iov[n].iov_base = sub->data;
+    iov[n++].iov_len = sub_headlen(sub);
+    for (int i = 0; i < sub->nr_frags; i++) {
+        iov[n].iov_base = sub->frags[i].data;
+        iov[n++].iov_len = sub->frags[i].len;
+    }
+    return n;
+}
+
+/*
+ * The Internet checksum from offset to the end of the frame, over the frags as well. A piece
+ * that starts at an odd position has its bytes in the other half of the 16 bit words, so
+ * its sum is byte swapped before it is added (RFC 1071, 2.(B)).
+ */
+uint16_t sub_csum(struct subuff *sub, uint32_t offset)
+{
+    uint32_t headlen = sub_headlen(sub), sum = 0, pos = 0;
+    int i = -1;
+
+    while (i < sub->nr_frags) {
+        uint8_t *data = i < 0 ? sub->data : sub->frags[i].data;
+        uint32_t len = i < 0 ? headlen : sub->frags[i].len;
+        i++;
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+        data += offset;
+        len -= offset;
+        offset = 0;
+        uint16_t part = ~do_csum(data, len, 0);
+        if (pos & 1) {
+            part = (part << 8) | (part >> 8);
+        }
+        sum += part;
+        pos += len;
+    }
+    return do_csum(NULL, 0, sum);
 }
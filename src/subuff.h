@@ -20,22 +20,60 @@
 
 #include "linklist.h"
 #include "systems_headers.h"
+#include "config.h"
 
 // The kernel has socket kernel buffer (SKB), we have socket user buffer - both are equally ugly and painful ;)
 // for the brave among us : https://elixir.bootlin.com/linux/latest/source/include/linux/skbuff.h#L711
 // for the documentation, a good source, http://vger.kernel.org/~davem/skb.html
 // coming back to our small userspace networking stack...
 
+struct rx_ring;
+struct sub_zc;
+
+// a piece of the frame that lies outside the buffer of the subuff, behind its linear part
+struct sub_frag {
+    uint8_t *data;
+    uint32_t len;
+};
+
+// checksum state of a subuff, same meaning as ip_summed in the kernel skb
+#define CHECKSUM_NONE        0 // nothing is known, software verifies or computes the checksum
+#define CHECKSUM_UNNECESSARY 1 // rx: the device has already verified the checksum
+#define CHECKSUM_PARTIAL     2 // only the pseudo header sum is in place, the rest is summed from csum_start
+
 struct subuff {
     struct list_head list;
     struct rtentry *rt;
     struct anp_netdev *dev;
+    // references, free_sub() drops one and the last one releases the subuff
     int refcnt;
     uint16_t protocol;
+    // the whole frame from data on, data_len of it is in the frags
     uint32_t len;
+    uint32_t data_len;
     uint32_t dlen;
     uint32_t seq;
     uint32_t end_seq;
+    uint8_t ip_summed;
+    // offset from head where the checksummed data starts and where in it the checksum goes
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    // segmentation offload, a super-segment is cut into gso_size payload pieces (0 = none)
+    uint16_t gso_size;
+    uint8_t gso_type;
+    // the device queue a frame on a tx queue leaves on
+    uint8_t tx_queue;
+    // the receive ring this subuff is recycled into, NULL for pool allocated ones
+    struct rx_ring *ring;
+    // size class + 1 of a pooled subuff, 0 when it is larger than every class
+    uint8_t pool;
+    // a clone shares the data area of this subuff, and holds a reference on it
+    struct subuff *clone_of;
+    // the frame goes on in memory the subuff does not own, e.g. the buffer of a
+    // MSG_ZEROCOPY send, and zc learns when the subuff lets go of it
+    uint8_t nr_frags;
+    struct sub_frag frags[ANP_SUB_MAX_FRAGS];
+    struct sub_zc *zc;
     uint8_t *end;
     uint8_t *head;
     uint8_t *data;
@@ -49,10 +87,23 @@ struct subuff_head {
 
 struct subuff *alloc_sub(unsigned int size);
 void free_sub(struct subuff *skb);
+struct subuff *sub_get(struct subuff *skb);
+struct subuff *sub_clone(struct subuff *skb);
+struct subuff *sub_copy(struct subuff *skb);
+bool sub_cloned(struct subuff *skb);
+int sub_add_frag(struct subuff *skb, void *data, uint32_t len);
+void sub_copy_bits(struct subuff *skb, uint32_t offset, void *to, uint32_t len);
+int sub_to_iovec(struct subuff *skb, struct iovec *iov, int max);
+uint16_t sub_csum(struct subuff *skb, uint32_t offset);
+
+// the part of the frame in the buffer of the subuff itself
+static inline uint32_t sub_headlen(const struct subuff *skb)
+{
+    return skb->len - skb->data_len;
+}
 uint8_t *sub_push(struct subuff *skb, unsigned int len);
 uint8_t *sub_head(struct subuff *skb);
 void *sub_reserve(struct subuff *skb, unsigned int len);
-void sub_reset_header(struct subuff *skb);
 
 static inline uint32_t sub_queue_len(const struct subuff_head *list)
 {
@@ -104,7 +155,6 @@ static inline void sub_queue_free(struct subuff_head *list)
 
     while ((skb = sub_peek(list)) != NULL) {
         sub_dequeue(list);
-        skb->refcnt--;
         free_sub(skb);
     }
 }
@@ -0,0 +1,70 @@
+/*
+ * A cookie is the 5 low bits of a counter that ticks every SYNCOOKIE_PERIOD seconds, the
+ * index of the peer's mss in syncookie_mss and 24 bits of a keyed hash over the tuple, the
+ * peer's isn and the counter. The counter bounds how long a cookie is good for, the hash
+ * that only we can have made it for this connection.
+ */
+#include "syncookie.h"
+#include "jhash.h"
+#include <sys/random.h>
+
+#define SYNCOOKIE_PERIOD_SHIFT 6
+// counter periods a cookie is accepted for, after the one it was made in
+#define SYNCOOKIE_MAX_AGE 2
+
+#define SYNCOOKIE_HASH_MASK 0xffffff
+#define SYNCOOKIE_MSS_SHIFT 24
+#define SYNCOOKIE_COUNT_SHIFT 27
+
+// common segment sizes, ascending, the peer gets the largest not above what it announced
+static const uint16_t syncookie_mss[] = {536, 1220, 1440, 1460, 4036, 8960, 16344, 65483};
+
+static uint32_t secret[2];
+
+int syncookie_init()
+{
+    if (getrandom(secret, sizeof(secret), 0) != sizeof(secret)) {
+        printf("Error: no random secret for syn cookies \n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t syncookie_count()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec >> SYNCOOKIE_PERIOD_SHIFT;
+}
+
+static uint32_t syncookie_hash(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                               uint32_t isn, uint32_t count)
+{
+    uint32_t h = jhash_3words(saddr, daddr, ((uint32_t) sport << 16) | dport, secret[0]);
+    return jhash_3words(h, isn, count, secret[1]) & SYNCOOKIE_HASH_MASK;
+}
+
+uint32_t syncookie_make(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                        uint32_t isn, uint16_t mss)
+{
+    uint32_t count = syncookie_count();
+    uint32_t idx = 0;
+
+    while (idx + 1 < sizeof(syncookie_mss) / sizeof(syncookie_mss[0]) && syncookie_mss[idx + 1] <= mss)
+        idx++;
+    return (count << SYNCOOKIE_COUNT_SHIFT) | (idx << SYNCOOKIE_MSS_SHIFT) |
+           syncookie_hash(saddr, daddr, sport, dport, isn, count);
+}
+
+uint16_t syncookie_check(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                         uint32_t isn, uint32_t cookie)
+{
+    uint32_t now = syncookie_count();
+    uint32_t age = (now - (cookie >> SYNCOOKIE_COUNT_SHIFT)) & 0x1f;
+
+    if (age > SYNCOOKIE_MAX_AGE)
+        return 0;
+    if ((cookie & SYNCOOKIE_HASH_MASK) != syncookie_hash(saddr, daddr, sport, dport, isn, now - age))
+        return 0;
+    return syncookie_mss[(cookie >> SYNCOOKIE_MSS_SHIFT) & 0x7];
+}
@@ -0,0 +1,18 @@
+#ifndef ANPNETSTACK_SYNCOOKIE_H
+#define ANPNETSTACK_SYNCOOKIE_H
+
+#include "systems_headers.h"
+
+/*
+ * SYN cookies: when a listener's SYN queue is full the state of a passive open goes into
+ * the initial sequence number of the synack, and the socket is only allocated once the
+ * peer's ack returns it. The tuple is in the order of the incoming segment.
+ */
+int syncookie_init();
+uint32_t syncookie_make(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                        uint32_t isn, uint16_t mss);
+// the mss the cookie was made with, 0 if it is not one of ours or too old
+uint16_t syncookie_check(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                         uint32_t isn, uint32_t cookie);
+
+#endif //ANPNETSTACK_SYNCOOKIE_H
@@ -48,6 +48,7 @@
 #include <sys/prctl.h>
 #include <sys/capability.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 
@@ -55,6 +56,7 @@
 
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include <unistd.h>
 #include <sys/syscall.h>
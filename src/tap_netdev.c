@@ -22,20 +22,20 @@
 #include "tap_netdev.h"
 #include "utilities.h"
 #include "config.h"
+#include "rx_ring.h"
+#include "tcp.h"
 
-static struct tap_netdev *_tdev = NULL;
-
-char *get_tdev_name(){
-    return _tdev->devname;
-}
 /*
  * Taken from Kernel Documentation/networking/tuntap.txt
+ * With more than one queue this follows the multiqueue section of the same document:
+ * every queue is a separate fd attached to the same device name with IFF_MULTI_QUEUE.
  */
-static int tdev_alloc(struct tap_netdev *dev)
+static int tdev_alloc_queue(struct tap_netdev *dev, int queue)
 {
     struct ifreq ifr;
     int fd, err;
-    fd = open("/dev/net/tap", O_RDWR);
+    // non-blocking, tap_rx_burst() drains the queue until EAGAIN and then waits in poll()
+    fd = open("/dev/net/tap", O_RDWR | O_NONBLOCK);
     if( 0 > fd ) {
         printf("Cannot open any TUN/TAP dev, errno %d \n", errno);
         printf("Make sure one exists, otherwise just create one with as shown below \n >sudo mknod /dev/net/tap c 10 200\n");
@@ -47,71 +47,273 @@ static int tdev_alloc(struct tap_netdev *dev)
     /* Flags: IFF_TUN   - TUN device (no Ethernet headers)
      *        IFF_TAP   - TAP device
      *        IFF_NO_PI - Do not provide packet information
+     *        IFF_MULTI_QUEUE - one fd per queue, the kernel spreads the flows over them
+     *        IFF_VNET_HDR - every frame is preceded by a struct virtio_net_hdr with the offload info
      * In this project we want raw access (no additional information) to the Ethernet frames
      * on the TAP device (Ethernet), not the TUN (ip level)
      */
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (ANP_NETDEV_QUEUES > 1) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    if (ANP_TAP_VNET_HDR) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
     if( NULL != dev->devname ) {
-        // there is name passed, then use it
+        // there is name passed, then use it. After the first queue this is always the case
         strncpy(ifr.ifr_name, dev->devname, IFNAMSIZ);
     }
     err = ioctl(fd, TUNSETIFF, (void *) &ifr);
     if( 0 > err ){
-        printf("ERR: Could not ioctl tun device, errno %d err %d \n", errno, err);
+        printf("ERR: Could not ioctl tun device queue %d, errno %d err %d \n", queue, errno, err);
         close(fd);
         return err;
     }
     // dst, src
     strcpy(dev->devname, ifr.ifr_name);
-    dev->tun_fd = fd;
+    dev->tun_fd[queue] = fd;
     return err;
 }
 
+static int tdev_alloc(struct tap_netdev *dev)
+{
+    int err = 0;
+    for (int i = 0; i < ANP_NETDEV_QUEUES; i++) {
+        err = tdev_alloc_queue(dev, i);
+        if (0 != err) {
+            // we can live with less queues, but not without any
+            if (0 == i) {
+                return err;
+            }
+            printf("WARN: only %d out of %d tap queues could be opened \n", i, ANP_NETDEV_QUEUES);
+            return 0;
+        }
+        dev->num_queues = i + 1;
+    }
+    return err;
+}
 
-void tdev_init(void)
+/*
+ * Tells the kernel which offloads we can handle in the frames it gives us: partially
+ * checksummed frames (TUN_F_CSUM) and unsegmented TCP super frames (TUN_F_TSO4), the latter
+ * is what makes the kernel hand over its GRO/TSO packets as is. Our own frames can carry
+ * partial checksums and GSO info regardless, the virtio_net_hdr is always honoured on write.
+ */
+static void tdev_set_offloads(struct tap_netdev *dev)
 {
-    _tdev = calloc(sizeof(struct tap_netdev), 1);
+    unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4;
+    int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+
+    if (0 > ioctl(dev->tun_fd[0], TUNSETVNETHDRSZ, &vnet_hdr_sz)) {
+        printf("ERR: could not set the vnet header size, errno %d \n", errno);
+        exit(1);
+    }
+    if (0 > ioctl(dev->tun_fd[0], TUNSETOFFLOAD, offloads)) {
+        printf("WARN: tap offloads not accepted, errno %d, continuing with checksums only \n", errno);
+        offloads = TUN_F_CSUM;
+        if (0 > ioctl(dev->tun_fd[0], TUNSETOFFLOAD, offloads)) {
+            offloads = 0;
+        }
+    }
+    dev->offloads = offloads;
+}
+
+
+int tap_open(struct anp_netdev *dev)
+{
+    struct tap_netdev *tdev = calloc(sizeof(struct tap_netdev), 1);
     int ret = -1;
-    if(NULL == _tdev){
+    if(NULL == tdev){
         printf("error null value, illegal argument \n");
         exit(-EINVAL);
     }
-    _tdev->devname = calloc(1, IFNAMSIZ);
-    ret = tdev_alloc(_tdev);
+    tdev->devname = calloc(1, IFNAMSIZ);
+    ret = tdev_alloc(tdev);
     if(0 != ret){
         printf("ERROR device alloc failed, ret %d, errno %d \n", ret, errno);
         exit(-ret);
     }
-    printf("tap device OK, %s \n", _tdev->devname);
+    if (ANP_TAP_VNET_HDR) {
+        tdev_set_offloads(tdev);
+    }
+    printf("tap device OK, %s with %d queue(s), offloads 0x%x \n", tdev->devname,
+           tdev->num_queues, tdev->offloads);
+    dev->priv = tdev;
+    dev->num_queues = tdev->num_queues;
+    // with a vnet header on every frame the kernel finishes checksums and segments for us,
+    // TUN_F_TSO4 means it also gives us its unsegmented frames
+    if (ANP_TAP_VNET_HDR) {
+        dev->features |= NETDEV_F_CSUM | NETDEV_F_TSO;
+    }
+    if (tdev->offloads & TUN_F_TSO4) {
+        dev->features |= NETDEV_F_GRO;
+    }
+    // The max size of ethernet packet over the MTU (including additional headers */
+    // https://searchnetworking.techtarget.com/answer/Minimum-and-maximum-Ethernet-frame-sizes
+    // with GRO on, the kernel can give us a whole 64KB TCP super frame instead
+    dev->rx_buf_size = (dev->features & NETDEV_F_GRO) ? ANP_MTU_65K_MAX_SIZE : ANP_FRAME_SIZE(dev->mtu);
+    // the kernel end sends frames of up to this mtu to us
+    ret = run_bash_command("ip link set dev %s mtu %u", tdev->devname, dev->mtu);
+    if(0 != ret){
+        printf("ERROR failed setting the device mtu %u, errno %d \n", dev->mtu, errno);
+        exit(-ret);
+    }
     // bring the device up
-    ret = run_bash_command("ip link set dev %s up", _tdev->devname);
+    ret = run_bash_command("ip link set dev %s up", tdev->devname);
     if(0 != ret){
         printf("ERROR failed getting the device up, errno %d \n", errno);
         exit(-ret);
     }
     printf("OK: device should be up now, %s \n", ANP_SUBNET_TAP);
     //2. set the CIDR routing
-    ret = run_bash_command("ip route add dev %s %s", _tdev->devname, ANP_SUBNET_TAP);
+    ret = run_bash_command("ip route add dev %s %s", tdev->devname, ANP_SUBNET_TAP);
     if (0 != ret) {
         printf("ERROR failed setting the device route %s, errno %d \n", ANP_SUBNET_TAP, errno);
         exit(-ret);
     }
     printf("OK: setting the device route, %s \n", ANP_SUBNET_TAP);
     // 3. setup the device address (MUST be last, the ordering is important).
-    ret = run_bash_command("ip address add dev %s local %s", _tdev->devname, ANP_IP_TAP_DEV);
+    ret = run_bash_command("ip address add dev %s local %s", tdev->devname, ANP_IP_TAP_DEV);
     if (0 != ret) {
         printf("ERROR failed setting the device address, %s errno %d \n", ANP_IP_TAP_DEV, errno);
         exit(-ret);
     }
     printf("OK: setting the device address %s \n", ANP_IP_TAP_DEV);
+    return 0;
+}
+
+/*
+ * Without IFF_VNET_HDR these are plain read/write calls. With it the virtio_net_hdr is
+ * scattered into/gathered from vh, so the frame itself still lands at buf. The returned
+ * length is always the length of the Ethernet frame.
+ */
+static int tap_read(struct tap_netdev *tdev, int queue, char *buf, int len, struct virtio_net_hdr *vh)
+{
+    if (!ANP_TAP_VNET_HDR) {
+        memset(vh, 0, sizeof(*vh));
+        return read(tdev->tun_fd[queue], buf, len);
+    }
+    struct iovec iov[2] = {
+        { .iov_base = vh, .iov_len = sizeof(*vh) },
+        { .iov_base = buf, .iov_len = len }
+    };
+    int ret = readv(tdev->tun_fd[queue], iov, 2);
+    return ret < 0 ? ret : ret - (int) sizeof(*vh);
 }
 
-int tdev_read(char *buf, int len)
+// gathers the frame from the linear part of the subuff and its frags, behind the vnet header
+static int tap_write(struct tap_netdev *tdev, int queue, struct subuff *sub, struct virtio_net_hdr *vh)
 {
-    return read(_tdev->tun_fd, buf, len);
+    int fd = tdev->tun_fd[queue % tdev->num_queues];
+    struct iovec iov[1 + 1 + ANP_SUB_MAX_FRAGS] = {
+        { .iov_base = vh, .iov_len = sizeof(*vh) }
+    };
+    int n = sub_to_iovec(sub, iov + 1, ANP_SUB_MAX_FRAGS + 1);
+    if (!ANP_TAP_VNET_HDR) {
+        return writev(fd, iov + 1, n);
+    }
+    int ret = writev(fd, iov, n + 1);
+    return ret < 0 ? ret : ret - (int) sizeof(*vh);
 }
 
-int tdev_write(char *buf, int len)
+// describes the offloads the frame needs in the header the tap device expects in front of it
+void tap_fill_vnet_hdr(struct subuff *sub, struct virtio_net_hdr *vh)
 {
-    return write(_tdev->tun_fd, buf, len);
-}
\ No newline at end of file
+    memset(vh, 0, sizeof(*vh));
+    if (sub->ip_summed == CHECKSUM_PARTIAL) {
+        vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh->csum_start = sub->csum_start - (sub->data - sub->head);
+        vh->csum_offset = sub->csum_offset;
+    }
+    if (sub->gso_size) {
+        struct tcp_hdr *th = (struct tcp_hdr *) (sub->head + sub->csum_start);
+        vh->gso_type = sub->gso_type;
+        vh->gso_size = sub->gso_size;
+        vh->hdr_len = vh->csum_start + th->off * 4;
+    }
+}
+
+// what the header the tap device put in front of a received frame tells about it
+void tap_parse_vnet_hdr(struct subuff *sub, struct virtio_net_hdr *vh)
+{
+    // frames from the kernel with a partial checksum never left the host, no need to verify
+    if (vh->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)) {
+        sub->ip_summed = CHECKSUM_UNNECESSARY;
+    }
+    if (vh->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        sub->gso_type = vh->gso_type;
+        sub->gso_size = vh->gso_size;
+    }
+}
+
+// a tap fd hands out one frame per read, so this still is a syscall per frame
+static int tap_rx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int max)
+{
+    struct tap_netdev *tdev = dev->priv;
+    struct rx_ring *ring = dev->rx_rings[queue];
+    struct pollfd pfd = { .fd = tdev->tun_fd[queue], .events = POLLIN };
+    struct virtio_net_hdr vh;
+    int n = 0, ret;
+
+    ret = poll(&pfd, 1, ANP_RX_POLL_MSEC);
+    if (ret <= 0) {
+        return (ret < 0 && errno != EINTR) ? -errno : 0;
+    }
+    while (n < max) {
+        // goes back into the ring when the packet is dropped or consumed
+        struct subuff *sub = rx_ring_get(ring);
+        // out of memory, the packet waits in the tap queue until the next burst
+        if (!sub) {
+            break;
+        }
+        ret = tap_read(tdev, queue, (char *)sub->data, ring->buf_size, &vh);
+        if (ret < 0) {
+            int err = errno;
+            free_sub(sub);
+            if (err == EAGAIN || err == EINTR) {
+                break;
+            }
+            return n > 0 ? n : -err;
+        }
+        sub->len = ret;
+        tap_parse_vnet_hdr(sub, &vh);
+        subs[n++] = sub;
+    }
+    return n;
+}
+
+static int tap_tx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int count)
+{
+    struct tap_netdev *tdev = dev->priv;
+    struct virtio_net_hdr vh;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        tap_fill_vnet_hdr(subs[i], &vh);
+        if (tap_write(tdev, queue, subs[i], &vh) < 0) {
+            return i > 0 ? i : -errno;
+        }
+    }
+    return i;
+}
+
+// the device itself goes away with the last fd
+void tap_close(struct anp_netdev *dev)
+{
+    struct tap_netdev *tdev = dev->priv;
+
+    for (int i = 0; i < tdev->num_queues; i++) {
+        close(tdev->tun_fd[i]);
+    }
+    free(tdev->devname);
+    free(tdev);
+    dev->priv = NULL;
+}
+
+const struct netdev_ops tap_netdev_ops = {
+    .name = "tap",
+    .open = tap_open,
+    .rx_burst = tap_rx_burst,
+    .tx_burst = tap_tx_burst,
+    .close = tap_close,
+};
@@ -19,18 +19,32 @@
 #define ANP_DEV_MANAGEMENT_H
 
 #include "systems_headers.h"
+#include "config.h"
+#include "anp_netdev.h"
 
+struct tap_uring;
+
+// the private state of the tap backend
 struct tap_netdev {
-    // tun device file descriptor
-    int tun_fd;
+    // tun device file descriptors, one per queue (IFF_MULTI_QUEUE), non-blocking
+    int tun_fd[ANP_NETDEV_QUEUES];
+    // number of queues that are open
+    int num_queues;
+    // TUN_F_* offloads the kernel accepted, 0 without IFF_VNET_HDR
+    unsigned int offloads;
     // device name
     char *devname;
+    // the io_uring state when the device runs as tap-uring
+    struct tap_uring *uring;
 };
 
+extern const struct netdev_ops tap_netdev_ops;
+extern const struct netdev_ops tap_uring_netdev_ops;
 
-char *get_tdev_name();
-void tdev_init(void);
-int tdev_read(char *buf, int len);
-int tdev_write(char *buf, int len);
+// shared with the io_uring flavour of the backend in tap_uring.c
+int tap_open(struct anp_netdev *dev);
+void tap_close(struct anp_netdev *dev);
+void tap_fill_vnet_hdr(struct subuff *sub, struct virtio_net_hdr *vh);
+void tap_parse_vnet_hdr(struct subuff *sub, struct virtio_net_hdr *vh);
 
 #endif // ANP_DEV_MANAGEMENT_H
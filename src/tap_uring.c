@@ -0,0 +1,280 @@
+/*
+ * The tap device driven through io_uring, ANP_NETDEV=tap-uring. The device itself is set up
+ * exactly like for the plain tap backend.
+ *
+ * Every queue keeps one multishot read armed on its tap fd. The kernel takes a buffer for
+ * each frame from a ring of provided buffers registered with it (IORING_REGISTER_PBUF_RING),
+ * and those are the buffers of the queue's rx_ring. A completion therefore is a received
+ * subuff, without a copy and without a syscall per frame. Descriptors that free_sub() put
+ * back into the rx_ring are handed to the kernel again on the next rx_burst().
+ *
+ * A tx burst is one linked writev sqe per frame and a single io_uring_enter() for all of them.
+ */
+
+#include "tap_netdev.h"
+#include "uring.h"
+#include "rx_ring.h"
+#include "config.h"
+#include "utilities.h"
+
+#include <sys/mman.h>
+
+// the buffer group of the provided buffers, every queue has its own io_uring
+#define TAP_URING_BGID 0
+// the rx rings only ever see the sqe (re)arming the multishot read
+#define TAP_URING_RX_SQ_ENTRIES 8
+
+#define TAP_URING_VNET_LEN (ANP_TAP_VNET_HDR ? sizeof(struct virtio_net_hdr) : 0)
+
+struct tap_uring_rx {
+    struct uring ring;
+    struct io_uring_buf_ring *bufs;
+    size_t bufs_len;
+    // the frame memory behind the queue's rx_ring
+    uint8_t *buffers;
+    // a multishot read is outstanding
+    bool armed;
+    // buffers the kernel holds
+    uint32_t posted;
+};
+
+struct tap_uring {
+    struct tap_uring_rx rx[ANP_NETDEV_QUEUES];
+    // tx_burst() is called by the TX thread, or by anyone without a tx queue
+    pthread_mutex_t tx_lock;
+    struct uring tx;
+    struct virtio_net_hdr tx_vh[ANP_TX_BURST];
+    // the vnet header, the linear part and the frags of each frame
+    struct iovec tx_iov[ANP_TX_BURST][2 + ANP_SUB_MAX_FRAGS];
+};
+
+static int tap_uring_open_rx(struct anp_netdev *dev, struct tap_uring_rx *rx, int queue)
+{
+    uint32_t buf_size = dev->rx_buf_size + TAP_URING_VNET_LEN;
+    int ret;
+
+    ret = uring_init(&rx->ring, TAP_URING_RX_SQ_ENTRIES, 2 * ANP_RX_RING_SIZE);
+    if (0 > ret) {
+        return ret;
+    }
+    // malloc, like rx_ring_alloc(), pages are only touched when a frame lands in them
+    rx->buffers = malloc((size_t) ANP_RX_RING_SIZE * buf_size);
+    rx->bufs_len = ANP_RX_RING_SIZE * sizeof(struct io_uring_buf);
+    rx->bufs = mmap(NULL, rx->bufs_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!rx->buffers || MAP_FAILED == rx->bufs) {
+        printf("Error: could not allocate the io_uring buffers of tap queue %d \n", queue);
+        return -ENOMEM;
+    }
+    // the kernel writes the vnet header first, the frame follows right behind it
+    dev->rx_rings[queue] = rx_ring_alloc_on(ANP_RX_RING_SIZE, buf_size, rx->buffers);
+    if (!dev->rx_rings[queue]) {
+        return -ENOMEM;
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) rx->bufs,
+        .ring_entries = ANP_RX_RING_SIZE,
+        .bgid = TAP_URING_BGID,
+    };
+    ret = uring_register(&rx->ring, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (0 > ret) {
+        printf("Error: could not register the provided buffer ring (linux >= 5.19), %d \n", ret);
+        return ret;
+    }
+    return 0;
+}
+
+static int tap_uring_open(struct anp_netdev *dev)
+{
+    int ret = tap_open(dev);
+    if (0 != ret) {
+        return ret;
+    }
+    struct tap_netdev *tdev = dev->priv;
+    struct tap_uring *u = calloc(1, sizeof(struct tap_uring));
+    if (NULL == u) {
+        return -ENOMEM;
+    }
+    tdev->uring = u;
+    for (int i = 0; i < dev->num_queues; i++) {
+        ret = tap_uring_open_rx(dev, &u->rx[i], i);
+        if (0 != ret) {
+            return ret;
+        }
+    }
+    ret = uring_init(&u->tx, ANP_TX_BURST, 2 * ANP_TX_BURST);
+    if (0 != ret) {
+        return ret;
+    }
+    pthread_mutex_init(&u->tx_lock, NULL);
+    printf("OK: io_uring on %d tap queue(s) \n", dev->num_queues);
+    return 0;
+}
+
+// hands the descriptors that came back into the rx_ring to the kernel again
+static void tap_uring_refill(struct tap_uring_rx *rx, struct rx_ring *ring)
+{
+    uint16_t tail = rx->bufs->tail;
+    struct subuff *sub;
+    int n = 0;
+
+    // there are as many buffers as ring entries, this can never overrun the kernel
+    while (NULL != (sub = rx_ring_try_get(ring))) {
+        struct io_uring_buf *buf = &rx->bufs->bufs[(tail + n) & (ring->size - 1)];
+        buf->addr = (uint64_t) (uintptr_t) sub->head;
+        buf->len = ring->buf_size;
+        buf->bid = sub - ring->descs;
+        n++;
+    }
+    if (n > 0) {
+        __atomic_store_n(&rx->bufs->tail, (uint16_t) (tail + n), __ATOMIC_RELEASE);
+        rx->posted += n;
+    }
+}
+
+static void tap_uring_arm(struct tap_netdev *tdev, struct tap_uring_rx *rx, int queue)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&rx->ring);
+
+    if (NULL == sqe) {
+        return;
+    }
+    // one sqe, a completion for every frame until it runs out of buffers or fails
+    sqe->opcode = ANP_IORING_OP_READ_MULTISHOT;
+    sqe->fd = tdev->tun_fd[queue];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TAP_URING_BGID;
+    rx->armed = true;
+}
+
+static int tap_uring_reap(struct tap_uring_rx *rx, struct rx_ring *ring, struct subuff **subs, int max)
+{
+    struct io_uring_cqe *cqe;
+    int n = 0;
+
+    while (n < max && NULL != (cqe = uring_peek_cqe(&rx->ring))) {
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_cqe_seen(&rx->ring);
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+            rx->armed = false;
+        }
+        if (!(flags & IORING_CQE_F_BUFFER)) {
+            // -ENOBUFS: the stack holds all buffers, the read is armed again once some are back
+            if (res < 0 && res != -ENOBUFS) {
+                printf("Error: multishot read on the tap device failed, %d \n", res);
+                return n > 0 ? n : res;
+            }
+            continue;
+        }
+        struct subuff *sub = &ring->descs[flags >> IORING_CQE_BUFFER_SHIFT];
+        rx->posted--;
+        if (res <= (int) TAP_URING_VNET_LEN) {
+            free_sub(sub);
+            continue;
+        }
+        if (ANP_TAP_VNET_HDR) {
+            tap_parse_vnet_hdr(sub, (struct virtio_net_hdr *) sub->head);
+        }
+        // the stack expects the Ethernet header at head, rx_ring_put() moves it back
+        sub->head += TAP_URING_VNET_LEN;
+        sub->data = sub->head;
+        sub->len = res - TAP_URING_VNET_LEN;
+        subs[n++] = sub;
+    }
+    return n;
+}
+
+static int tap_uring_rx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int max)
+{
+    struct tap_netdev *tdev = dev->priv;
+    struct tap_uring_rx *rx = &tdev->uring->rx[queue];
+    struct rx_ring *ring = dev->rx_rings[queue];
+    int n, ret;
+
+    tap_uring_refill(rx, ring);
+    if (!rx->armed && rx->posted > 0) {
+        tap_uring_arm(tdev, rx, queue);
+    }
+    n = tap_uring_reap(rx, ring, subs, max);
+    if (n != 0) {
+        // a fresh sqe goes in without waiting, the next call reaps its frames
+        uring_submit_and_wait(&rx->ring, 0, 0);
+        return n;
+    }
+    ret = uring_submit_and_wait(&rx->ring, 1, ANP_RX_POLL_MSEC);
+    if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+        return ret;
+    }
+    return tap_uring_reap(rx, ring, subs, max);
+}
+
+static int tap_uring_tx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int count)
+{
+    struct tap_netdev *tdev = dev->priv;
+    struct tap_uring *u = tdev->uring;
+    int fd = tdev->tun_fd[queue % tdev->num_queues];
+    int n = ANP_MIN(count, ANP_TX_BURST);
+    int done = 0, sent = 0, ret = 0;
+
+    pthread_mutex_lock(&u->tx_lock);
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&u->tx);
+        struct iovec *iov = u->tx_iov[i];
+
+        tap_fill_vnet_hdr(subs[i], &u->tx_vh[i]);
+        iov[0].iov_base = &u->tx_vh[i];
+        iov[0].iov_len = TAP_URING_VNET_LEN;
+        int nr_iov = sub_to_iovec(subs[i], iov + 1, 1 + ANP_SUB_MAX_FRAGS);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) (ANP_TAP_VNET_HDR ? iov : iov + 1);
+        sqe->len = ANP_TAP_VNET_HDR ? nr_iov + 1 : nr_iov;
+        // linked, so the frames leave in order
+        if (i + 1 < n) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+    }
+    // the caller frees the frames once we return, wait for every write
+    while (done < n) {
+        ret = uring_submit_and_wait(&u->tx, n - done, -1);
+        if (ret < 0 && ret != -EINTR) {
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while (NULL != (cqe = uring_peek_cqe(&u->tx))) {
+            if (cqe->res >= 0) {
+                sent++;
+            }
+            done++;
+            uring_cqe_seen(&u->tx);
+        }
+    }
+    pthread_mutex_unlock(&u->tx_lock);
+    return (sent == 0 && ret < 0) ? ret : sent;
+}
+
+// the rx_rings still point into the frame memory, so that stays
+static void tap_uring_close(struct anp_netdev *dev)
+{
+    struct tap_netdev *tdev = dev->priv;
+    struct tap_uring *u = tdev->uring;
+
+    for (int i = 0; i < dev->num_queues; i++) {
+        uring_free(&u->rx[i].ring);
+        munmap(u->rx[i].bufs, u->rx[i].bufs_len);
+    }
+    uring_free(&u->tx);
+    pthread_mutex_destroy(&u->tx_lock);
+    free(u);
+    tdev->uring = NULL;
+    tap_close(dev);
+}
+
+const struct netdev_ops tap_uring_netdev_ops = {
+    .name = "tap-uring",
+    .open = tap_uring_open,
+    .rx_burst = tap_uring_rx_burst,
+    .tx_burst = tap_uring_tx_burst,
+    .close = tap_uring_close,
+};
@@ -6,6 +6,13 @@
 #include "timer.h"
 #include "arp.h"
 #include "cond_wait.h"
+#include "route.h"
+#include "anp_netdev.h"
+#include "zerocopy.h"
+#include "sock_hash.h"
+#include "sock_poll.h"
+#include <sys/mman.h>
+#include <linux/tcp.h>
 
 static uint16_t next_port = EPHEMERAL_PORT_MIN;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
@@ -21,21 +28,76 @@ static uint16_t get_next_port() {
     return ret;
 }
 
+// the mss we advertise, what fits the mtu of the device the route to daddr goes out on
+uint16_t tcp_local_mss(uint32_t daddr) {
+    struct rtentry *rt = route_lookup(daddr);
+    uint32_t mtu = rt ? rt->dev->mtu : ANP_MTU;
+
+    return (ANP_MIN(mtu, TCP_IP_MAX_LEN)) - IP_HDR_LEN - TCP_HDR_LEN;
+}
+
+// the window is whatever the receive ring has room for, it only grows while tcp_rx() is not
+// writing to the ring, so any thread can ask without the socket lock
+uint16_t tcp_rcv_wnd(struct sock *sock) {
+    uint32_t space = byte_ring_free(&sock->rcv_ring);
+    return ANP_MIN(space, TCP_MAX_WINDOW);
+}
+
+// what tcp_rx() checks incoming segments against, called with the socket locked
+void tcp_update_rcv_wnd(struct sock *sock) {
+    sock->tcb->rcv.wnd = tcp_rcv_wnd(sock);
+}
+
+// called by tcp_rx() after it put data into the receive ring or the stream ended
+void tcp_rcv_wake(struct sock *sock) {
+    sock_poll_wake(sock);
+    // pairs with the fence in tcp_receive(), either we see the sleeper or it sees the data
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sock->rcv_sleepers, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&sock->conds.rcv_mutex);
+    pthread_cond_broadcast(&sock->conds.rcv_cond);
+    pthread_mutex_unlock(&sock->conds.rcv_mutex);
+}
+
+// whether more data can still come in on the connection
+static bool tcp_can_receive(int state) {
+    return state == TCP_ESTABLISHED || state == TCP_FIN_WAIT_1 || state == TCP_FIN_WAIT_2;
+}
+
+// how much payload tcp_send() hands down at once, a whole super-segment (a multiple of the
+// mss within 64KB) when the device does TSO
+static int tcp_max_seg_size(struct sock *sock) {
+    struct rtentry *rt = route_lookup(sock->daddr);
+
+    if (rt && (rt->dev->features & NETDEV_F_TSO))
+        return (ANP_MAX(1, (TCP_IP_MAX_LEN - IP_HDR_LEN - TCP_HDR_LEN) / sock->mss)) * sock->mss;
+    return sock->mss;
+}
+
 void add_connect_info(struct sock *sock, const struct sockaddr *saddr, socklen_t addrlen) {
     struct sockaddr_in *addr = (struct sockaddr_in *) saddr;
 
     pthread_rwlock_wrlock(&sock->rwlock);
     sock->daddr = ntohl(addr->sin_addr.s_addr);
     sock->dport = ntohs(addr->sin_port);
-    sock->saddr = ip_str_to_h32(ANP_IP_CLIENT_EXT); // do we have to hardcode the ip?
-    sock->sport = get_next_port();
+    // a bound socket keeps its address, otherwise it's the one of the device the route goes out on
+    if (sock->saddr == INADDR_ANY) {
+        struct rtentry *rt = route_lookup(sock->daddr);
+        sock->saddr = rt ? rt->dev->addr : ip_str_to_h32(ANP_IP_CLIENT_EXT);
+    }
+    if (sock->sport == 0)
+        sock->sport = get_next_port();
+    sock_hash_add(sock);
     pthread_rwlock_unlock(&sock->rwlock);
 }
 
 void change_state(struct sock *sock, int new_state) {
     pthread_mutex_lock(&sock->conds.state_change_mutex);
-    sock->tcp_state = new_state;
+    // readers look at it without a lock, they must see the data that came before a fin
+    __atomic_store_n(&sock->tcp_state, new_state, __ATOMIC_RELEASE);
     pthread_mutex_unlock(&sock->conds.state_change_mutex);
+    sock_poll_wake(sock);
 }
 
 // connect call called from anp_wrapper
@@ -46,9 +108,13 @@ int tcp_connect(struct sock *sock) {
     switch (sock->tcp_state) {
         case TCP_CLOSED:
             break;
-        case TCP_LISTEN:
         case TCP_SYN_SENT:
         case TCP_SYN_RECEIVED:
+            // a nonblocking connect() asked again before the handshake is done
+            sock->err = EALREADY;
+            pthread_rwlock_unlock(&sock->rwlock);
+            return -1;
+        case TCP_LISTEN:
         case TCP_ESTABLISHED:
         case TCP_CLOSE_WAIT:
         case TCP_FIN_WAIT_1:
@@ -77,177 +143,563 @@ int tcp_connect(struct sock *sock) {
     sock->tcb->snd.wl2 = 0;
     sock->tcb->irs = 0;
     sock->tcb->rcv.nxt = 0;
-    sock->tcb->rcv.wnd = TCP_START_WINDOW;
+    tcp_update_rcv_wnd(sock);
     sock->tcb->rcv.up = 0;
+    sock->so_error = 0;
+    // lowered to the peer's mss when its synack comes in
+    sock->mss = tcp_local_mss(sock->daddr);
+    // before the syn leaves, a synack over loopback can be back right away
+    change_state(sock, TCP_SYN_SENT);
     pthread_rwlock_unlock(&sock->rwlock);
 
     ret = tcp_send_syn(sock);
+    // the syn is queued, the retransmit timer sends it again once the neighbour is resolved
+    if (ret < 0 && sock->nonblock)
+        return 0;
     int count = 0;
     while (ret < 0 && count < TCP_CONN_RETRIES) {
         printf("failed to send tcp packet in connect, retried %d times\n", count);
         timed_wait_cond(&arp_entry_cond, &arp_entry_mutex, 200000000);
         pthread_rwlock_wrlock(&sock->rwlock);
         sub_queue_free(&sock->snd_queue);
+        sock->tcb->snd.nxt = sock->tcb->iss;
         pthread_rwlock_unlock(&sock->rwlock);
         ret = tcp_send_syn(sock);
         count++;
     }
-    pthread_rwlock_wrlock(&sock->rwlock);
-    if (ret >= 0) {
-        sock->tcb->snd.nxt++;
-        change_state(sock, TCP_SYN_SENT);
-    } else {
+    if (ret < 0) {
+        pthread_rwlock_wrlock(&sock->rwlock);
         ret = -1;
         sock->err = ECONNREFUSED;
+        change_state(sock, TCP_CLOSED);
+        pthread_rwlock_unlock(&sock->rwlock);
     }
-    pthread_rwlock_unlock(&sock->rwlock);
     return ret;
 }
 
-// tcp send function called from anp_wrapper
-int tcp_send(struct sock *sock, const void *buf, size_t len) {
-    if (len < 0 || !buf) {
-        pthread_rwlock_wrlock(&sock->rwlock);
-        sock->err = EINVAL;
+// whether the connection still takes data from us
+static bool tcp_can_send(struct sock *sock) {
+    return sock->tcp_state == TCP_ESTABLISHED || sock->tcp_state == TCP_CLOSE_WAIT;
+}
+
+// what the peer's window still takes, 0 as well when it shrank below what is in flight
+static uint32_t tcp_snd_wnd(struct sock *sock) {
+    pthread_rwlock_rdlock(&sock->rwlock);
+    int32_t wnd = (int32_t) TCP_SND_WINDOW(sock->tcb);
+    pthread_rwlock_unlock(&sock->rwlock);
+    return wnd > 0 ? wnd : 0;
+}
+
+/*
+ * Cuts the data in the send ring into segments, as far as the peer's window goes. A segment
+ * smaller than the mss waits while earlier data is unacked (Nagle, RFC 896), so small
+ * writes go out as full segments. TCP_NODELAY sends it right away, TCP_CORK holds it until
+ * the cork is pulled. Called with conds.ack_mutex held.
+ */
+static int tcp_output_locked(struct sock *sock) {
+    int sent = 0;
+
+    // a zero copy send is segmenting its own buffer, the ring holds what came after it
+    while (!sock->snd_zc && tcp_can_send(sock)) {
+        uint32_t unsent = byte_ring_used(&sock->snd_ring);
+        uint32_t max_seg = tcp_max_seg_size(sock);
+        uint32_t wnd = tcp_snd_wnd(sock);
+        uint32_t len = ANP_MIN(unsent, max_seg);
+        len = ANP_MIN(len, wnd);
+
+        pthread_rwlock_rdlock(&sock->rwlock);
+        bool idle = sock->tcb->snd.una == sock->tcb->snd.nxt;
         pthread_rwlock_unlock(&sock->rwlock);
-        return -1;
+        if (len == 0 || (len < sock->mss && (sock->cork || (!sock->nodelay && !idle))))
+            break;
+        int ret = tcp_send_ring(sock, len, len == unsent);
+        if (ret == -ENOMEM)
+            break;
+        // otherwise the segment is queued, a failed transmit is up to the retransmit timer
+        if (ret < 0)
+            m4_debug("failed to send data");
+        sent += len;
+    }
+    // room in the ring for send() again
+    if (sent > 0) {
+        pthread_cond_broadcast(&sock->conds.ack_cond);
+        sock_poll_wake(sock);
     }
+    return sent;
+}
 
-    pthread_rwlock_wrlock(&sock->rwlock);
-    switch(sock->tcp_state) {
+/*
+ * What the socket is ready for, in poll() bits (the same as the epoll ones). Readable when
+ * recv() returns at once, with data or the end of the stream, writable when send() takes
+ * at least a byte without waiting.
+ */
+uint32_t tcp_poll(struct sock *sock) {
+    int state = __atomic_load_n(&sock->tcp_state, __ATOMIC_ACQUIRE);
+    uint32_t mask = 0;
+
+    if (state == TCP_LISTEN)
+        return __atomic_load_n(&sock->accept_len, __ATOMIC_RELAXED) > 0 ? POLLIN | POLLRDNORM : 0;
+
+    if (__atomic_load_n(&sock->so_error, __ATOMIC_RELAXED))
+        mask |= POLLERR;
+    if (byte_ring_used(&sock->rcv_ring) >= __atomic_load_n(&sock->rcvlowat, __ATOMIC_RELAXED))
+        mask |= POLLIN | POLLRDNORM;
+    switch (state) {
         case TCP_CLOSED:
-            printf("error: connection does not exist\n");
-            sock->err = ENOTCONN;
-            pthread_rwlock_unlock(&sock->rwlock);
-            return -1;
-        case TCP_LISTEN:
-        case TCP_SYN_SENT:
-        case TCP_SYN_RECEIVED:
-            printf("send queue on none established socket not implemented\n");
-            pthread_rwlock_unlock(&sock->rwlock);
-            return -1;
-        case TCP_ESTABLISHED:
-        case TCP_CLOSE_WAIT:
+            mask |= POLLHUP;
             break;
-        case TCP_FIN_WAIT_1:
-        case TCP_FIN_WAIT_2:
+        case TCP_CLOSE_WAIT:
         case TCP_CLOSING:
         case TCP_LAST_ACK:
         case TCP_TIME_WAIT:
-            printf("error: connection closing\n");
-            sock->err = EPIPE;
-            pthread_rwlock_unlock(&sock->rwlock);
-            return -1;
-        default:
-            printf("unknown tcp state\n");
-            pthread_rwlock_unlock(&sock->rwlock);
-            return -1;
+            // the peer's fin
+            mask |= POLLIN | POLLRDNORM | POLLRDHUP;
+            break;
     }
+    if (tcp_can_send(sock) && !__atomic_load_n(&sock->snd_zc, __ATOMIC_RELAXED) && byte_ring_free(&sock->snd_ring) > 0 &&
+        byte_ring_used(&sock->snd_ring) < __atomic_load_n(&sock->notsent_lowat, __ATOMIC_RELAXED))
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
+}
 
-    int bytes_sent = 0;
-    int ret = 0;
+// called by tcp_rx() after an ack, it may have opened the window for more of the ring
+void tcp_output(struct sock *sock) {
+    pthread_mutex_lock(&sock->conds.ack_mutex);
+    tcp_output_locked(sock);
+    // wakes a zero copy send that waits for the window as well
+    pthread_cond_broadcast(&sock->conds.ack_cond);
+    pthread_mutex_unlock(&sock->conds.ack_mutex);
+}
 
-    int snd_wnd = TCP_SND_WINDOW(sock->tcb);
-    pthread_rwlock_unlock(&sock->rwlock);
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
 
-    if (snd_wnd == 0) {
-        pthread_mutex_lock(&sock->conds.ack_mutex);
-        while (snd_wnd == 0) {
-            pthread_cond_wait(&sock->conds.ack_cond, &sock->conds.ack_mutex);
-            pthread_rwlock_rdlock(&sock->rwlock);
-            snd_wnd = TCP_SND_WINDOW(sock->tcb);
-            pthread_rwlock_unlock(&sock->rwlock);
+// copies the iovecs from byte off of them on into the ring, as much as it has room for
+static size_t tcp_ring_write_iov(struct byte_ring *ring, const struct iovec *iov, int iovcnt, size_t off) {
+    size_t written = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
         }
-        pthread_mutex_unlock(&sock->conds.ack_mutex);
+        size_t left = iov[i].iov_len - off;
+        uint32_t n = byte_ring_write(ring, (const char *) iov[i].iov_base + off, left);
+        written += n;
+        off = 0;
+        if (n < left)
+            break;
     }
+    return written;
+}
+
+// segments the iovecs themselves, after whatever is in the send ring already. A segment
+// does not span two of them. Nonblocking, it takes what the window allows right now, the
+// send only takes an id when some of it was queued.
+static int tcp_send_zerocopy(struct sock *sock, const struct iovec *iov, int iovcnt, struct sub_zc *zc,
+                             bool nonblock) {
+    size_t len = iov_length(iov, iovcnt), bytes_sent = 0;
+    int idx = 0;
+    size_t off = 0;
 
-    while (bytes_sent < len && snd_wnd > 0) {
-        int to_send = (TCP_SAFE_MTU > len - bytes_sent) ? len - bytes_sent : TCP_SAFE_MTU;
-        to_send = (to_send > snd_wnd) ? snd_wnd : to_send;
-        assert(to_send + bytes_sent <= len);
-        bool push = (to_send + bytes_sent == len) ? true : false;
-        ret = tcp_send_data(sock, buf+bytes_sent, to_send, push);
+    pthread_mutex_lock(&sock->conds.ack_mutex);
+    while ((sock->snd_zc || byte_ring_used(&sock->snd_ring) > 0) && tcp_can_send(sock)) {
+        if (nonblock)
+            goto busy;
+        timed_wait_cond(&sock->conds.ack_cond, &sock->conds.ack_mutex, TCP_SND_WAIT);
+    }
+    sock->snd_zc = true;
+    while (bytes_sent < len && tcp_can_send(sock)) {
+        uint32_t wnd = tcp_snd_wnd(sock);
+        if (wnd == 0) {
+            if (nonblock)
+                break;
+            timed_wait_cond(&sock->conds.ack_cond, &sock->conds.ack_mutex, TCP_SND_WAIT);
+            continue;
+        }
+        while (off == iov[idx].iov_len) {
+            idx++;
+            off = 0;
+        }
+        size_t left = iov[idx].iov_len - off, max_seg = tcp_max_seg_size(sock);
+        size_t to_send = ANP_MIN(left, max_seg);
+        to_send = ANP_MIN(to_send, wnd);
+        bool push = bytes_sent + to_send == len;
+        int ret = tcp_send_data(sock, (const char *) iov[idx].iov_base + off, to_send, push, zc);
+        if (ret == -ENOMEM)
+            break;
         if (ret < 0)
             m4_debug("failed to send data");
         bytes_sent += to_send;
-        pthread_rwlock_rdlock(&sock->rwlock);
-        int snd_wnd = TCP_SND_WINDOW(sock->tcb);
-        pthread_rwlock_unlock(&sock->rwlock);
+        off += to_send;
     }
+    sock->snd_zc = false;
+    // under ack_mutex, ids go in the order of the data
+    if (bytes_sent > 0)
+        zc_take_id(zc);
+    // what other sends put into the ring meanwhile
+    tcp_output_locked(sock);
+    pthread_cond_broadcast(&sock->conds.ack_cond);
+busy:
+    pthread_mutex_unlock(&sock->conds.ack_mutex);
+    // the segments hold it now, it completes when the last of them is acked
+    zc_put(zc);
 
+    if (bytes_sent == 0 && len > 0) {
+        sock->err = tcp_can_send(sock) ? EAGAIN : EPIPE;
+        return -1;
+    }
     return bytes_sent;
 }
 
-int tcp_receive(struct sock *sock, void *buf, size_t len) {
-
-    pthread_rwlock_wrlock(&sock->rwlock);
+// called with the socket locked, -1 and sock->err when its state allows no send
+static int tcp_send_state(struct sock *sock, bool nonblock) {
     switch(sock->tcp_state) {
         case TCP_CLOSED:
             printf("error: connection does not exist\n");
             sock->err = ENOTCONN;
-            pthread_rwlock_unlock(&sock->rwlock);
             return -1;
-        case TCP_LISTEN:
         case TCP_SYN_SENT:
         case TCP_SYN_RECEIVED:
-            m4_debug("send queue on none established socket not implemented");
-            pthread_rwlock_unlock(&sock->rwlock);
+            // the handshake of a nonblocking connect() is still going
+            if (nonblock) {
+                sock->err = EAGAIN;
+                return -1;
+            }
+            // fall through
+        case TCP_LISTEN:
+            printf("send queue on none established socket not implemented\n");
             return -1;
         case TCP_ESTABLISHED:
+        case TCP_CLOSE_WAIT:
+            return 0;
         case TCP_FIN_WAIT_1:
         case TCP_FIN_WAIT_2:
-            break;
-        case TCP_CLOSE_WAIT:
-            if (sub_queue_len(&sock->rcv_queue) > 0)
-                break;
         case TCP_CLOSING:
         case TCP_LAST_ACK:
         case TCP_TIME_WAIT:
             printf("error: connection closing\n");
             sock->err = EPIPE;
-            pthread_rwlock_unlock(&sock->rwlock);
             return -1;
         default:
             printf("unknown tcp state\n");
-            pthread_rwlock_unlock(&sock->rwlock);
             return -1;
     }
-    pthread_rwlock_unlock(&sock->rwlock);
+}
 
-    int bytes_received = 0;
+/*
+ * tcp send function called from anp_wrapper. The data is copied into the send ring, which
+ * only blocks while the ring is full, the stack segments it as the window allows. All the
+ * iovecs go into the ring before it is segmented, so they share full sized segments. With
+ * MSG_ZEROCOPY the segments point into the iovecs instead of copying them, the application
+ * must leave them alone until the send shows up in anp_zerocopy_completion().
+ */
+int tcp_sendmsg(struct sock *sock, const struct iovec *iov, int iovcnt, int flags) {
+    bool nonblock = (flags & MSG_DONTWAIT) || sock->nonblock;
 
-    // wait until data comes in
-    while (sub_queue_len(&sock->rcv_queue) == 0) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX || (iovcnt > 0 && !iov)) {
+        pthread_rwlock_wrlock(&sock->rwlock);
+        sock->err = EINVAL;
+        pthread_rwlock_unlock(&sock->rwlock);
+        return -1;
     }
 
     pthread_rwlock_wrlock(&sock->rwlock);
-    for (int i = 0; i < sub_queue_len(&sock->rcv_queue); i++) {
-        struct subuff *sub = sub_peek(&sock->rcv_queue);
+    if (tcp_send_state(sock, nonblock) < 0) {
+        pthread_rwlock_unlock(&sock->rwlock);
+        return -1;
+    }
 
-        if (!sub)
-            continue;
+    size_t len = iov_length(iov, iovcnt);
+    struct sub_zc *zc = NULL;
+    if ((flags & MSG_ZEROCOPY) && len > 0) {
+        if (!sock->zc_queue)
+            sock->zc_queue = zc_queue_alloc();
+        zc = sock->zc_queue ? zc_alloc(sock->zc_queue) : NULL;
+    }
+    pthread_rwlock_unlock(&sock->rwlock);
 
-        struct iphdr *iph = IP_HDR_FROM_SUB(sub);
-        struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
-        uint32_t seg_len = iph->len - (iph->ihl * 4) - (tcph->off * 4);
+    // without a completion to report it is an ordinary send
+    if (zc)
+        return tcp_send_zerocopy(sock, iov, iovcnt, zc, nonblock);
+
+    size_t bytes_sent = 0;
+    pthread_mutex_lock(&sock->conds.ack_mutex);
+    while (bytes_sent < len) {
+        bytes_sent += tcp_ring_write_iov(&sock->snd_ring, iov, iovcnt, bytes_sent);
+        // sends right away what the window allows, acks coming in take care of the rest
+        tcp_output_locked(sock);
+        // a full ring, poll() reports room
+        if (bytes_sent == len || !tcp_can_send(sock) || nonblock)
+            break;
+        timed_wait_cond(&sock->conds.ack_cond, &sock->conds.ack_mutex, TCP_SND_WAIT);
+    }
+    pthread_mutex_unlock(&sock->conds.ack_mutex);
 
-        if (bytes_received + seg_len > len)
+    if (bytes_sent == 0 && len > 0) {
+        sock->err = tcp_can_send(sock) ? EAGAIN : EPIPE;
+        return -1;
+    }
+    return bytes_sent;
+}
+
+// copies up to count bytes from fd into the send ring, a nonblocking socket reads no more
+// than the ring has room for so that nothing read is left over
+ssize_t tcp_send_fd(struct sock *sock, int fd, size_t count, bool nonblock) {
+    char buf[ANP_SENDFILE_COPY];
+    size_t sent = 0;
+
+    sock->err = 0;
+    while (sent < count) {
+        size_t want = ANP_MIN(count - sent, sizeof(buf));
+        if (nonblock) {
+            size_t room = byte_ring_free(&sock->snd_ring);
+            want = ANP_MIN(want, room);
+            if (want == 0) {
+                sock->err = EAGAIN;
+                break;
+            }
+        }
+        ssize_t n = read(fd, buf, want);
+        if (n < 0) {
+            sock->err = errno;
+            break;
+        }
+        if (n == 0)
+            break;
+        int ret = tcp_send(sock, buf, n, nonblock ? MSG_DONTWAIT : 0);
+        if (ret < 0)
+            break;
+        sent += ret;
+        // the rest of fd is not there yet, or the connection went away
+        if (ret < n || (size_t) n < want)
             break;
+    }
+    if (sent == 0 && count > 0 && sock->err)
+        return -1;
+    return sent;
+}
 
-        uint8_t *data = TCP_DATA_FROM_SUB(sub);
-        memcpy(buf + bytes_received, data, seg_len);
-        bytes_received += seg_len;
-        sock->tcb->rcv.wnd += seg_len;
-        sub = sub_dequeue(&sock->rcv_queue);
-        free_sub(sub);
+/*
+ * sendfile() of a regular file maps count bytes of it from *offset on (or the file
+ * position) and sends them like a MSG_ZEROCOPY send, ANP_SENDFILE_CHUNK bytes per mapping.
+ * The segments point into the page cache and are checksummed in place, a mapping goes
+ * when the last of its segments is acked. The file must not shrink meanwhile. Other files
+ * are copied by tcp_send_fd().
+ */
+ssize_t tcp_sendfile(struct sock *sock, int in_fd, off_t *offset, size_t count) {
+    bool nonblock = sock->nonblock;
+    struct stat st;
+    size_t sent = 0;
+
+    if (fstat(in_fd, &st) < 0) {
+        sock->err = errno;
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        if (offset) {
+            sock->err = ESPIPE;
+            return -1;
+        }
+        return tcp_send_fd(sock, in_fd, count, nonblock);
+    }
+    off_t pos = offset ? *offset : lseek(in_fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        sock->err = offset ? EINVAL : errno;
+        return -1;
     }
+
+    pthread_rwlock_wrlock(&sock->rwlock);
+    int ret = tcp_send_state(sock, nonblock);
     pthread_rwlock_unlock(&sock->rwlock);
+    if (ret < 0)
+        return -1;
+
+    count = pos < st.st_size ? ANP_MIN(count, (size_t) (st.st_size - pos)) : 0;
+    long page = sysconf(_SC_PAGESIZE);
+    sock->err = 0;
+    while (sent < count) {
+        off_t map_off = (pos + sent) & ~((off_t) page - 1);
+        size_t skip = pos + sent - map_off, left = count - sent;
+        size_t len = ANP_MIN(left, ANP_SENDFILE_CHUNK);
+        void *map = mmap(NULL, skip + len, PROT_READ, MAP_SHARED, in_fd, map_off);
+        if (map == MAP_FAILED) {
+            sock->err = errno;
+            break;
+        }
+        struct sub_zc *zc = zc_alloc_map(map, skip + len);
+        if (!zc) {
+            munmap(map, skip + len);
+            sock->err = ENOMEM;
+            break;
+        }
+        struct iovec iov = {.iov_base = (char *) map + skip, .iov_len = len};
+        ret = tcp_send_zerocopy(sock, &iov, 1, zc, nonblock);
+        if (ret < 0)
+            break;
+        sent += ret;
+        if ((size_t) ret < len)
+            break;
+    }
+
+    if (offset)
+        *offset = pos + sent;
+    else
+        lseek(in_fd, pos + sent, SEEK_SET);
+    if (sent == 0 && count > 0)
+        return -1;
+    return sent;
+}
+
+int tcp_send(struct sock *sock, const void *buf, size_t len, int flags) {
+    struct iovec iov = {.iov_base = (void *) buf, .iov_len = len};
+
+    if (!buf) {
+        pthread_rwlock_wrlock(&sock->rwlock);
+        sock->err = EINVAL;
+        pthread_rwlock_unlock(&sock->rwlock);
+        return -1;
+    }
+    return tcp_sendmsg(sock, &iov, 1, flags);
+}
+
+/*
+ * The receive ring is a single producer, single consumer ring, tcp_rx() fills it and this
+ * drains it without taking the socket lock. Concurrent recv() calls on one socket are not
+ * supported, like the byte stream they would share.
+ */
+int tcp_recvmsg(struct sock *sock, const struct iovec *iov, int iovcnt, int flags) {
+    bool nonblock = (flags & MSG_DONTWAIT) || sock->nonblock;
+    // SO_RCVLOWAT, a blocking call waits for that much, or what the buffers take if less,
+    // a nonblocking one returns whatever there is
+    size_t lowat = __atomic_load_n(&sock->rcvlowat, __ATOMIC_RELAXED);
+    size_t total = iov_length(iov, iovcnt);
+    uint32_t target = ANP_MIN(lowat, total);
+    if (target == 0 || nonblock)
+        target = 1;
+
+    // wait until data comes in, or the peer's fin ends the stream
+    while (byte_ring_used(&sock->rcv_ring) < target) {
+        int state = __atomic_load_n(&sock->tcp_state, __ATOMIC_ACQUIRE);
+        // no more is coming, short of the low mark or not
+        if (!tcp_can_receive(state) && byte_ring_used(&sock->rcv_ring) > 0)
+            break;
+        switch (state) {
+            case TCP_CLOSED:
+                printf("error: connection does not exist\n");
+                sock->err = ENOTCONN;
+                return -1;
+            case TCP_SYN_SENT:
+            case TCP_SYN_RECEIVED:
+                if (nonblock) {
+                    sock->err = EAGAIN;
+                    return -1;
+                }
+                // fall through
+            case TCP_LISTEN:
+                m4_debug("send queue on none established socket not implemented");
+                return -1;
+            case TCP_CLOSING:
+            case TCP_LAST_ACK:
+            case TCP_TIME_WAIT:
+                printf("error: connection closing\n");
+                sock->err = EPIPE;
+                return -1;
+        }
+        // the fin came after the data, which is visible now if there was any
+        if (!tcp_can_receive(state)) {
+            if (byte_ring_used(&sock->rcv_ring) == 0)
+                return 0;
+            break;
+        }
+        if (nonblock) {
+            sock->err = EAGAIN;
+            return -1;
+        }
+
+        pthread_mutex_lock(&sock->conds.rcv_mutex);
+        __atomic_fetch_add(&sock->rcv_sleepers, 1, __ATOMIC_RELAXED);
+        // pairs with the fence in tcp_rcv_wake()
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (byte_ring_used(&sock->rcv_ring) < target && tcp_can_receive(sock->tcp_state))
+            timed_wait_cond(&sock->conds.rcv_cond, &sock->conds.rcv_mutex, TCP_RCV_WAIT);
+        __atomic_fetch_sub(&sock->rcv_sleepers, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sock->conds.rcv_mutex);
+    }
+
+    uint16_t old_wnd = tcp_rcv_wnd(sock);
+    int bytes_received = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        uint32_t n = byte_ring_read(&sock->rcv_ring, iov[i].iov_base, ANP_MIN(iov[i].iov_len, sock->rcv_ring.size));
+        bytes_received += n;
+        if (n < iov[i].iov_len)
+            break;
+    }
+    // the peer stopped at a window too small for a segment, tell it there is room again.
+    // The ack reads the tcb, which tcp_rx() changes under the lock.
+    if (old_wnd < sock->mss && tcp_rcv_wnd(sock) >= sock->mss) {
+        pthread_rwlock_wrlock(&sock->rwlock);
+        if (sock->tcp_state != TCP_CLOSED)
+            tcp_send_ack(sock);
+        pthread_rwlock_unlock(&sock->rwlock);
+    }
     return bytes_received;
 }
 
+int tcp_receive(struct sock *sock, void *buf, size_t len, int flags) {
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    return tcp_recvmsg(sock, &iov, 1, flags);
+}
+
+// the connections a closing listener did not hand to accept() yet, half-open or not, are
+// reset and removed
+static void tcp_reset_queued(struct sock *sock) {
+    epoch_enter();
+    for (;;) {
+        struct sock *child = NULL;
+
+        pthread_mutex_lock(&sock->conds.state_change_mutex);
+        struct list_head *queue = list_empty(&sock->syn_queue) ? &sock->accept_queue : &sock->syn_queue;
+        if (!list_empty(queue)) {
+            child = list_first_entry(queue, struct sock, accept_list);
+            list_del(&child->accept_list);
+            list_init(&child->accept_list);
+            __atomic_store_n(&child->listener, NULL, __ATOMIC_RELAXED);
+        } else {
+            sock->accept_len = 0;
+            sock->syn_len = 0;
+        }
+        pthread_mutex_unlock(&sock->conds.state_change_mutex);
+        if (!child)
+            break;
+
+        // the child's lock is taken without the listener's mutex, as tcp_rx() does
+        pthread_rwlock_wrlock(&child->rwlock);
+        if (child->tcp_state != TCP_CLOSED)
+            tcp_send_rst(child);
+        pthread_rwlock_unlock(&child->rwlock);
+        remove_sock_entry(child);
+    }
+    epoch_exit();
+}
+
 int tcp_close(struct sock *sock) {
     int ret = 0;
 
+    // our fin goes after the data still in the send ring, a cork holds none of it back now
+    pthread_mutex_lock(&sock->conds.ack_mutex);
+    if (sock->cork) {
+        sock->cork = false;
+        tcp_output_locked(sock);
+    }
+    while ((byte_ring_used(&sock->snd_ring) > 0 || sock->snd_zc) && tcp_can_send(sock))
+        timed_wait_cond(&sock->conds.ack_cond, &sock->conds.ack_mutex, TCP_SND_WAIT);
+    pthread_mutex_unlock(&sock->conds.ack_mutex);
+
     pthread_rwlock_wrlock(&sock->rwlock);
     switch(sock->tcp_state) {
         case TCP_CLOSED:
@@ -256,6 +708,15 @@ int tcp_close(struct sock *sock) {
             pthread_rwlock_unlock(&sock->rwlock);
             return -1;
         case TCP_LISTEN:
+            // no connection comes in from here on, tcp_rx() checks the state under the lock
+            change_state(sock, TCP_CLOSED);
+            pthread_rwlock_unlock(&sock->rwlock);
+            // wake up anyone blocked in accept()
+            pthread_mutex_lock(&sock->conds.state_change_mutex);
+            pthread_cond_broadcast(&sock->conds.state_change_cond);
+            pthread_mutex_unlock(&sock->conds.state_change_mutex);
+            tcp_reset_queued(sock);
+            return 0;
         case TCP_SYN_SENT:
             change_state(sock, TCP_CLOSED);
             pthread_rwlock_unlock(&sock->rwlock);
@@ -281,29 +742,341 @@ int tcp_close(struct sock *sock) {
             pthread_rwlock_unlock(&sock->rwlock);
             return -1;
     }
+    // the passive side has seen the peer's fin already, it only waits for the last ack
+    int final_state = TCP_TIME_WAIT;
+    if (sock->tcp_state == TCP_CLOSE_WAIT) {
+        change_state(sock, TCP_LAST_ACK);
+        final_state = TCP_CLOSED;
+    } else {
+        change_state(sock, TCP_FIN_WAIT_1);
+    }
     pthread_rwlock_unlock(&sock->rwlock);
 
     tcp_send_fin(sock);
+
+    // wait until state changes to TIME-WAIT (or CLOSED)
+    pthread_mutex_lock(&sock->conds.state_change_mutex);
+
+    // tcp_state is written under this mutex, taking the rwlock here as well would deadlock
+    // against tcp_rx() which holds it while changing state
+    while (sock->tcp_state != final_state) {
+        pthread_cond_wait(&sock->conds.state_change_cond, &sock->conds.state_change_mutex);
+    }
+
+    pthread_mutex_unlock(&sock->conds.state_change_mutex);
+
+
+    return ret;
+}
+
+int tcp_bind(struct sock *sock, const struct sockaddr *saddr, socklen_t addrlen) {
+    struct sockaddr_in *addr = (struct sockaddr_in *) saddr;
+    int err = 0;
+
+    if (!addr || addrlen < sizeof(struct sockaddr_in) || addr->sin_family != AF_INET) {
+        err = EINVAL;
+        goto error;
+    }
+
+    uint32_t ip = ntohl(addr->sin_addr.s_addr);
+    uint16_t port = ntohs(addr->sin_port);
+
+    // only the addresses of our own devices can be bound
+    if (ip != INADDR_ANY && !netdev_get(ip)) {
+        err = EADDRNOTAVAIL;
+        goto error;
+    }
+    if (port == 0) {
+        port = get_next_port();
+    } else if (sock_port_in_use(port, ip)) {
+        err = EADDRINUSE;
+        goto error;
+    }
+
     pthread_rwlock_wrlock(&sock->rwlock);
-    change_state(sock, TCP_FIN_WAIT_1);
-    sock->tcb->snd.nxt++;
+    if (sock->tcp_state != TCP_CLOSED || sock->sport != 0) {
+        sock->err = EINVAL;
+        pthread_rwlock_unlock(&sock->rwlock);
+        return -1;
+    }
+    sock->saddr = ip;
+    sock->sport = port;
     pthread_rwlock_unlock(&sock->rwlock);
+    return 0;
 
-    // wait until state changes to TIME-WAIT
-    pthread_mutex_lock(&sock->conds.state_change_mutex);
+error:
+    pthread_rwlock_wrlock(&sock->rwlock);
+    sock->err = err;
+    pthread_rwlock_unlock(&sock->rwlock);
+    return -1;
+}
 
-    pthread_rwlock_rdlock(&sock->rwlock);
-    int state = sock->tcp_state;
+int tcp_listen(struct sock *sock, int backlog) {
+    pthread_rwlock_wrlock(&sock->rwlock);
+    switch (sock->tcp_state) {
+        case TCP_CLOSED:
+        case TCP_LISTEN:
+            break;
+        default:
+            printf("error: listen on a connected socket\n");
+            sock->err = EINVAL;
+            pthread_rwlock_unlock(&sock->rwlock);
+            return -1;
+    }
+
+    // like linux, an unbound socket listens on an ephemeral port of any address
+    if (sock->sport == 0)
+        sock->sport = get_next_port();
+    if (backlog <= 0)
+        backlog = 1;
+    sock->backlog = ANP_MIN(backlog, SOMAXCONN);
+    change_state(sock, TCP_LISTEN);
+    // found by get_listen_sock() from here on
+    sock_hash_add(sock);
     pthread_rwlock_unlock(&sock->rwlock);
-    while (state != TCP_TIME_WAIT) {
+    return 0;
+}
+
+// blocks until a connection completes its handshake (unless nonblocking), returns it or
+// NULL with sock->err set
+struct sock *tcp_accept(struct sock *sock) {
+    struct sock *child = NULL;
+
+    pthread_mutex_lock(&sock->conds.state_change_mutex);
+    while (list_empty(&sock->accept_queue) && sock->tcp_state == TCP_LISTEN) {
+        if (sock->nonblock) {
+            pthread_mutex_unlock(&sock->conds.state_change_mutex);
+            sock->err = EAGAIN;
+            return NULL;
+        }
         pthread_cond_wait(&sock->conds.state_change_cond, &sock->conds.state_change_mutex);
-        pthread_rwlock_rdlock(&sock->rwlock);
-        state = sock->tcp_state;
+    }
+    if (!list_empty(&sock->accept_queue)) {
+        child = list_first_entry(&sock->accept_queue, struct sock, accept_list);
+        list_del(&child->accept_list);
+        list_init(&child->accept_list);
+        child->listener = NULL;
+        sock->accept_len--;
+    }
+    pthread_mutex_unlock(&sock->conds.state_change_mutex);
+
+    if (!child) {
+        pthread_rwlock_wrlock(&sock->rwlock);
+        sock->err = EINVAL;
         pthread_rwlock_unlock(&sock->rwlock);
     }
+    return child;
+}
 
-    pthread_mutex_unlock(&sock->conds.state_change_mutex);
+// the file status flags of a socket, only O_NONBLOCK has a meaning
+int tcp_fcntl(struct sock *sock, int cmd, long arg) {
+    switch (cmd) {
+        case F_GETFL:
+            return O_RDWR | (__atomic_load_n(&sock->nonblock, __ATOMIC_RELAXED) ? O_NONBLOCK : 0);
+        case F_SETFL:
+            __atomic_store_n(&sock->nonblock, (arg & O_NONBLOCK) != 0, __ATOMIC_RELAXED);
+            return 0;
+        // nothing of the socket survives an exec anyway
+        case F_GETFD:
+        case F_SETFD:
+            return 0;
+        default:
+            sock->err = EINVAL;
+            return -1;
+    }
+}
 
+// SO_SNDBUF and SO_RCVBUF, the rings are a power of two in size
+static uint32_t tcp_buf_size(int val) {
+    uint32_t size = ANP_SOCK_BUF_MIN;
+    while (val > 0 && size < (uint32_t) val && size < ANP_SOCK_BUF_MAX)
+        size <<= 1;
+    return size;
+}
 
+// the send ring never shrinks below what it holds, send() may take more right away
+static int tcp_set_sndbuf(struct sock *sock, int val) {
+    int ret = 0;
+
+    pthread_mutex_lock(&sock->conds.ack_mutex);
+    uint32_t size = tcp_buf_size(val);
+    while (size < byte_ring_used(&sock->snd_ring))
+        size <<= 1;
+    if (size != sock->snd_ring.size)
+        ret = byte_ring_resize(&sock->snd_ring, size);
+    pthread_cond_broadcast(&sock->conds.ack_cond);
+    pthread_mutex_unlock(&sock->conds.ack_mutex);
+    sock_poll_wake(sock);
     return ret;
 }
+
+// recv() reads the receive ring without the lock, so it is only sized before a connection
+static int tcp_set_rcvbuf(struct sock *sock, int val) {
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&sock->rwlock);
+    if (sock->tcp_state != TCP_CLOSED && sock->tcp_state != TCP_LISTEN) {
+        ret = -EISCONN;
+    } else if (tcp_buf_size(val) != sock->rcv_ring.size) {
+        ret = byte_ring_resize(&sock->rcv_ring, tcp_buf_size(val));
+        if (ret == 0)
+            tcp_update_rcv_wnd(sock);
+    }
+    // a low mark the ring cannot reach would never make the socket readable
+    if (sock->rcvlowat > sock->rcv_ring.size)
+        __atomic_store_n(&sock->rcvlowat, sock->rcv_ring.size, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sock->rwlock);
+    return ret;
+}
+
+/*
+ * The options an application tunes a connection with, each socket keeps its own. TCP_NODELAY
+ * and TCP_CORK decide when tcp_output_locked() sends a partial segment, TCP_QUICKACK whether
+ * tcp_rx() acks each segment, the buffer sizes are those of the rings and the low marks are
+ * what poll() and recv() wait for.
+ */
+int tcp_setsockopt(struct sock *sock, int level, int optname, const void *optval, socklen_t optlen) {
+    int val, ret = 0;
+
+    if (!optval) {
+        sock->err = EFAULT;
+        return -1;
+    }
+    if (optlen < sizeof(val)) {
+        sock->err = EINVAL;
+        return -1;
+    }
+    memcpy(&val, optval, sizeof(val));
+
+    if (level == SOL_SOCKET && optname == SO_SNDBUF) {
+        ret = tcp_set_sndbuf(sock, val);
+    } else if (level == SOL_SOCKET && optname == SO_RCVBUF) {
+        ret = tcp_set_rcvbuf(sock, val);
+    } else if (level == SOL_SOCKET && optname == SO_RCVLOWAT) {
+        if (val < 0) {
+            ret = -EINVAL;
+        } else {
+            uint32_t lowat = ANP_MAX(1, val);
+            lowat = ANP_MIN(lowat, sock->rcv_ring.size);
+            __atomic_store_n(&sock->rcvlowat, lowat, __ATOMIC_RELAXED);
+            // the data that is there may be enough now
+            tcp_rcv_wake(sock);
+        }
+    } else if (level == IPPROTO_TCP && optname == TCP_NOTSENT_LOWAT) {
+        // 0 is the default of no mark
+        __atomic_store_n(&sock->notsent_lowat, val > 0 ? (uint32_t) val : UINT32_MAX, __ATOMIC_RELAXED);
+        sock_poll_wake(sock);
+    } else if (level == IPPROTO_TCP && (optname == TCP_NODELAY || optname == TCP_CORK)) {
+        // what either held back goes out now, if the other lets it
+        pthread_mutex_lock(&sock->conds.ack_mutex);
+        if (optname == TCP_NODELAY)
+            sock->nodelay = val != 0;
+        else
+            sock->cork = val != 0;
+        if (!val || optname == TCP_NODELAY)
+            tcp_output_locked(sock);
+        pthread_mutex_unlock(&sock->conds.ack_mutex);
+    } else if (level == IPPROTO_TCP && optname == TCP_QUICKACK) {
+        // unlike Linux it stays set until it is cleared, the delayed ack decisions do not reset it
+        pthread_rwlock_wrlock(&sock->rwlock);
+        sock->quickack = val != 0;
+        // an ack that is held back goes now
+        if (sock->quickack && __atomic_load_n(&sock->delack_segs, __ATOMIC_RELAXED) > 0 &&
+            sock->tcp_state != TCP_CLOSED)
+            tcp_send_ack(sock);
+        pthread_rwlock_unlock(&sock->rwlock);
+    } else {
+        ret = -ENOPROTOOPT;
+    }
+
+    if (ret < 0) {
+        sock->err = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+// the state numbers of Linux, which is what tcpi_state is compared against
+static const uint8_t tcp_info_states[] = {
+    [TCP_CLOSED] = 7,
+    [TCP_LISTEN] = 10,
+    [TCP_SYN_SENT] = 2,
+    [TCP_SYN_RECEIVED] = 3,
+    [TCP_ESTABLISHED] = 1,
+    [TCP_FIN_WAIT_1] = 4,
+    [TCP_FIN_WAIT_2] = 5,
+    [TCP_CLOSE_WAIT] = 8,
+    [TCP_CLOSING] = 11,
+    [TCP_LAST_ACK] = 9,
+    [TCP_TIME_WAIT] = 6,
+};
+
+// what the stack knows about the connection, there is no rtt estimate or congestion window
+static void tcp_get_info(struct sock *sock, struct tcp_info *info) {
+    memset(info, 0, sizeof(*info));
+
+    pthread_rwlock_rdlock(&sock->rwlock);
+    info->tcpi_state = tcp_info_states[sock->tcp_state];
+    info->tcpi_retransmits = sock->timers.retries;
+    info->tcpi_rto = sock->timers.rto * 1000;
+    info->tcpi_ato = sock->quickack ? 0 : ANP_TCP_DELACK_MSEC * 1000;
+    info->tcpi_snd_mss = sock->mss;
+    info->tcpi_rcv_mss = sock->mss;
+    info->tcpi_unacked = sub_queue_len(&sock->snd_queue);
+    info->tcpi_rcv_space = tcp_rcv_wnd(sock);
+    info->tcpi_snd_wnd = sock->tcb->snd.wnd;
+    info->tcpi_notsent_bytes = byte_ring_used(&sock->snd_ring);
+    // the syn and fin take a sequence number each but are no bytes, before the handshake
+    // completes nothing is counted
+    int state = sock->tcp_state;
+    if (state != TCP_CLOSED && state != TCP_LISTEN && state != TCP_SYN_SENT && state != TCP_SYN_RECEIVED) {
+        bool fin_acked = state == TCP_FIN_WAIT_2 || state == TCP_TIME_WAIT;
+        bool fin_received = state == TCP_CLOSE_WAIT || state == TCP_CLOSING ||
+                            state == TCP_LAST_ACK || state == TCP_TIME_WAIT;
+        info->tcpi_bytes_acked = (uint32_t) (sock->tcb->snd.una - sock->tcb->iss - 1 - fin_acked);
+        info->tcpi_bytes_received = (uint32_t) (sock->tcb->rcv.nxt - sock->tcb->irs - 1 - fin_received);
+    }
+    pthread_rwlock_unlock(&sock->rwlock);
+}
+
+int tcp_getsockopt(struct sock *sock, int level, int optname, void *optval, socklen_t *optlen) {
+    int val;
+
+    if (!optval || !optlen) {
+        sock->err = EFAULT;
+        return -1;
+    }
+    if (level == IPPROTO_TCP && optname == TCP_INFO) {
+        struct tcp_info info;
+        tcp_get_info(sock, &info);
+        *optlen = ANP_MIN(*optlen, sizeof(info));
+        memcpy(optval, &info, *optlen);
+        return 0;
+    }
+
+    if (level == SOL_SOCKET && optname == SO_ERROR) {
+        // how a nonblocking connect() ended, reading it clears it
+        val = __atomic_exchange_n(&sock->so_error, 0, __ATOMIC_RELAXED);
+    } else if (level == SOL_SOCKET && optname == SO_SNDBUF) {
+        val = sock->snd_ring.size;
+    } else if (level == SOL_SOCKET && optname == SO_RCVBUF) {
+        val = sock->rcv_ring.size;
+    } else if (level == SOL_SOCKET && optname == SO_RCVLOWAT) {
+        val = __atomic_load_n(&sock->rcvlowat, __ATOMIC_RELAXED);
+    } else if (level == IPPROTO_TCP && optname == TCP_NOTSENT_LOWAT) {
+        uint32_t lowat = __atomic_load_n(&sock->notsent_lowat, __ATOMIC_RELAXED);
+        val = lowat == UINT32_MAX ? 0 : lowat;
+    } else if (level == IPPROTO_TCP && optname == TCP_NODELAY) {
+        val = sock->nodelay;
+    } else if (level == IPPROTO_TCP && optname == TCP_CORK) {
+        val = sock->cork;
+    } else if (level == IPPROTO_TCP && optname == TCP_QUICKACK) {
+        val = sock->quickack;
+    } else {
+        sock->err = ENOPROTOOPT;
+        return -1;
+    }
+    *optlen = ANP_MIN(*optlen, sizeof(val));
+    memcpy(optval, &val, *optlen);
+    return 0;
+}
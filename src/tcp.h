@@ -14,13 +14,27 @@
 #define EPHEMERAL_PORT_MIN 49152
 #define EPHEMERAL_PORT_MAX 65535
 
-#define TCP_START_WINDOW 64240
-#define TCP_SAFE_MTU 1400
+// the largest window the 16 bit field can advertise, we do not scale it
+#define TCP_MAX_WINDOW 65535
+// what we may send when the peer's syn carries no mss option, RFC 1122 4.2.2.6
+#define TCP_DEFAULT_MSS 536
+// an IP packet, and with it a super-segment, can not be larger than this
+#define TCP_IP_MAX_LEN 65535
+
+// the only option we send and look at, on syn segments
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_MSS_LEN 4
 
 #define TCP_START_RTO 10000
 //https://stackoverflow.com/questions/5227520/how-many-times-will-tcp-retransmit#:~:text=tcp_retries2%20(integer%3B%20default%3A%2015,depending%20on%20the%20retransmission%20timeout.
 #define TCP_CONN_RETRIES 4
 #define TCP_CONN_WAIT 200000
+// ns, how often a send() or close() waiting for the send ring checks on the connection
+#define TCP_SND_WAIT 100000000
+// ns, the same for a recv() waiting for data
+#define TCP_RCV_WAIT 100000000
 #define TCP_MAX_RETRIES 15
 
 enum tcp_states {
@@ -92,12 +106,18 @@ struct tcb {
         uint32_t wnd; // window
         uint32_t up;  // urgent pointer
     } rcv;
+    // reset_sock() replaces it while others may still read it
+    struct epoch_head epoch;
 };
 
 #define TCP_HDR_LEN 20
 #define TCP_HDR_FROM_SUB(_sub) (struct tcp_hdr *) (_sub->head + ETH_HDR_LEN + IP_HDR_LEN)
 #define TCP_DATA_FROM_SUB(_sub) (uint8_t *) (_sub->head + ETH_HDR_LEN + IP_HDR_LEN + (TCP_HDR_FROM_SUB(_sub))->off * 4)
 
+// sequence numbers wrap around, a is before b when b is less than 2^31 ahead
+#define TCP_SEQ_LT(_a, _b) ((int32_t) ((_a) - (_b)) < 0)
+#define TCP_SEQ_LEQ(_a, _b) ((int32_t) ((_a) - (_b)) <= 0)
+
 #define TCP_SND_WINDOW(_tcb) ((_tcb->snd.una + _tcb->snd.wnd) - _tcb->snd.nxt)
 #define TCP_RCV_WINDOW(_tcb) ((_tcb->rcv.nxt + _tcb->rcv.wnd) - _tcb->rcv.nxt)
 
@@ -121,21 +141,45 @@ struct tcb {
 uint32_t generate_ISS();
 void add_connect_info(struct sock *sock, const struct sockaddr *addr, socklen_t addrlen);
 void change_state(struct sock *sock, int new_state);
+uint16_t tcp_local_mss(uint32_t daddr);
+uint16_t tcp_rcv_wnd(struct sock *sock);
+void tcp_update_rcv_wnd(struct sock *sock);
+void tcp_rcv_wake(struct sock *sock);
+void tcp_output(struct sock *sock);
+uint32_t tcp_poll(struct sock *sock);
 
 int tcp_connect(struct sock *sock);
-int tcp_send(struct sock *sock, const void *buf, size_t len);
-int tcp_receive(struct sock *sock, void *buf, size_t len);
+int tcp_send(struct sock *sock, const void *buf, size_t len, int flags);
+int tcp_sendmsg(struct sock *sock, const struct iovec *iov, int iovcnt, int flags);
+ssize_t tcp_send_fd(struct sock *sock, int fd, size_t count, bool nonblock);
+ssize_t tcp_sendfile(struct sock *sock, int in_fd, off_t *offset, size_t count);
+int tcp_receive(struct sock *sock, void *buf, size_t len, int flags);
+int tcp_recvmsg(struct sock *sock, const struct iovec *iov, int iovcnt, int flags);
 int tcp_close(struct sock *sock);
+int tcp_bind(struct sock *sock, const struct sockaddr *addr, socklen_t addrlen);
+int tcp_listen(struct sock *sock, int backlog);
+struct sock *tcp_accept(struct sock *sock);
+int tcp_fcntl(struct sock *sock, int cmd, long arg);
+int tcp_getsockopt(struct sock *sock, int level, int optname, void *optval, socklen_t *optlen);
+int tcp_setsockopt(struct sock *sock, int level, int optname, const void *optval, socklen_t optlen);
 
 // tcp_rx.c definitions
 void tcp_rx(struct subuff *sub);
+void tcp_synq_drop(struct sock *sock);
 
 
 // tcp_tx.c definitions
 int tcp_send_syn(struct sock *sock);
-int tcp_send_data(struct sock *sock, const void *buf, size_t len, bool push);
+int tcp_send_synack(struct sock *sock);
+int tcp_send_cookie_synack(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                           uint32_t seq, uint32_t ack);
+int tcp_send_data(struct sock *sock, const void *buf, size_t len, bool push, struct sub_zc *zc);
+int tcp_send_ring(struct sock *sock, size_t len, bool push);
 int tcp_send_ack(struct sock *sock);
+int tcp_send_rst(struct sock *sock);
+int tcp_resend_synack(struct sock *sock);
 int tcp_send_fin(struct sock *sock);
 void *tcp_retransmit(void *s);
+void *tcp_delack(void *s);
 
 #endif //ANPNETSTACK_TCP_H
@@ -4,16 +4,17 @@
 #include "config.h"
 #include "timer.h"
 #include "cond_wait.h"
+#include "sock_hash.h"
+#include "sock_poll.h"
+#include "syncookie.h"
 
+// must run before the header is converted to host order
 static bool tcp_check_csum(struct subuff *sub) {
     struct iphdr *iph = IP_HDR_FROM_SUB(sub);
     struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
 
-    uint16_t rec_csum = tcph->csum;
-    tcph->csum = 0;
-    tcph->csum = do_tcp_csum( (uint8_t *) tcph, tcph->off, IPP_TCP, iph->saddr, iph->daddr);
-
-    return rec_csum == tcph->csum;
+    // summing over the received checksum as well folds to zero for an intact segment
+    return do_tcp_csum( (uint8_t *) tcph, IP_PAYLOAD_LEN(iph), IPP_TCP, iph->saddr, iph->daddr) == 0;
 }
 
 static bool legal_segment_seq(struct sock *sock, struct subuff *sub) {
@@ -57,6 +58,25 @@ static bool legal_segment_seq(struct sock *sock, struct subuff *sub) {
     return true;
 }
 
+// the mss option of a syn, TCP_DEFAULT_MSS when the peer did not send one
+static uint16_t tcp_parse_mss(struct tcp_hdr *tcph) {
+    uint8_t *opt = (uint8_t *) tcph + TCP_HDR_LEN;
+    uint8_t *end = (uint8_t *) tcph + tcph->off * 4;
+
+    while (opt < end && *opt != TCP_OPT_END) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break;
+        if (opt[0] == TCP_OPT_MSS && opt[1] == TCP_OPT_MSS_LEN)
+            return (opt[2] << 8) | opt[3];
+        opt += opt[1];
+    }
+    return TCP_DEFAULT_MSS;
+}
+
 static void tcp_rcv_synack(struct sock *sock, struct subuff *sub) {
     if (sock->tcp_state != TCP_SYN_SENT) {
         printf("received synack when state isn't syn-sent\n");
@@ -72,13 +92,17 @@ static void tcp_rcv_synack(struct sock *sock, struct subuff *sub) {
         m4_debug("removing synack from retransmit queue because ack was received");
         timer_cancel(sock->timers.retransmit);
         sock->timers.retransmit = NULL;
-        sub_dequeue(&sock->snd_queue);
+        free_sub(sub_dequeue(&sock->snd_queue));
     }
 
     sock->tcb->snd.una++;
     sock->tcb->snd.wnd = tcph->wnd;
-    sock->tcb->irs = tcph->ack;
+    sock->tcb->snd.wl1 = tcph->seq;
+    sock->tcb->snd.wl2 = tcph->ack;
+    sock->tcb->irs = tcph->seq;
     sock->tcb->rcv.nxt = tcph->seq + 1;
+    uint16_t peer_mss = tcp_parse_mss(tcph);
+    sock->mss = ANP_MIN(sock->mss, peer_mss);
 
     #ifdef M3_DEBUG
     printf("tcp_rcv_synack: changing state of sock %d to ESTABLISHED\n", sock->fd);
@@ -91,6 +115,195 @@ static void tcp_rcv_synack(struct sock *sock, struct subuff *sub) {
     tcp_send_ack(sock);
 }
 
+/*
+ * Takes a place in the syn queue of the listener for a new connection, fails when the
+ * accept queue is full already. -EAGAIN when only the syn queue is.
+ */
+static int tcp_synq_add(struct sock *listener) {
+    int ret = 0;
+
+    pthread_mutex_lock(&listener->conds.state_change_mutex);
+    if (listener->accept_len >= listener->backlog)
+        ret = -ENOSPC;
+    else if (listener->syn_len >= ANP_MIN(listener->backlog, ANP_SYN_BACKLOG))
+        ret = -EAGAIN;
+    else
+        listener->syn_len++;
+    pthread_mutex_unlock(&listener->conds.state_change_mutex);
+    return ret;
+}
+
+/*
+ * The listener of a connection on its syn_queue, returned with conds.state_change_mutex
+ * held. NULL once the listener's close() took the connection off, the listener itself is
+ * not freed before the caller leaves its epoch.
+ */
+static struct sock *tcp_synq_lock(struct sock *sock) {
+    struct sock *listener = __atomic_load_n(&sock->listener, __ATOMIC_ACQUIRE);
+    if (!listener)
+        return NULL;
+
+    pthread_mutex_lock(&listener->conds.state_change_mutex);
+    if (sock->listener != listener) {
+        pthread_mutex_unlock(&listener->conds.state_change_mutex);
+        return NULL;
+    }
+    return listener;
+}
+
+// the synack was never acked, called by tcp_retransmit() without the socket locked
+void tcp_synq_drop(struct sock *sock) {
+    struct sock *listener = tcp_synq_lock(sock);
+    if (listener) {
+        list_del(&sock->accept_list);
+        list_init(&sock->accept_list);
+        __atomic_store_n(&sock->listener, NULL, __ATOMIC_RELAXED);
+        listener->syn_len--;
+        pthread_mutex_unlock(&listener->conds.state_change_mutex);
+    }
+    remove_sock_entry(sock);
+}
+
+/*
+ * A passive open in syn-received, in the syn queue of the listener already. irs is the
+ * sequence number of the peer's syn, iss that of our synack. Returned unlocked, the
+ * connection is found by tcp_rx() from then on.
+ */
+static struct sock *tcp_passive_open(struct sock *listener, struct subuff *sub, uint32_t irs,
+                                     uint32_t iss, bool synack_sent, uint16_t peer_mss) {
+    struct iphdr *iph = IP_HDR_FROM_SUB(sub);
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
+
+    struct sock *sock = alloc_sock();
+    pthread_mutex_lock(&listener->conds.state_change_mutex);
+    if (sock) {
+        list_add_tail(&sock->accept_list, &listener->syn_queue);
+        __atomic_store_n(&sock->listener, listener, __ATOMIC_RELAXED);
+    } else {
+        listener->syn_len--;
+    }
+    pthread_mutex_unlock(&listener->conds.state_change_mutex);
+    if (!sock) {
+        m4_debug("failed to allocate socket for incoming connection");
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&sock->rwlock);
+    // the options set on the listener hold for its connections
+    sock->nodelay = listener->nodelay;
+    sock->cork = listener->cork;
+    sock->quickack = listener->quickack;
+    sock->rcvlowat = listener->rcvlowat;
+    sock->notsent_lowat = listener->notsent_lowat;
+    if ((sock->rcv_ring.size != listener->rcv_ring.size &&
+         byte_ring_resize(&sock->rcv_ring, listener->rcv_ring.size) < 0) ||
+        (sock->snd_ring.size != listener->snd_ring.size &&
+         byte_ring_resize(&sock->snd_ring, listener->snd_ring.size) < 0))
+        m4_debug("failed to size the buffers of incoming connection like the listener's");
+    sock->timers.rto = TCP_START_RTO;
+    sock->tcb->iss = iss;
+    sock->tcb->snd.una = iss;
+    sock->tcb->snd.nxt = synack_sent ? iss + 1 : iss;
+    sock->tcb->snd.wnd = tcph->wnd;
+    sock->tcb->snd.wl1 = irs;
+    sock->tcb->irs = irs;
+    sock->tcb->rcv.nxt = irs + 1;
+    tcp_update_rcv_wnd(sock);
+    change_state(sock, TCP_SYN_RECEIVED);
+    sock->saddr = iph->daddr;
+    sock->daddr = iph->saddr;
+    sock->sport = tcph->dport;
+    sock->dport = tcph->sport;
+    sock_hash_add(sock);
+    uint16_t local_mss = tcp_local_mss(sock->daddr);
+    sock->mss = ANP_MIN(local_mss, peer_mss);
+    pthread_rwlock_unlock(&sock->rwlock);
+    return sock;
+}
+
+// a syn on a listening socket, the new connection gets its own socket in syn-received
+static void tcp_rcv_syn(struct sock *listener, struct subuff *sub) {
+    struct iphdr *iph = IP_HDR_FROM_SUB(sub);
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
+
+    int ret = tcp_synq_add(listener);
+    if (ret == -ENOSPC) {
+        m4_debug("accept queue of listening socket is full, dropping syn");
+        return;
+    }
+    if (ret == -EAGAIN) {
+#ifdef ANP_SYN_COOKIES
+        // nothing is kept, the ack that returns the cookie opens the connection
+        uint32_t cookie = syncookie_make(iph->saddr, iph->daddr, tcph->sport, tcph->dport,
+                                         tcph->seq, tcp_parse_mss(tcph));
+        tcp_send_cookie_synack(iph->daddr, iph->saddr, tcph->dport, tcph->sport, cookie, tcph->seq + 1);
+#else
+        m4_debug("syn queue of listening socket is full, dropping syn");
+#endif
+        return;
+    }
+
+    struct sock *sock = tcp_passive_open(listener, sub, tcph->seq, generate_ISS(), false, tcp_parse_mss(tcph));
+    // a lost synack is resent by the retransmit timer
+    if (sock && tcp_send_synack(sock) < 0)
+        m4_debug("failed to send synack");
+}
+
+#ifdef ANP_SYN_COOKIES
+/*
+ * An ack on a listening socket that returns a syn cookie, the connection is set up in
+ * syn-received as if its synack had been sent from there. The caller hands the ack on to it.
+ */
+static struct sock *tcp_rcv_cookie_ack(struct sock *listener, struct subuff *sub) {
+    struct iphdr *iph = IP_HDR_FROM_SUB(sub);
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
+    uint32_t cookie = tcph->ack - 1;
+
+    uint16_t peer_mss = syncookie_check(iph->saddr, iph->daddr, tcph->sport, tcph->dport,
+                                        tcph->seq - 1, cookie);
+    if (!peer_mss) {
+        m4_debug("ack on listening socket is not for a syn cookie");
+        return NULL;
+    }
+    // counts as half-open until the ack completes it, even when the syn queue is full
+    pthread_mutex_lock(&listener->conds.state_change_mutex);
+    bool full = listener->accept_len >= listener->backlog;
+    if (!full)
+        listener->syn_len++;
+    pthread_mutex_unlock(&listener->conds.state_change_mutex);
+    if (full) {
+        m4_debug("accept queue of listening socket is full, dropping syn cookie");
+        return NULL;
+    }
+
+    return tcp_passive_open(listener, sub, tcph->seq - 1, cookie, true, peer_mss);
+}
+#endif
+
+// the handshake of a passive open completed, hand the connection to accept()
+static void tcp_rcv_handshake_ack(struct sock *sock) {
+    change_state(sock, TCP_ESTABLISHED);
+
+    struct sock *listener = tcp_synq_lock(sock);
+    if (!listener) {
+        m4_debug("listening socket is gone, connection will not be accepted");
+        return;
+    }
+    // the listener is closing, it resets whatever is on its queues
+    if (listener->tcp_state != TCP_LISTEN) {
+        pthread_mutex_unlock(&listener->conds.state_change_mutex);
+        return;
+    }
+
+    list_del(&sock->accept_list);
+    listener->syn_len--;
+    list_add_tail(&sock->accept_list, &listener->accept_queue);
+    listener->accept_len++;
+    pthread_cond_broadcast(&listener->conds.state_change_cond);
+    pthread_mutex_unlock(&listener->conds.state_change_mutex);
+    sock_poll_wake(listener);
+}
+
 static void tcp_rcv_ack(struct sock *sock, struct subuff *sub) {
     if (sock->tcp_state == TCP_CLOSED || sock->tcp_state == TCP_SYN_SENT) {
         m4_debug("received ack when not in state to do so");
@@ -122,10 +335,11 @@ static void tcp_rcv_ack(struct sock *sock, struct subuff *sub) {
         sock->timers.rto = TCP_START_RTO;
         sock->timers.retries = 0;
     }
-    // set send window
-    if (sock->tcb->snd.una < tcph->seq && tcph->seq <= sock->tcb->snd.nxt) {
-        if (sock->tcb->snd.wl1 < tcph->seq ||
-           (sock->tcb->snd.wl1 == tcph->seq && sock->tcb->snd.wl2 <= tcph->ack)) {
+    // set send window, from the latest segment only (RFC 793 page 72), a pure window
+    // update acks nothing new
+    if (TCP_SEQ_LEQ(sock->tcb->snd.una, tcph->ack) && TCP_SEQ_LEQ(tcph->ack, sock->tcb->snd.nxt)) {
+        if (TCP_SEQ_LT(sock->tcb->snd.wl1, tcph->seq) ||
+           (sock->tcb->snd.wl1 == tcph->seq && TCP_SEQ_LEQ(sock->tcb->snd.wl2, tcph->ack))) {
 
             sock->tcb->snd.wnd = tcph->wnd;
             sock->tcb->snd.wl1 = tcph->seq;
@@ -134,6 +348,7 @@ static void tcp_rcv_ack(struct sock *sock, struct subuff *sub) {
     }
 }
 
+// copies the data into the receive ring, the frame itself can go back right away
 static void tcp_rcv_data(struct sock *sock, struct subuff *sub) {
     if (sock->tcp_state == TCP_CLOSED || sock->tcp_state == TCP_SYN_SENT) {
         m4_debug("received data when not in state to do so");
@@ -149,16 +364,30 @@ static void tcp_rcv_data(struct sock *sock, struct subuff *sub) {
     }
 
     uint32_t seg_len = iph->len - (iph->ihl * 4) - (tcph->off * 4);
-    sub_queue_tail(&sock->rcv_queue, sub);
-    sock->tcb->rcv.nxt += seg_len;
-    sock->tcb->rcv.wnd -= seg_len;
-    tcp_send_ack(sock);
+    // legal_segment_seq() checked it fits rcv.wnd, which is never more than the ring has free
+    sock->tcb->rcv.nxt += byte_ring_write(&sock->rcv_ring, TCP_DATA_FROM_SUB(sub), seg_len);
+    tcp_update_rcv_wnd(sock);
+    tcp_rcv_wake(sock);
+    // without TCP_QUICKACK every second segment is acked, a lone one when the timer runs out
+    if (sock->quickack || __atomic_add_fetch(&sock->delack_segs, 1, __ATOMIC_RELAXED) >= 2)
+        tcp_send_ack(sock);
+    else if (!sock->timers.delack)
+        sock->timers.delack = timer_add(ANP_TCP_DELACK_MSEC, tcp_delack, (void *) sock);
 }
 
 void tcp_rx(struct subuff *sub) {
     struct iphdr *iph = IP_HDR_FROM_SUB(sub);
     struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
 
+    // skipped when the device has verified it or the segment never left the host
+    if (sub->ip_summed == CHECKSUM_NONE && !tcp_check_csum(sub)) {
+        #ifdef M3_DEBUG
+                printf("checksum did not match\n");
+        #endif
+
+        goto drop_pkt;
+    }
+
     tcph->sport = ntohs(tcph->sport);
     tcph->dport = ntohs(tcph->dport);
     tcph->seq = ntohl(tcph->seq);
@@ -169,20 +398,16 @@ void tcp_rx(struct subuff *sub) {
 
     debug_tcp_hdr("in", tcph);
 
-    if (!tcp_check_csum) {
-        #ifdef M3_DEBUG
-                printf("checksum did not match\n");
-        #endif
-
-        goto drop_pkt;
-    }
-
     struct sock *sock = get_sock_by_connection(
             tcph->dport, tcph->sport,
             iph->daddr, iph->saddr
     );
 
 
+    // no connection yet, maybe someone is listening
+    if (!sock)
+        sock = get_listen_sock(tcph->dport, iph->daddr);
+
     if (!sock) {
         #ifdef M3_DEBUG
                 printf("tcp_rx: no socket found for connection\n");
@@ -191,16 +416,37 @@ void tcp_rx(struct subuff *sub) {
     }
 
     uint32_t seg_len = iph->len - (iph->ihl * 4) - (tcph->off * 4);
+    bool acked = false;
 
     // https://tools.ietf.org/html/rfc793#section-3.7 page 25, guideline on accepting packets
 
+lock:
     pthread_rwlock_wrlock(&sock->rwlock);
+    // the reader made room in the receive ring since, without the lock
+    tcp_update_rcv_wnd(sock);
     switch(sock->tcp_state) {
         case TCP_CLOSED:
             m4_debug("received segment when socket is closed");
             goto unlock;
         case TCP_LISTEN:
-            m4_debug("received packet when in listen state - not implemented");
+            if (tcph->ctl.rst == 1)
+                goto unlock;
+#ifdef ANP_SYN_COOKIES
+            // the new socket takes the ack from here, as if it had been there all along
+            if (tcph->ctl.ack == 1 && tcph->ctl.syn == 0) {
+                struct sock *child = tcp_rcv_cookie_ack(sock, sub);
+                if (child) {
+                    pthread_rwlock_unlock(&sock->rwlock);
+                    sock = child;
+                    goto lock;
+                }
+            }
+#endif
+            // rst is ignored, an ack would get a rst (unimplemented), only a syn opens a connection
+            if (tcph->ctl.ack == 1 || tcph->ctl.syn == 0)
+                goto unlock;
+
+            tcp_rcv_syn(sock, sub);
             goto unlock;
         case TCP_SYN_SENT:
             if (tcph->ctl.ack == 1) {
@@ -219,8 +465,7 @@ void tcp_rx(struct subuff *sub) {
             if (tcph->ctl.syn == 1) {
                 if (tcph->ctl.ack == 1) {
                     tcp_rcv_synack(sock, sub);
-                    pthread_rwlock_unlock(&sock->rwlock);
-                    return;
+                    goto unlock;
                 }
                 // moving into syn_received state is unimplemented - it is always assumed we are the initiators
                 else if (tcph->ctl.ack == 0) {
@@ -231,8 +476,25 @@ void tcp_rx(struct subuff *sub) {
             goto unlock;
 
         case TCP_SYN_RECEIVED:
-            m4_debug("got packet when in syn received state - unimplemented");
-            goto unlock;
+            // the peer did not get our synack, it is lost or still on its way
+            if (tcph->ctl.syn == 1 && tcph->ctl.ack == 0 && tcph->seq == sock->tcb->irs) {
+                tcp_resend_synack(sock);
+                goto unlock;
+            }
+            if (legal_segment_seq(sock, sub) == false) {
+                tcp_send_ack(sock);
+                goto unlock;
+            }
+            // rst not implemented
+            if (tcph->ctl.rst == 1 || tcph->ctl.syn == 1 || tcph->ctl.ack == 0)
+                goto unlock;
+            if (tcph->ack <= sock->tcb->snd.una || tcph->ack > sock->tcb->snd.nxt) {
+                // rst would be sent, but is unimplemented
+                goto unlock;
+            }
+
+            tcp_rcv_handshake_ack(sock);
+            // the ack is processed below, it can carry data or a fin already
         case TCP_ESTABLISHED:
         case TCP_FIN_WAIT_1:
         case TCP_FIN_WAIT_2:
@@ -267,6 +529,7 @@ void tcp_rx(struct subuff *sub) {
                     case TCP_CLOSE_WAIT:
                     case TCP_ESTABLISHED:
                         tcp_rcv_ack(sock, sub);
+                        acked = true;
                         break;
                     case TCP_FIN_WAIT_1:
                         tcp_rcv_ack(sock, sub);
@@ -282,7 +545,7 @@ void tcp_rx(struct subuff *sub) {
                     case TCP_CLOSING:
                         tcp_rcv_ack(sock, sub);
                         if (sock->tcb->snd.una == sock->tcb->snd.nxt) {
-                            change_state(sock, TCP_CLOSING);
+                            change_state(sock, TCP_TIME_WAIT);
                             broadcast_cond(&sock->conds.state_change_cond);
                         }
                         goto unlock;
@@ -331,26 +594,28 @@ void tcp_rx(struct subuff *sub) {
                     sock->tcp_state == TCP_SYN_SENT)
                     goto unlock;
 
-                sock->tcb->rcv.nxt = tcph->seq + 1;
-                pthread_rwlock_unlock(&sock->rwlock);
+                // the fin takes up one sequence number, after any data it came with
+                sock->tcb->rcv.nxt = tcph->seq + seg_len + 1;
                 tcp_send_ack(sock);
-                pthread_rwlock_wrlock(&sock->rwlock);
-                sock->tcb->rcv.nxt++;
 
                 switch(sock->tcp_state) {
                     case TCP_ESTABLISHED:
                         change_state(sock, TCP_CLOSE_WAIT);
                         broadcast_cond(&sock->conds.state_change_cond);
+                        tcp_rcv_wake(sock);
                         break;
                     case TCP_FIN_WAIT_1:
-                        if (sock->tcb->snd.una == sock->tcb->snd.nxt) {
+                        // a simultaneous close waits in closing for the ack of our fin
+                        if (sock->tcb->snd.una == sock->tcb->snd.nxt)
                             change_state(sock, TCP_TIME_WAIT);
-                            broadcast_cond(&sock->conds.state_change_cond);
-                        }
+                        else
+                            change_state(sock, TCP_CLOSING);
+                        broadcast_cond(&sock->conds.state_change_cond);
                         break;
                     case TCP_FIN_WAIT_2:
                         change_state(sock, TCP_TIME_WAIT);
                         broadcast_cond(&sock->conds.state_change_cond);
+                        tcp_rcv_wake(sock);
                         break;
                     case TCP_CLOSE_WAIT:
                     case TCP_CLOSING:
@@ -362,8 +627,7 @@ void tcp_rx(struct subuff *sub) {
                         goto unlock;
                 }
             }
-            pthread_rwlock_unlock(&sock->rwlock);
-            return;
+            goto unlock;
         default:
             m4_debug("received packet when in unknown state");
             goto unlock;
@@ -371,6 +635,9 @@ void tcp_rx(struct subuff *sub) {
 
 unlock:
     pthread_rwlock_unlock(&sock->rwlock);
+    // the ack can open the window for more of the send ring
+    if (acked)
+        tcp_output(sock);
 drop_pkt:
     free_sub(sub);
 }
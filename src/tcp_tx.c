@@ -4,6 +4,7 @@
 #include "sock.h"
 #include "timer.h"
 #include "utilities.h"
+#include "zerocopy.h"
 
 static void tcp_release_rto_timer(struct sock *sock) {
     timer_release(sock->timers.retransmit);
@@ -15,19 +16,31 @@ static void tcp_reset_rto_timer(struct sock *sock) {
     sock->timers.retransmit = timer_add(sock->timers.rto, tcp_retransmit, (void *) sock);
 }
 
-// standard here is the sub it receives is always pushed up to, but not including the tcp header
-static int tcp_send_subuff(struct sock *sock, struct subuff *sub) {
+// pushes the header for the connection (saddr, sport) to (daddr, dport) and sends sub
+static int tcp_xmit(struct subuff *sub, uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                    uint32_t ack, uint16_t wnd) {
+    int opt_len = 0;
+    // a syn tells the peer how large our segments may be, pushed again on a retransmit
+    if ((TCP_HDR_FROM_SUB(sub))->ctl.syn) {
+        uint16_t mss = tcp_local_mss(daddr);
+        uint8_t *opt = sub_push(sub, TCP_OPT_MSS_LEN);
+        opt[0] = TCP_OPT_MSS;
+        opt[1] = TCP_OPT_MSS_LEN;
+        opt[2] = mss >> 8;
+        opt[3] = mss & 0xff;
+        opt_len = TCP_OPT_MSS_LEN;
+    }
     sub_push(sub, TCP_HDR_LEN);
     struct tcp_hdr *tcph = (struct tcp_hdr *) sub->data;
     sub->protocol = IPP_TCP;
 
-    tcph->sport = sock->sport;
-    tcph->dport = sock->dport;
-    tcph->seq = sock->tcb->snd.nxt;
-    tcph->ack = sock->tcb->rcv.nxt;
+    tcph->sport = sport;
+    tcph->dport = dport;
+    tcph->seq = sub->seq;
+    tcph->ack = ack;
     tcph->res = 0;
-    tcph->off = 5;
-    tcph->wnd = sock->tcb->rcv.wnd;
+    tcph->off = (TCP_HDR_LEN + opt_len) / 4;
+    tcph->wnd = wnd;
     tcph->csum = 0;
     tcph->urgp = 0;
 
@@ -40,40 +53,73 @@ static int tcp_send_subuff(struct sock *sock, struct subuff *sub) {
     tcph->wnd = htons(tcph->wnd);
     tcph->csum = htons(tcph->csum);
     tcph->urgp = htons(tcph->urgp);
-    tcph->csum = do_tcp_csum( (uint8_t *) tcph, TCP_HDR_LEN + sub->dlen, IPP_TCP, sock->saddr, sock->daddr);
+    // only the pseudo header part, the device or netdev_transmit() sums the segment itself
+    tcph->csum = do_pseudo_csum(TCP_HDR_LEN + opt_len + sub->dlen, IPP_TCP, saddr, daddr);
+    sub->ip_summed = CHECKSUM_PARTIAL;
+    sub->csum_start = sub->data - sub->head;
+    sub->csum_offset = offsetof(struct tcp_hdr, csum);
 
-    int ret = ip_output(sock->daddr, sub);
-    if (sub_queue_empty(&sock->snd_queue)) {
-        tcp_reset_rto_timer(sock);
-        sock->timers.retries = 0;
-        sock->timers.rto = TCP_START_RTO;
-    }
+    return ip_output(daddr, sub);
+}
 
+// standard here is the sub it receives is always pushed up to, but not including the tcp header
+static int tcp_send_subuff(struct sock *sock, struct subuff *sub) {
+    // the segment carries the ack a delayed ack was waiting to send
+    __atomic_store_n(&sock->delack_segs, 0, __ATOMIC_RELAXED);
+    return tcp_xmit(sub, sock->saddr, sock->daddr, sock->sport, sock->dport,
+                    sock->tcb->rcv.nxt, tcp_rcv_wnd(sock));
+}
+
+/*
+ * A queued segment is never sent itself, it stays as it is for a retransmit and a clone
+ * carries the headers to the device. A clone from an earlier transmit can still be on the
+ * tx queue with its headers in the same buffer, the segment is copied then.
+ */
+static struct subuff *tcp_clone_sub(struct subuff *sub) {
+    return sub_cloned(sub) ? sub_copy(sub) : sub_clone(sub);
+}
+
+static int tcp_send_clone(struct sock *sock, struct subuff *clone) {
+    if (!clone)
+        return -ENOMEM;
+
+    int ret = tcp_send_subuff(sock, clone);
+    free_sub(clone);
     return ret;
 }
 
+static int tcp_transmit_sub(struct sock *sock, struct subuff *sub) {
+    return tcp_send_clone(sock, tcp_clone_sub(sub));
+}
+
 // standard here is the sub it receives is always pushed up to, but not including the tcp header
 static int tcp_queue_send(struct sock* sock, struct subuff *sub) {
-    int ret = -1;
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
     // TODO: put the tcb window check here, to see if packet can be sent
 
-    ret = tcp_send_subuff(sock, sub);
-
+    // the segment is queued before it leaves, over loopback the peer's ack can be
+    // processed before ip_output() even returns. tcp_rx() takes acked segments off the
+    // queue under the same lock, and may free this one as soon as it is dropped.
     pthread_rwlock_wrlock(&sock->rwlock);
     sub->seq = sock->tcb->snd.nxt;
-    sock->tcb->snd.nxt += sub->dlen;
+    sock->tcb->snd.nxt += sub->dlen + tcph->ctl.syn + tcph->ctl.fin;
     sub->end_seq = sock->tcb->snd.nxt;
-    pthread_rwlock_unlock(&sock->rwlock);
-
+    if (sub_queue_empty(&sock->snd_queue)) {
+        sock->timers.retries = 0;
+        sock->timers.rto = TCP_START_RTO;
+        tcp_reset_rto_timer(sock);
+    }
     sub_queue_tail(&sock->snd_queue, sub);
+    struct subuff *clone = tcp_clone_sub(sub);
+    pthread_rwlock_unlock(&sock->rwlock);
 
-    return ret;
+    return tcp_send_clone(sock, clone);
 }
 
 int tcp_send_syn(struct sock *sock) {
     // allocate subuff and reserve necessary space
-    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
-    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_MSS_LEN);
+    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_MSS_LEN);
     sub->dlen = 0;
 
     struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
@@ -86,14 +132,48 @@ int tcp_send_syn(struct sock *sock) {
     return tcp_queue_send(sock, sub);
 }
 
-int tcp_send_data(struct sock *sock, const void *buf, size_t len, bool push) {
-    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + len);
-    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + len);
+// second step of a passive open, answers the peer's syn
+int tcp_send_synack(struct sock *sock) {
+    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_MSS_LEN);
+    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_MSS_LEN);
+    sub->dlen = 0;
+
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
+
+    tcph->ctl.syn = 1;
+    tcph->ctl.ack = 1;
+
+    return tcp_queue_send(sock, sub);
+}
+
+// a synack no socket keeps, its sequence number is a syn cookie (syncookie.h)
+int tcp_send_cookie_synack(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                           uint32_t seq, uint32_t ack) {
+    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_MSS_LEN);
+    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_MSS_LEN);
+    sub->dlen = 0;
+
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
+
+    tcph->ctl.syn = 1;
+    tcph->ctl.ack = 1;
+    sub->seq = seq;
+
+    int ret = tcp_xmit(sub, saddr, daddr, sport, dport, ack, ANP_MIN(ANP_SOCK_RCVBUF, TCP_MAX_WINDOW));
+    free_sub(sub);
+    return ret;
+}
+
+// queues and sends a segment whose len bytes of payload are in place already
+static int tcp_queue_data(struct sock *sock, struct subuff *sub, size_t len, bool push) {
     struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
     sub->dlen = len;
-    sub_push(sub, len);
 
-    memcpy(sub->data, buf, len);
+    // a super-segment, the device cuts it into mss sized segments
+    if (len > sock->mss) {
+        sub->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        sub->gso_size = sock->mss;
+    }
 
     // https://serverfault.com/questions/928642/all-tcp-packets-have-the-psh-flag-set-who-what-would-be-responsible-for-that
     if (push)
@@ -104,6 +184,38 @@ int tcp_send_data(struct sock *sock, const void *buf, size_t len, bool push) {
     return tcp_queue_send(sock, sub);
 }
 
+// with zc the payload stays in buf, the subuff only has room for the headers and points to it
+int tcp_send_data(struct sock *sock, const void *buf, size_t len, bool push, struct sub_zc *zc) {
+    struct subuff *sub;
+    if (zc) {
+        sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+        if (!sub)
+            return -ENOMEM;
+        sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+        sub_add_frag(sub, (void *) buf, len);
+        sub->zc = zc_get(zc);
+    } else {
+        sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + len);
+        if (!sub)
+            return -ENOMEM;
+        sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + len);
+        sub_push(sub, len);
+        memcpy(sub->data, buf, len);
+    }
+    return tcp_queue_data(sock, sub, len, push);
+}
+
+// the next len bytes of the send ring as a segment, called with conds.ack_mutex held
+int tcp_send_ring(struct sock *sock, size_t len, bool push) {
+    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + len);
+    if (!sub)
+        return -ENOMEM;
+    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + len);
+    sub_push(sub, len);
+    byte_ring_read(&sock->snd_ring, sub->data, len);
+    return tcp_queue_data(sock, sub, len, push);
+}
+
 int tcp_send_fin(struct sock *sock) {
     struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
     sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
@@ -117,6 +229,33 @@ int tcp_send_fin(struct sock *sock) {
     return tcp_queue_send(sock, sub);
 }
 
+// a syn that came again while in syn-received, the synack is still the one on the queue
+int tcp_resend_synack(struct sock *sock) {
+    struct subuff *sub = sub_peek(&sock->snd_queue);
+    if (!sub)
+        return 0;
+    return tcp_transmit_sub(sock, sub);
+}
+
+// aborts the connection, like an ack it is sent without being queued
+int tcp_send_rst(struct sock *sock) {
+    struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+    if (!sub)
+        return -ENOMEM;
+    sub_reserve(sub, ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+    sub->dlen = 0;
+
+    struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
+
+    tcph->ctl.rst = 1;
+    tcph->ctl.ack = 1;
+    sub->seq = sock->tcb->snd.nxt;
+
+    int ret = tcp_send_subuff(sock, sub);
+    free_sub(sub);
+    return ret;
+}
+
 // ack goes straight to send without queuing segment as acks shouldn't be retransmitted from the queue
 int tcp_send_ack(struct sock *sock) {
     struct subuff *sub = alloc_sub(ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
@@ -126,8 +265,24 @@ int tcp_send_ack(struct sock *sock) {
     struct tcp_hdr *tcph = TCP_HDR_FROM_SUB(sub);
 
     tcph->ctl.ack = 1;
+    sub->seq = sock->tcb->snd.nxt;
 
-    return tcp_send_subuff(sock, sub);
+    int ret = tcp_send_subuff(sock, sub);
+    free_sub(sub);
+    return ret;
+}
+
+// the delayed ack timer ran out, nothing went to the peer since the segment it waited on
+void *tcp_delack(void *s) {
+    struct sock *sock = (struct sock *) s;
+
+    pthread_rwlock_wrlock(&sock->rwlock);
+    timer_release(sock->timers.delack);
+    sock->timers.delack = NULL;
+    if (__atomic_load_n(&sock->delack_segs, __ATOMIC_RELAXED) > 0 && sock->tcp_state != TCP_CLOSED)
+        tcp_send_ack(sock);
+    pthread_rwlock_unlock(&sock->rwlock);
+    return NULL;
 }
 
 // retransmit logic called from timer when it runs out
@@ -149,17 +304,27 @@ void *tcp_retransmit(void *s) {
         // TODO: reset or release, then set in transmit?
         tcp_release_rto_timer(sock);
         goto end;
+    } else if (sock->tcp_state == TCP_SYN_RECEIVED && sock->timers.retries > TCP_CONN_RETRIES) {
+        // nobody waits on a half-open connection, its socket goes right away
+        m4_debug("failed to receive ack of synack");
+        change_state(sock, TCP_CLOSED);
+        tcp_release_rto_timer(sock);
+        pthread_rwlock_unlock(&sock->rwlock);
+        tcp_synq_drop(sock);
+        return NULL;
     } else if (sock->tcp_state == TCP_SYN_SENT) {
         if (sock->timers.retries > TCP_CONN_RETRIES) {
             printf("failed to receive synack\n");
             sock->err = ETIMEDOUT;
+            sock->so_error = ETIMEDOUT;
+            // a nonblocking connect() learns it from poll() and SO_ERROR
+            change_state(sock, TCP_CLOSED);
             tcp_release_rto_timer(sock);
             goto end;
         } else {
             sock->timers.retries++;
             sock->timers.rto *= 2;
-            sub_reset_header(sub);
-            tcp_send_subuff(sock, sub);
+            tcp_transmit_sub(sock, sub);
             tcp_reset_rto_timer(sock);
             goto end;
         }
@@ -167,13 +332,13 @@ void *tcp_retransmit(void *s) {
         if (sock->timers.retries > TCP_MAX_RETRIES) {
             printf("failed to receive ack after 15 retries\n");
             sock->err = ETIMEDOUT;
+            sock->so_error = ETIMEDOUT;
             tcp_release_rto_timer(sock);
             goto end;
         } else {
             sock->timers.retries++;
             sock->timers.rto *= 2;
-            sub_reset_header(sub);
-            tcp_send_subuff(sock, sub);
+            tcp_transmit_sub(sock, sub);
             tcp_reset_rto_timer(sock);
             goto end;
         }
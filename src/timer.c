@@ -52,6 +52,11 @@ static void timer_free(struct timer *t)
     free(t);
 }
 
+static void timer_reclaim(struct epoch_head *head)
+{
+    timer_free(list_entry(head, struct timer, epoch));
+}
+
 static struct timer *timer_alloc()
 {
     struct timer *t = calloc(sizeof(struct timer), 1);
@@ -60,6 +65,48 @@ static struct timer *timer_alloc()
     return t;
 }
 
+struct timer_run {
+    void *(*handler)(void *);
+    void *arg;
+    struct epoch_rec *rec;
+};
+
+static void *timer_run(void *arg)
+{
+    struct timer_run run = *(struct timer_run *) arg;
+
+    free(arg);
+    epoch_adopt(run.rec);
+    run.handler(run.arg);
+    epoch_exit();
+    return NULL;
+}
+
+/*
+ * The handler runs in a thread of its own. It inherits the critical section of the tick,
+ * so a socket that is removed after the timer fired stays valid for it.
+ */
+static int timer_fire(struct timer *t)
+{
+    struct timer_run *run = malloc(sizeof(*run));
+    pthread_t th;
+    int rc;
+
+    if (!run) {
+        return -ENOMEM;
+    }
+    run->handler = t->handler;
+    run->arg = t->arg;
+    run->rec = epoch_hand_over();
+    if ((rc = pthread_create(&th, NULL, timer_run, run)) != 0) {
+        printf("Timer handler thread: %s\n", strerror(rc));
+        epoch_release(run->rec);
+        free(run);
+        return -rc;
+    }
+    return 0;
+}
+
 static void timers_tick()
 {
     struct list_head *item, *tmp = NULL;
@@ -70,6 +117,7 @@ static void timers_tick()
         printf("Timer tick lock not acquired: %s\n", strerror(rc));
         return;
     };
+    epoch_enter();
 
     list_for_each_safe(item, tmp, &timers) {
         if (!item) {
@@ -86,22 +134,22 @@ static void timers_tick()
             continue;
         }
 
-        if (!t->cancelled && t->expires < tick) {
+        // one that could not fire is tried again with the next tick
+        if (!t->cancelled && t->expires < tick && timer_fire(t) == 0) {
             t->cancelled = 1;
-            pthread_t th;
-            pthread_create(&th, NULL, t->handler, t->arg);
         }
 
         if (t->cancelled && t->refcnt == 0) {
             list_del(&t->list);
             pthread_mutex_unlock(&t->lock);
 
-            timer_free(t);
+            epoch_retire(&t->epoch, timer_reclaim);
         } else {
             pthread_mutex_unlock(&t->lock);
         }
     }
 
+    epoch_exit();
     pthread_mutex_unlock(&lock);
 }
 
@@ -195,6 +243,7 @@ void *timers_start()
         tick += 10;
         pthread_rwlock_unlock(&rwlock);
         timers_tick();
+        epoch_poll();
     }
 }
 
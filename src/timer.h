@@ -20,6 +20,7 @@
 
 #include "systems_headers.h"
 #include "linklist.h"
+#include "epoch.h"
 #define timer_dbg(msg, t)                                               \
     do {                                                                \
         print_debug("Timer at %d: "msg": expires %d", tick, t->expires); \
@@ -33,6 +34,7 @@ struct timer {
     void *(*handler)(void *);
     void *arg;
     pthread_mutex_t lock;
+    struct epoch_head epoch;
 };
 
 struct timer *timer_add(uint32_t expire, void *(*handler)(void *), void *arg);
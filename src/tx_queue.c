@@ -0,0 +1,178 @@
+/*
+ * The transmit queue of a device. netdev_transmit() puts a reference to the frame on it and
+ * returns, the device's TX thread takes whatever piled up, up to ANP_TX_BURST frames, and
+ * hands them to tx_burst() per device queue. A burst costs the packet backend a single
+ * send() on its TX ring. The thread is only woken up through wake_fd when it went to sleep
+ * on an empty queue, while it is busy, producers don't make a syscall at all.
+ */
+
+#include "tx_queue.h"
+#include "mpsc_ring.h"
+#include "anp_netdev.h"
+#include "config.h"
+
+#include <sys/eventfd.h>
+
+extern volatile bool stop;
+
+struct tx_queue *tx_queue_alloc(struct anp_netdev *dev, uint32_t size)
+{
+    struct tx_queue *txq = calloc(1, sizeof(*txq));
+
+    if (!txq) {
+        printf("Error: tx queue calloc failed \n");
+        return NULL;
+    }
+    txq->dev = dev;
+    txq->ring = mpsc_ring_alloc(size);
+    txq->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (!txq->ring || 0 > txq->wake_fd) {
+        printf("Error: could not set up the tx queue, errno %d \n", errno);
+        free(txq);
+        return NULL;
+    }
+    return txq;
+}
+
+// takes ownership of sub, -ENOBUFS when the queue is full
+int tx_queue_push(struct tx_queue *txq, struct subuff *sub)
+{
+    uint64_t one = 1;
+
+    if (!mpsc_ring_push(txq->ring, sub)) {
+        __atomic_fetch_add(&txq->drops, 1, __ATOMIC_RELAXED);
+        free_sub(sub);
+        return -ENOBUFS;
+    }
+    uint64_t enqueued = __atomic_add_fetch(&txq->enqueued, 1, __ATOMIC_RELAXED);
+    uint32_t depth = enqueued - __atomic_load_n(&txq->dequeued, __ATOMIC_RELAXED);
+    uint32_t max = __atomic_load_n(&txq->max_depth, __ATOMIC_RELAXED);
+    while (depth > max && !__atomic_compare_exchange_n(&txq->max_depth, &max, depth, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    // pairs with the fence in tx_queue_wait()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&txq->sleeping, __ATOMIC_SEQ_CST)) {
+        write(txq->wake_fd, &one, sizeof(one));
+    }
+    return 0;
+}
+
+static int tx_queue_pop(struct tx_queue *txq, struct subuff **subs, int max)
+{
+    int n = 0;
+
+    while (n < max && NULL != (subs[n] = mpsc_ring_pop(txq->ring))) {
+        n++;
+    }
+    return n;
+}
+
+// like loop_rx_burst(), announce the sleep and look once more before going to sleep
+static int tx_queue_wait(struct tx_queue *txq, struct subuff **subs, int max)
+{
+    struct pollfd pfd = { .fd = txq->wake_fd, .events = POLLIN };
+    uint64_t val;
+    int n = tx_queue_pop(txq, subs, max);
+
+    if (n > 0) {
+        return n;
+    }
+    __atomic_store_n(&txq->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    n = tx_queue_pop(txq, subs, max);
+    if (0 == n) {
+        poll(&pfd, 1, ANP_RX_POLL_MSEC);
+        read(txq->wake_fd, &val, sizeof(val));
+        n = tx_queue_pop(txq, subs, max);
+    }
+    __atomic_store_n(&txq->sleeping, 0, __ATOMIC_SEQ_CST);
+    return n;
+}
+
+static void tx_queue_count_burst(struct tx_queue *txq, int n)
+{
+    int bucket = 0;
+
+    // bucket i counts bursts of 2^i up to 2^(i+1) - 1 frames
+    while (n > 1 && bucket < ANP_TX_BURST_BUCKETS - 1) {
+        n >>= 1;
+        bucket++;
+    }
+    __atomic_fetch_add(&txq->bursts, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&txq->burst_sizes[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// sends the frames of one device queue, whatever the device does not take is dropped
+static void tx_queue_flush(struct tx_queue *txq, int queue, struct subuff **subs, int count)
+{
+    struct anp_netdev *dev = txq->dev;
+    int ret = dev->ops->tx_burst(dev, queue, subs, count);
+
+    tx_queue_count_burst(txq, count);
+    if (ret < count) {
+        // a full device, TCP sends them again
+        __atomic_fetch_add(&txq->errors, count - (ret < 0 ? 0 : ret), __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < count; i++) {
+        free_sub(subs[i]);
+    }
+}
+
+void *tx_queue_loop(void *arg)
+{
+    struct tx_queue *txq = arg;
+    struct anp_netdev *dev = txq->dev;
+    struct subuff *subs[ANP_TX_BURST];
+    struct subuff *batch[ANP_TX_BURST];
+
+    while (!stop) {
+        int n = tx_queue_wait(txq, subs, ANP_TX_BURST);
+        if (0 == n) {
+            continue;
+        }
+        __atomic_fetch_add(&txq->dequeued, n, __ATOMIC_RELAXED);
+        // netdev_transmit() put the device queue into the subuff, keep each queue's frames
+        // in the order they came
+        for (int q = 0; q < dev->num_queues; q++) {
+            int count = 0;
+            for (int i = 0; i < n; i++) {
+                if (subs[i]->tx_queue == q) {
+                    batch[count++] = subs[i];
+                }
+            }
+            if (count > 0) {
+                tx_queue_flush(txq, q, batch, count);
+            }
+        }
+    }
+    return NULL;
+}
+
+void tx_queue_stats(struct tx_queue *txq, struct anp_tx_queue_stats *stats)
+{
+    stats->size = txq->ring->size;
+    stats->enqueued = __atomic_load_n(&txq->enqueued, __ATOMIC_RELAXED);
+    stats->depth = stats->enqueued - __atomic_load_n(&txq->dequeued, __ATOMIC_RELAXED);
+    stats->max_depth = __atomic_load_n(&txq->max_depth, __ATOMIC_RELAXED);
+    stats->drops = __atomic_load_n(&txq->drops, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&txq->errors, __ATOMIC_RELAXED);
+    stats->bursts = __atomic_load_n(&txq->bursts, __ATOMIC_RELAXED);
+    for (int i = 0; i < ANP_TX_BURST_BUCKETS; i++) {
+        stats->burst_sizes[i] = __atomic_load_n(&txq->burst_sizes[i], __ATOMIC_RELAXED);
+    }
+}
+
+// frames still on the queue are freed with it
+void tx_queue_free(struct tx_queue *txq)
+{
+    struct subuff *sub;
+
+    while (NULL != (sub = mpsc_ring_pop(txq->ring))) {
+        free_sub(sub);
+    }
+    close(txq->wake_fd);
+    free(txq->ring->slots);
+    free(txq->ring);
+    free(txq);
+}
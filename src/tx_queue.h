@@ -0,0 +1,34 @@
+#ifndef ANPNETSTACK_TX_QUEUE_H
+#define ANPNETSTACK_TX_QUEUE_H
+
+#include "systems_headers.h"
+#include "subuff.h"
+#include "anpnetstack.h"
+
+struct anp_netdev;
+struct mpsc_ring;
+
+// frames on their way to a device, any thread enqueues, the device's TX thread sends them
+struct tx_queue {
+    struct anp_netdev *dev;
+    struct mpsc_ring *ring;
+    // the TX thread sleeps on this when the queue is empty, producers only ring it then
+    int wake_fd;
+    int sleeping;
+    // statistics, see struct anp_tx_queue_stats
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t drops;
+    uint64_t errors;
+    uint64_t bursts;
+    uint64_t burst_sizes[ANP_TX_BURST_BUCKETS];
+    uint32_t max_depth;
+};
+
+struct tx_queue *tx_queue_alloc(struct anp_netdev *dev, uint32_t size);
+int tx_queue_push(struct tx_queue *txq, struct subuff *sub);
+void *tx_queue_loop(void *arg);
+void tx_queue_stats(struct tx_queue *txq, struct anp_tx_queue_stats *stats);
+void tx_queue_free(struct tx_queue *txq);
+
+#endif //ANPNETSTACK_TX_QUEUE_H
@@ -0,0 +1,149 @@
+/*
+ * Just enough of io_uring for the tap backend, following the io_uring(7) man page and
+ * https://kernel.dk/io_uring.pdf. Every struct uring is only used by one thread at a time.
+ */
+
+#include "uring.h"
+#include "utilities.h"
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+int uring_init(struct uring *ring, unsigned sq_entries, unsigned cq_entries)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    ring->fd = syscall(__NR_io_uring_setup, sq_entries, &p);
+    if (0 > ring->fd) {
+        printf("Error: io_uring_setup failed, errno %d \n", errno);
+        return -errno;
+    }
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // since 5.4 both rings come with one mmap()
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_map_len = ANP_MAX(ring->sq_map_len, ring->cq_map_len);
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sq_map) {
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == ring->cq_map) {
+            munmap(ring->sq_map, ring->sq_map_len);
+            goto error;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes) {
+        if (ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_len);
+        }
+        munmap(ring->sq_map, ring->sq_map_len);
+        goto error;
+    }
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = ring->sq_map + p.sq_off.head;
+    ring->sq_tail = ring->sq_map + p.sq_off.tail;
+    ring->sq_mask = ring->sq_map + p.sq_off.ring_mask;
+    ring->sq_array = ring->sq_map + p.sq_off.array;
+    ring->cq_entries = p.cq_entries;
+    ring->cq_head = ring->cq_map + p.cq_off.head;
+    ring->cq_tail = ring->cq_map + p.cq_off.tail;
+    ring->cq_mask = ring->cq_map + p.cq_off.ring_mask;
+    ring->cqes = ring->cq_map + p.cq_off.cqes;
+    return 0;
+
+error:
+    printf("Error: could not map the io_uring rings, errno %d \n", errno);
+    close(ring->fd);
+    return -ENOMEM;
+}
+
+// a zeroed sqe at the tail of the submission queue, NULL when it is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned tail = ring->sqe_tail;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/*
+ * Submits the pending sqes and waits until wait_nr completions are there, for at most
+ * timeout_msec (< 0 waits without a limit). Returns the number of sqes submitted or -errno,
+ * -ETIME when the timeout expired.
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr, int timeout_msec)
+{
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_msec / 1000,
+        .tv_nsec = (timeout_msec % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t) (uintptr_t) &ts };
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (wait_nr > 0 && timeout_msec >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    // the kernel reads the sqes once it sees the new tail, what it does not consume in this
+    // call stays queued for the next one
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, argp, argsz);
+    return 0 > ret ? -errno : ret;
+}
+
+// the oldest completion, NULL when there is none
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register(struct uring *ring, unsigned opcode, void *arg, unsigned nr_args)
+{
+    int ret = syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args);
+    return 0 > ret ? -errno : ret;
+}
+
+void uring_free(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
@@ -0,0 +1,41 @@
+#ifndef ANPNETSTACK_URING_H
+#define ANPNETSTACK_URING_H
+
+#include "systems_headers.h"
+#include <linux/io_uring.h>
+
+// the uapi headers we build against can predate it (linux 6.7)
+#define ANP_IORING_OP_READ_MULTISHOT 49
+
+// The rings of one io_uring instance, set up with the raw system calls (no liburing).
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned cq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // where uring_get_sqe() hands out the next sqe, the kernel sees them up to sq_tail
+    unsigned sqe_tail;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+};
+
+int uring_init(struct uring *ring, unsigned sq_entries, unsigned cq_entries);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr, int timeout_msec);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+int uring_register(struct uring *ring, unsigned opcode, void *arg, unsigned nr_args);
+void uring_free(struct uring *ring);
+
+#endif //ANPNETSTACK_URING_H
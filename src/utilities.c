@@ -63,15 +63,29 @@ uint16_t do_csum(void *addr, int count, int start_sum)
     return ~sum;
 }
 
-int do_tcp_csum(uint8_t *data, int length, uint16_t protocol, uint32_t saddr, uint32_t daddr)
+static uint32_t pseudo_hdr_sum(int length, uint16_t protocol, uint32_t saddr, uint32_t daddr)
 {
     uint32_t sum = 0;
+    saddr = htonl(saddr);
+    daddr = htonl(daddr);
 
-    sum += htonl(saddr);
-    sum += htonl(daddr);
+    // 16 bits at a time, adding the 32 bit addresses whole can overflow the sum
+    sum += (saddr >> 16) + (saddr & 0xffff);
+    sum += (daddr >> 16) + (daddr & 0xffff);
     sum += htons(protocol);
     sum += htons(length);
-    return do_csum(data, length, sum);
+    return sum;
+}
+
+int do_tcp_csum(uint8_t *data, int length, uint16_t protocol, uint32_t saddr, uint32_t daddr)
+{
+    return do_csum(data, length, pseudo_hdr_sum(length, protocol, saddr, daddr));
+}
+
+uint16_t do_pseudo_csum(int length, uint16_t protocol, uint32_t saddr, uint32_t daddr)
+{
+    // folded but not inverted, this is the seed of a CHECKSUM_PARTIAL checksum field
+    return ~do_csum(NULL, 0, pseudo_hdr_sum(length, protocol, saddr, daddr));
 }
 
 uint32_t ip_str_to_n32(const char *addr){
@@ -0,0 +1,403 @@
+/*
+ * The AF_XDP backend, on the same veth pair as the packet backend. A tiny XDP program on
+ * the stack's end redirects every frame into the XSK socket of its rx queue. The socket
+ * runs in generic (SKB, copy) mode, so any device will do, the veth included.
+ * The rx frames of the UMEM are the buffers of the queue's rx_ring: a received frame is
+ * handed up as the subuff of its chunk and ip_rx()/tcp_rx() work on it where the kernel
+ * wrote it. Once free_sub() puts it back into the ring it goes to the fill ring again.
+ * https://www.kernel.org/doc/html/latest/networking/af_xdp.html
+ */
+
+#include "xdp_netdev.h"
+#include "packet_netdev.h"
+#include "utilities.h"
+#include "config.h"
+#include "rx_ring.h"
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#define XDP_RX_FRAMES ANP_RX_RING_SIZE
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Loads and attaches (SKB mode)
+ *     return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ * which is all we need, so no libbpf/clang. Frames for a queue without a socket take the
+ * normal path. The program goes away with link_fd.
+ */
+static int xdp_attach_prog(struct xdp_netdev *xdev)
+{
+    union bpf_attr attr;
+    struct bpf_insn prog[] = {
+        // r2 = ctx->rx_queue_index
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+          .off = offsetof(struct xdp_md, rx_queue_index) },
+        // r1 = &xsks (two instruction wide immediate)
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD,
+          .imm = xdev->map_fd },
+        { 0 },
+        // r3 = XDP_PASS, the action when there is no socket
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+
+    _clear_var(attr);
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t) (uintptr_t) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t) (uintptr_t) "GPL";
+    xdev->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (0 > xdev->prog_fd) {
+        printf("ERR: could not load the xdp program, errno %d \n", errno);
+        return -errno;
+    }
+    _clear_var(attr);
+    attr.link_create.prog_fd = xdev->prog_fd;
+    attr.link_create.target_ifindex = xdev->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    xdev->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (0 > xdev->link_fd) {
+        printf("ERR: could not attach the xdp program to %s, errno %d \n", ANP_PACKET_IFNAME, errno);
+        return -errno;
+    }
+    return 0;
+}
+
+static int xdp_create_map(struct xdp_netdev *xdev, int queues)
+{
+    union bpf_attr attr;
+
+    _clear_var(attr);
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queues;
+    xdev->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (0 > xdev->map_fd) {
+        printf("ERR: could not create the xsk map, errno %d \n", errno);
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Generic XDP hands the frame over as it is, a partial checksum (CHECKSUM_PARTIAL) from the
+ * kernel end would stay unfinished. Without tx checksumming the peer also stops doing TSO,
+ * so what reaches us is segmented and fits a UMEM chunk.
+ */
+static void xdp_peer_csum_off()
+{
+    struct ethtool_value ev = { .cmd = ETHTOOL_STXCSUM, .data = 0 };
+    struct ifreq ifr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    _clear_var(ifr);
+    strncpy(ifr.ifr_name, ANP_PACKET_PEER, IFNAMSIZ - 1);
+    ifr.ifr_data = (void *) &ev;
+    if (0 > fd || 0 > ioctl(fd, SIOCETHTOOL, &ifr)) {
+        printf("WARN: could not turn off tx checksumming on %s, errno %d \n", ANP_PACKET_PEER, errno);
+    }
+    if (0 <= fd) {
+        close(fd);
+    }
+}
+
+static int xsk_map_ring(struct xsk_ring *r, int fd, struct xdp_ring_offset *off, off_t pgoff,
+                        uint32_t size, size_t desc_size)
+{
+    r->map_len = off->desc + size * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (MAP_FAILED == r->map) {
+        r->map = NULL;
+        return -errno;
+    }
+    r->producer = (uint32_t *) ((uint8_t *) r->map + off->producer);
+    r->consumer = (uint32_t *) ((uint8_t *) r->map + off->consumer);
+    r->descs = (uint8_t *) r->map + off->desc;
+    r->size = size;
+    return 0;
+}
+
+static int xdp_open_queue(struct anp_netdev *dev, struct xdp_netdev *xdev, int queue)
+{
+    struct xdp_queue *xq = &xdev->queues[queue];
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    int rx_size = XDP_RX_FRAMES, tx_size = ANP_XDP_TX_FRAMES;
+    union bpf_attr attr;
+
+    xq->umem_len = (size_t) (XDP_RX_FRAMES + ANP_XDP_TX_FRAMES) * ANP_XDP_FRAME_SIZE;
+    xq->umem = mmap(NULL, xq->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == xq->umem) {
+        return -ENOMEM;
+    }
+    xq->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (0 > xq->fd) {
+        printf("ERR: could not open an xdp socket, errno %d \n", errno);
+        return -errno;
+    }
+    struct xdp_umem_reg reg = {
+        .addr = (uint64_t) (uintptr_t) xq->umem,
+        .len = xq->umem_len,
+        .chunk_size = ANP_XDP_FRAME_SIZE,
+        .headroom = 0,
+    };
+    // the fill ring holds at most all rx frames, the completion ring all tx frames
+    if (0 > setsockopt(xq->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg))
+        || 0 > setsockopt(xq->fd, SOL_XDP, XDP_UMEM_FILL_RING, &rx_size, sizeof(rx_size))
+        || 0 > setsockopt(xq->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &tx_size, sizeof(tx_size))
+        || 0 > setsockopt(xq->fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size))
+        || 0 > setsockopt(xq->fd, SOL_XDP, XDP_TX_RING, &tx_size, sizeof(tx_size))
+        || 0 > getsockopt(xq->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        printf("ERR: could not set up the umem and xdp rings, errno %d \n", errno);
+        return -errno;
+    }
+    if (0 > xsk_map_ring(&xq->fill, xq->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, rx_size, sizeof(uint64_t))
+        || 0 > xsk_map_ring(&xq->comp, xq->fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, tx_size, sizeof(uint64_t))
+        || 0 > xsk_map_ring(&xq->rx, xq->fd, &off.rx, XDP_PGOFF_RX_RING, rx_size, sizeof(struct xdp_desc))
+        || 0 > xsk_map_ring(&xq->tx, xq->fd, &off.tx, XDP_PGOFF_TX_RING, tx_size, sizeof(struct xdp_desc))) {
+        printf("ERR: could not mmap the xdp rings, errno %d \n", errno);
+        return -errno;
+    }
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = xdev->ifindex,
+        .sxdp_queue_id = queue,
+        .sxdp_flags = XDP_COPY,
+    };
+    if (0 > bind(xq->fd, (struct sockaddr *) &sxdp, sizeof(sxdp))) {
+        printf("ERR: could not bind the xdp socket to %s queue %d, errno %d \n", ANP_PACKET_IFNAME, queue, errno);
+        return -errno;
+    }
+    uint32_t key = queue, value = xq->fd;
+    _clear_var(attr);
+    attr.map_fd = xdev->map_fd;
+    attr.key = (uint64_t) (uintptr_t) &key;
+    attr.value = (uint64_t) (uintptr_t) &value;
+    attr.flags = BPF_ANY;
+    if (0 > sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+        printf("ERR: could not add the xdp socket to the xsk map, errno %d \n", errno);
+        return -errno;
+    }
+
+    dev->rx_rings[queue] = rx_ring_alloc_on(XDP_RX_FRAMES, ANP_XDP_FRAME_SIZE, xq->umem);
+    if (!dev->rx_rings[queue]) {
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < ANP_XDP_TX_FRAMES; i++) {
+        xq->tx_free[i] = (uint64_t) (XDP_RX_FRAMES + i) * ANP_XDP_FRAME_SIZE;
+    }
+    xq->tx_free_count = ANP_XDP_TX_FRAMES;
+    pthread_mutex_init(&xq->tx_lock, NULL);
+    return 0;
+}
+
+static int xdp_open(struct anp_netdev *dev)
+{
+    struct xdp_netdev *xdev = calloc(sizeof(struct xdp_netdev), 1);
+    struct ifreq ifr;
+    int ret;
+
+    if (NULL == xdev) {
+        return -ENOMEM;
+    }
+    // a frame has to fit one chunk, behind the headroom the kernel keeps in front of it
+    if (ANP_FRAME_SIZE(dev->mtu) > ANP_XDP_FRAME_SIZE - XDP_PACKET_HEADROOM) {
+        uint32_t mtu = ANP_XDP_FRAME_SIZE - XDP_PACKET_HEADROOM - ANP_FRAME_SIZE(0);
+        printf("WARN: mtu %u does not fit an xdp chunk, using %u \n", dev->mtu, mtu);
+        dev->mtu = mtu;
+    }
+    ret = packet_setup_veth(dev->mtu);
+    if (0 != ret) {
+        free(xdev);
+        return ret;
+    }
+    xdp_peer_csum_off();
+    _clear_var(ifr);
+    strncpy(ifr.ifr_name, ANP_PACKET_IFNAME, IFNAMSIZ - 1);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (0 > fd || 0 > ioctl(fd, SIOCGIFINDEX, &ifr)) {
+        printf("ERR: no such device %s, errno %d \n", ANP_PACKET_IFNAME, errno);
+        free(xdev);
+        return -ENODEV;
+    }
+    close(fd);
+    xdev->ifindex = ifr.ifr_ifindex;
+    // generic XDP on a veth sees everything on rx queue 0, more sockets would stay idle
+    xdev->num_queues = 1;
+
+    ret = xdp_create_map(xdev, xdev->num_queues);
+    if (0 == ret) {
+        ret = xdp_open_queue(dev, xdev, 0);
+    }
+    // the sockets are in the map before the program can redirect to them
+    if (0 == ret) {
+        ret = xdp_attach_prog(xdev);
+    }
+    if (0 != ret) {
+        return ret;
+    }
+    dev->priv = xdev;
+    dev->num_queues = xdev->num_queues;
+    // checksums, segmentation and reassembly are all ours, frames are at most one chunk
+    dev->features = 0;
+    dev->rx_buf_size = ANP_XDP_FRAME_SIZE;
+    return 0;
+}
+
+// hands the free rx frames to the kernel to receive into
+static void xdp_refill(struct xdp_queue *xq, struct rx_ring *ring)
+{
+    uint32_t prod = *xq->fill.producer;
+    uint32_t room = xq->fill.size - (prod - __atomic_load_n(xq->fill.consumer, __ATOMIC_ACQUIRE));
+    uint64_t *addrs = xq->fill.descs;
+    struct subuff *sub;
+    uint32_t n = 0;
+
+    while (n < room && NULL != (sub = rx_ring_try_get(ring))) {
+        addrs[(prod + n) & (xq->fill.size - 1)] = sub->head - xq->umem;
+        n++;
+    }
+    if (n > 0) {
+        __atomic_store_n(xq->fill.producer, prod + n, __ATOMIC_RELEASE);
+    }
+}
+
+static int xdp_rx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int max)
+{
+    struct xdp_netdev *xdev = dev->priv;
+    struct xdp_queue *xq = &xdev->queues[queue];
+    struct rx_ring *ring = dev->rx_rings[queue];
+    struct xdp_desc *descs = xq->rx.descs;
+    uint32_t cons = *xq->rx.consumer;
+    uint32_t avail, n;
+
+    xdp_refill(xq, ring);
+    avail = __atomic_load_n(xq->rx.producer, __ATOMIC_ACQUIRE) - cons;
+    if (0 == avail) {
+        struct pollfd pfd = { .fd = xq->fd, .events = POLLIN };
+        if (0 > poll(&pfd, 1, ANP_RX_POLL_MSEC) && errno != EINTR) {
+            return -errno;
+        }
+        avail = __atomic_load_n(xq->rx.producer, __ATOMIC_ACQUIRE) - cons;
+    }
+    n = ANP_MIN(avail, (uint32_t) max);
+    for (uint32_t i = 0; i < n; i++) {
+        struct xdp_desc *desc = &descs[(cons + i) & (xq->rx.size - 1)];
+        // the chunk the frame is in is the descriptor it was posted with, the frame itself
+        // starts XDP_PACKET_HEADROOM into it and the stack expects it at head
+        struct subuff *sub = &ring->descs[desc->addr / ANP_XDP_FRAME_SIZE];
+        sub->head = xq->umem + desc->addr;
+        sub->data = sub->head;
+        sub->len = desc->len;
+        subs[i] = sub;
+    }
+    if (n > 0) {
+        __atomic_store_n(xq->rx.consumer, cons + n, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+// tx frames the kernel is done with
+static void xdp_reclaim_tx(struct xdp_queue *xq)
+{
+    uint32_t cons = *xq->comp.consumer;
+    uint32_t avail = __atomic_load_n(xq->comp.producer, __ATOMIC_ACQUIRE) - cons;
+    uint64_t *addrs = xq->comp.descs;
+
+    for (uint32_t i = 0; i < avail; i++) {
+        xq->tx_free[xq->tx_free_count++] = addrs[(cons + i) & (xq->comp.size - 1)];
+    }
+    if (avail > 0) {
+        __atomic_store_n(xq->comp.consumer, cons + avail, __ATOMIC_RELEASE);
+    }
+}
+
+// copy mode needs a syscall to get the tx ring going
+static int xdp_kick_tx(struct xdp_queue *xq)
+{
+    if (0 > sendto(xq->fd, NULL, 0, MSG_DONTWAIT, NULL, 0)
+        && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int xdp_tx_burst(struct anp_netdev *dev, int queue, struct subuff **subs, int count)
+{
+    struct xdp_netdev *xdev = dev->priv;
+    struct xdp_queue *xq = &xdev->queues[queue % xdev->num_queues];
+    struct xdp_desc *descs = xq->tx.descs;
+    int i, ret = 0;
+
+    pthread_mutex_lock(&xq->tx_lock);
+    xdp_reclaim_tx(xq);
+    uint32_t prod = *xq->tx.producer;
+    for (i = 0; i < count; i++) {
+        if (0 == xq->tx_free_count) {
+            // all frames are in flight, push them out and see what came back
+            if (0 == i) {
+                ret = xdp_kick_tx(xq);
+                xdp_reclaim_tx(xq);
+            }
+            if (0 == xq->tx_free_count) {
+                ret = ret ? ret : -EAGAIN;
+                break;
+            }
+        }
+        if (subs[i]->len > ANP_XDP_FRAME_SIZE) {
+            printf("Error: frame of %u bytes does not fit an xdp frame \n", subs[i]->len);
+            ret = -EMSGSIZE;
+            break;
+        }
+        uint64_t addr = xq->tx_free[--xq->tx_free_count];
+        sub_copy_bits(subs[i], 0, xq->umem + addr, subs[i]->len);
+        descs[(prod + i) & (xq->tx.size - 1)].addr = addr;
+        descs[(prod + i) & (xq->tx.size - 1)].len = subs[i]->len;
+        descs[(prod + i) & (xq->tx.size - 1)].options = 0;
+    }
+    if (i > 0) {
+        __atomic_store_n(xq->tx.producer, prod + i, __ATOMIC_RELEASE);
+        ret = xdp_kick_tx(xq);
+    }
+    pthread_mutex_unlock(&xq->tx_lock);
+    return (i > 0 || 0 == ret) ? i : ret;
+}
+
+static void xdp_close(struct anp_netdev *dev)
+{
+    struct xdp_netdev *xdev = dev->priv;
+
+    // detaches the program first, nothing is redirected to the sockets after this
+    close(xdev->link_fd);
+    close(xdev->prog_fd);
+    close(xdev->map_fd);
+    for (int i = 0; i < xdev->num_queues; i++) {
+        struct xdp_queue *xq = &xdev->queues[i];
+        munmap(xq->fill.map, xq->fill.map_len);
+        munmap(xq->comp.map, xq->comp.map_len);
+        munmap(xq->rx.map, xq->rx.map_len);
+        munmap(xq->tx.map, xq->tx.map_len);
+        close(xq->fd);
+        // the rx_ring still points into the umem, so that stays
+    }
+    free(xdev);
+    dev->priv = NULL;
+}
+
+const struct netdev_ops xdp_netdev_ops = {
+    .name = "xdp",
+    .open = xdp_open,
+    .rx_burst = xdp_rx_burst,
+    .tx_burst = xdp_tx_burst,
+    .close = xdp_close,
+};
@@ -0,0 +1,46 @@
+#ifndef ANPNETSTACK_XDP_NETDEV_H
+#define ANPNETSTACK_XDP_NETDEV_H
+
+#include "systems_headers.h"
+#include "config.h"
+#include "anp_netdev.h"
+
+#include <sys/mman.h>
+#include <linux/if_xdp.h>
+
+// one of the four single producer/single consumer rings shared with the kernel
+struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *descs;            // uint64_t umem addresses (fill, completion) or struct xdp_desc (rx, tx)
+    uint32_t size;          // power of two
+    void *map;
+    size_t map_len;
+};
+
+struct xdp_queue {
+    int fd;
+    // the rx part of the umem is the buffer area of the queue's rx_ring, so received
+    // frames are processed where the kernel put them
+    uint8_t *umem;
+    size_t umem_len;
+    struct xsk_ring fill, comp, rx, tx;
+    // umem addresses of the tx frames that are not with the kernel
+    uint64_t tx_free[ANP_XDP_TX_FRAMES];
+    uint32_t tx_free_count;
+    pthread_mutex_t tx_lock;
+};
+
+// the private state of the xdp backend
+struct xdp_netdev {
+    int ifindex;
+    int map_fd;             // XSKMAP, rx queue index -> xsk
+    int prog_fd;
+    int link_fd;            // the program stays attached as long as this is open
+    int num_queues;
+    struct xdp_queue queues[ANP_NETDEV_QUEUES];
+};
+
+extern const struct netdev_ops xdp_netdev_ops;
+
+#endif //ANPNETSTACK_XDP_NETDEV_H
@@ -0,0 +1,210 @@
+/*
+ * Completion notification for send(..., MSG_ZEROCOPY). The segments of such a send point
+ * into the application's buffer instead of a copy of it, and the buffer must stay as it is
+ * until the last of them is acked and off the tx queue. Every send gets an id, like on Linux
+ * the ids of completed sends are reported in ranges, anp_zerocopy_completion() hands them
+ * out. https://www.kernel.org/doc/html/latest/networking/msg_zerocopy.html
+ *
+ * sendfile() sends from a mapping of the file the same way, and unmaps it when done.
+ */
+
+#include "zerocopy.h"
+#include "sock.h"
+#include "anpnetstack.h"
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <linux/errqueue.h>
+
+struct zc_queue *zc_queue_alloc()
+{
+    struct zc_queue *queue = calloc(1, sizeof(*queue));
+
+    if (!queue) {
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    list_init(&queue->ranges);
+    queue->refcnt = 1;
+    return queue;
+}
+
+void zc_queue_put(struct zc_queue *queue)
+{
+    struct list_head *item, *tmp;
+
+    if (!queue || __atomic_sub_fetch(&queue->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    list_for_each_safe(item, tmp, &queue->ranges) {
+        list_del(item);
+        free(list_entry(item, struct zc_range, list));
+    }
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+// the oldest range of completed sends, 0 when there is none
+int zc_queue_pop(struct zc_queue *queue, uint32_t *lo, uint32_t *hi)
+{
+    struct zc_range *range = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (!list_empty(&queue->ranges)) {
+        range = list_first_entry(&queue->ranges, struct zc_range, list);
+        list_del(&range->list);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (!range) {
+        return 0;
+    }
+    *lo = range->lo;
+    *hi = range->hi;
+    free(range);
+    return 1;
+}
+
+static void zc_complete(struct zc_queue *queue, uint32_t id)
+{
+    struct zc_range *last = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (!list_empty(&queue->ranges)) {
+        last = list_entry(queue->ranges.prev, struct zc_range, list);
+    }
+    if (last && last->hi + 1 == id) {
+        last->hi = id;
+    } else {
+        struct zc_range *range = malloc(sizeof(*range));
+        if (range) {
+            range->lo = range->hi = id;
+            list_add_tail(&range->list, &queue->ranges);
+        } else {
+            printf("Error: lost the completion of zero copy send %u \n", id);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// the caller holds the first reference, the send is complete when the last one is gone. It
+// gets its id from zc_take_id() once something is queued.
+struct sub_zc *zc_alloc(struct zc_queue *queue)
+{
+    struct sub_zc *zc = malloc(sizeof(*zc));
+
+    if (!zc) {
+        return NULL;
+    }
+    zc->refcnt = 1;
+    zc->queue = queue;
+    zc->map = NULL;
+    zc->map_len = 0;
+    zc->has_id = false;
+    __atomic_add_fetch(&queue->refcnt, 1, __ATOMIC_RELAXED);
+    return zc;
+}
+
+// called while the caller still holds its reference, so no segment completes it before
+void zc_take_id(struct sub_zc *zc)
+{
+    if (!zc->queue || zc->has_id) {
+        return;
+    }
+    pthread_mutex_lock(&zc->queue->lock);
+    zc->id = zc->queue->next_id++;
+    pthread_mutex_unlock(&zc->queue->lock);
+    zc->has_id = true;
+}
+
+// takes over the mapping, it is unmapped with the last reference
+struct sub_zc *zc_alloc_map(void *map, size_t map_len)
+{
+    struct sub_zc *zc = calloc(1, sizeof(*zc));
+
+    if (!zc) {
+        return NULL;
+    }
+    zc->refcnt = 1;
+    zc->map = map;
+    zc->map_len = map_len;
+    return zc;
+}
+
+struct sub_zc *zc_get(struct sub_zc *zc)
+{
+    if (zc) {
+        __atomic_add_fetch(&zc->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    return zc;
+}
+
+void zc_put(struct sub_zc *zc)
+{
+    if (!zc || __atomic_sub_fetch(&zc->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (zc->queue) {
+        if (zc->has_id) {
+            zc_complete(zc->queue, zc->id);
+        }
+        zc_queue_put(zc->queue);
+    }
+    if (zc->map) {
+        munmap(zc->map, zc->map_len);
+    }
+    free(zc);
+}
+
+int anp_zerocopy_completion(int fd, uint32_t *lo, uint32_t *hi)
+{
+    struct sock *sock = get_sock_by_fd(fd);
+    int ret = 0;
+
+    if (!sock || !lo || !hi) {
+        errno = sock ? EINVAL : EBADF;
+        return -1;
+    }
+    pthread_rwlock_rdlock(&sock->rwlock);
+    if (sock->zc_queue) {
+        ret = zc_queue_pop(sock->zc_queue, lo, hi);
+    }
+    pthread_rwlock_unlock(&sock->rwlock);
+    return ret;
+}
+
+/*
+ * recvmsg(..., MSG_ERRQUEUE) as Linux has it for MSG_ZEROCOPY, one range of completed ids
+ * per call in a sock_extended_err of origin SO_EE_ORIGIN_ZEROCOPY. EAGAIN when none is left.
+ */
+int zc_recv_errqueue(struct sock *sock, struct msghdr *msg)
+{
+    struct sock_extended_err ee = {.ee_origin = SO_EE_ORIGIN_ZEROCOPY};
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&sock->rwlock);
+    if (sock->zc_queue) {
+        ret = zc_queue_pop(sock->zc_queue, &ee.ee_info, &ee.ee_data);
+    }
+    pthread_rwlock_unlock(&sock->rwlock);
+    if (ret <= 0) {
+        sock->err = EAGAIN;
+        return -1;
+    }
+
+    msg->msg_namelen = 0;
+    msg->msg_flags = MSG_ERRQUEUE;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+    if (!cm || msg->msg_controllen < CMSG_LEN(sizeof(ee))) {
+        // like Linux, the range is gone all the same
+        msg->msg_flags |= MSG_CTRUNC;
+        msg->msg_controllen = 0;
+        return 0;
+    }
+    cm->cmsg_level = SOL_IP;
+    cm->cmsg_type = IP_RECVERR;
+    cm->cmsg_len = CMSG_LEN(sizeof(ee));
+    memcpy(CMSG_DATA(cm), &ee, sizeof(ee));
+    if (msg->msg_controllen > CMSG_SPACE(sizeof(ee))) {
+        msg->msg_controllen = CMSG_SPACE(sizeof(ee));
+    }
+    return 0;
+}
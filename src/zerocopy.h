@@ -0,0 +1,46 @@
+#ifndef ANPNETSTACK_ZEROCOPY_H
+#define ANPNETSTACK_ZEROCOPY_H
+
+#include "systems_headers.h"
+#include "linklist.h"
+
+// the zero copy sends of a socket that completed, the socket and every pending send hold a
+// reference, so it outlives whichever of them goes first
+struct zc_queue {
+    pthread_mutex_t lock;
+    int refcnt;
+    struct list_head ranges;
+    uint32_t next_id;
+};
+
+// completed sends lo..hi, consecutive ids are merged into one range
+struct zc_range {
+    struct list_head list;
+    uint32_t lo;
+    uint32_t hi;
+};
+
+// one MSG_ZEROCOPY send(), every subuff that points into its buffer holds a reference.
+// A sendfile() has no id and no queue, its buffer is the mapping of the file instead.
+struct sub_zc {
+    int refcnt;
+    uint32_t id;
+    bool has_id;  // a send that queued nothing takes no id and completes nothing
+    struct zc_queue *queue;
+    void *map;
+    size_t map_len;
+};
+
+struct zc_queue *zc_queue_alloc();
+void zc_queue_put(struct zc_queue *queue);
+int zc_queue_pop(struct zc_queue *queue, uint32_t *lo, uint32_t *hi);
+struct sub_zc *zc_alloc(struct zc_queue *queue);
+struct sub_zc *zc_alloc_map(void *map, size_t map_len);
+void zc_take_id(struct sub_zc *zc);
+struct sub_zc *zc_get(struct sub_zc *zc);
+void zc_put(struct sub_zc *zc);
+
+struct sock;
+int zc_recv_errqueue(struct sock *sock, struct msghdr *msg);
+
+#endif //ANPNETSTACK_ZEROCOPY_H